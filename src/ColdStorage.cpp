@@ -0,0 +1,152 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <filesystem>
+
+#include "golpe.h"
+
+#include "ColdStorage.h"
+
+
+ColdStorage coldStorage;
+
+
+static std::string segmentPath(const std::string &dir, uint32_t segmentId) {
+    return dir + "/" + std::to_string(segmentId) + ".seg";
+}
+
+
+std::string ColdStorage::coldDir(MDB_env *e) {
+    const char *path;
+    if (mdb_env_get_path(e, &path)) throw herr("unable to get LMDB env path");
+    return std::string(path) + "/cold";
+}
+
+int ColdStorage::getFd(MDB_env *e, uint32_t segmentId) {
+    std::lock_guard<std::mutex> guard(mutex);
+
+    auto key = std::make_pair(e, segmentId);
+
+    auto it = fds.find(key);
+    if (it != fds.end()) return it->second;
+
+    auto path = segmentPath(coldDir(e), segmentId);
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) throw herr("unable to open cold segment ", path, ": ", strerror(errno));
+
+    fds[key] = fd;
+    return fd;
+}
+
+std::string_view ColdStorage::read(lmdb::txn &txn, std::string_view stub, std::string &buf) {
+    if (stub.size() != StubSize) throw herr("bad cold EventPayload stub");
+
+    uint32_t segmentId = lmdb::from_sv<uint32_t>(stub.substr(1, 4));
+    uint64_t offset = lmdb::from_sv<uint64_t>(stub.substr(5, 8));
+    uint32_t size = lmdb::from_sv<uint32_t>(stub.substr(13, 4));
+
+    int fd = getFd(mdb_txn_env(txn.handle()), segmentId);
+
+    buf.resize(size);
+
+    size_t done = 0;
+
+    while (done < size) {
+        auto ret = ::pread(fd, buf.data() + done, size - done, offset + done);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            throw herr("error reading cold segment: ", strerror(errno));
+        }
+        if (ret == 0) throw herr("cold segment truncated");
+        done += ret;
+    }
+
+    return std::string_view(buf.data(), size);
+}
+
+
+ColdStorage::Writer::Writer(MDB_env *e, uint64_t maxSegmentBytes) : dir(coldDir(e)), maxSegmentBytes(maxSegmentBytes) {
+    std::filesystem::create_directories(dir);
+
+    // Continue appending to the newest segment
+
+    uint32_t newest = 0;
+
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        if (entry.path().extension() != ".seg") continue;
+        try {
+            newest = std::max(newest, (uint32_t)std::stoul(entry.path().stem().string()));
+        } catch (...) {}
+    }
+
+    openSegment(newest == 0 ? 1 : newest);
+}
+
+ColdStorage::Writer::~Writer() {
+    if (fd != -1) ::close(fd);
+}
+
+void ColdStorage::Writer::openSegment(uint32_t id) {
+    if (fd != -1) {
+        sync();
+        ::close(fd);
+    }
+
+    auto path = segmentPath(dir, id);
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) throw herr("unable to open cold segment ", path, ": ", strerror(errno));
+
+    auto end = ::lseek(fd, 0, SEEK_END);
+    if (end < 0) throw herr("unable to seek cold segment ", path, ": ", strerror(errno));
+
+    segmentId = id;
+    segmentSize = end;
+}
+
+std::string ColdStorage::Writer::append(uint64_t levId, std::string_view record) {
+    if (segmentSize > 0 && segmentSize + RecordHeaderSize + record.size() > maxSegmentBytes) openSegment(segmentId + 1);
+
+    std::string buf;
+    buf += lmdb::to_sv<uint64_t>(levId);
+    buf += lmdb::to_sv<uint32_t>(record.size());
+    buf += record;
+
+    size_t done = 0;
+
+    while (done < buf.size()) {
+        auto ret = ::write(fd, buf.data() + done, buf.size() - done);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            int err = errno;
+
+            // Drop any partially written record, so the offsets of later records stay correct
+            if (::ftruncate(fd, segmentSize)) {
+                auto end = ::lseek(fd, 0, SEEK_END);
+                if (end < 0) throw herr("unable to recover cold segment after write error: ", strerror(errno));
+                segmentSize = end;
+            }
+
+            throw herr("error writing cold segment: ", strerror(err));
+        }
+        done += ret;
+    }
+
+    uint64_t offset = segmentSize + RecordHeaderSize;
+    segmentSize += buf.size();
+
+    std::string stub;
+    stub += '\x03';
+    stub += lmdb::to_sv<uint32_t>(segmentId);
+    stub += lmdb::to_sv<uint64_t>(offset);
+    stub += lmdb::to_sv<uint32_t>(record.size());
+
+    return stub;
+}
+
+void ColdStorage::Writer::sync() {
+    if (::fsync(fd)) throw herr("error syncing cold segment: ", strerror(errno));
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "golpe.h"
+
+
+// Cold tier for event payloads
+//
+// Old payloads can be moved out of LMDB into append-only segment files in a "cold" directory
+// next to the DB's data.mdb. Their EventPayload records are replaced with a small stub, so
+// EventPayload itself acts as the levId -> (segment, offset) index:
+//
+//   0x03, segmentId (native endian uint32), offset (native endian uint64), size (native endian uint32)
+//
+// Each record in a segment is the levId (native endian uint64), the size (native endian uint32),
+// and then the original EventPayload record (compressed unless that made it bigger). Records
+// are never rewritten, so space used by deleted events is not reclaimed.
+
+struct ColdStorage {
+    static constexpr size_t StubSize = 1 + 4 + 8 + 4;
+    static constexpr size_t RecordHeaderSize = 8 + 4;
+
+    // Reads the EventPayload record that a stub points to into buf, and returns a view of it
+    std::string_view read(lmdb::txn &txn, std::string_view stub, std::string &buf);
+
+    static std::string coldDir(MDB_env *e);
+
+    // Appends to the newest segment of one DB. Only one Writer per DB should exist at a time.
+    struct Writer : NonCopyable {
+        Writer(MDB_env *e, uint64_t maxSegmentBytes);
+        ~Writer();
+
+        // Returns the stub to store in EventPayload once sync() has succeeded
+        std::string append(uint64_t levId, std::string_view record);
+
+        void sync();
+
+      private:
+        std::string dir;
+        uint64_t maxSegmentBytes;
+        uint32_t segmentId = 0;
+        uint64_t segmentSize = 0;
+        int fd = -1;
+
+        void openSegment(uint32_t id);
+    };
+
+  private:
+    std::mutex mutex;
+    flat_hash_map<std::pair<MDB_env*, uint32_t>, int> fds;
+
+    int getFd(MDB_env *e, uint32_t segmentId);
+};
+
+extern ColdStorage coldStorage;
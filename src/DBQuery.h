@@ -5,6 +5,7 @@
 #include "Subscription.h"
 #include "filters.h"
 #include "events.h"
+#include "Metrics.h"
 
 
 struct DBScan : NonCopyable {
@@ -94,6 +95,7 @@ struct DBScan : NonCopyable {
     bool indexOnly;
     lmdb::dbi indexDbi;
     const char *desc = "?";
+    metrics::Counter workMetric = metrics::Counter::ScanWorkCreatedAt;
     std::vector<ScanCursor> cursors;
     std::deque<CandidateEvent> eventQueue; // sorted descending by created
     uint64_t initialScanDepth;
@@ -107,6 +109,7 @@ struct DBScan : NonCopyable {
         if (f.ids) {
             indexDbi = env.dbi_Event__id;
             desc = "ID";
+            workMetric = metrics::Counter::ScanWorkId;
 
             cursors.reserve(f.ids->size());
             for (uint64_t i = 0; i < f.ids->size(); i++) {
@@ -123,6 +126,7 @@ struct DBScan : NonCopyable {
         } else if (f.tags.size()) {
             indexDbi = env.dbi_Event__tag;
             desc = "Tag";
+            workMetric = metrics::Counter::ScanWorkTag;
 
             char tagName = '\0';
             {
@@ -154,6 +158,7 @@ struct DBScan : NonCopyable {
         } else if (f.authors && f.kinds && f.authors->size() * f.kinds->size() < 1'000) {
             indexDbi = env.dbi_Event__pubkeyKind;
             desc = "PubkeyKind";
+            workMetric = metrics::Counter::ScanWorkPubkeyKind;
 
             cursors.reserve(f.authors->size() * f.kinds->size());
             for (uint64_t i = 0; i < f.authors->size(); i++) {
@@ -178,6 +183,7 @@ struct DBScan : NonCopyable {
 
             indexDbi = env.dbi_Event__pubkey;
             desc = "Pubkey";
+            workMetric = metrics::Counter::ScanWorkPubkey;
 
             cursors.reserve(f.authors->size());
             for (uint64_t i = 0; i < f.authors->size(); i++) {
@@ -194,6 +200,7 @@ struct DBScan : NonCopyable {
         } else if (f.kinds) {
             indexDbi = env.dbi_Event__kind;
             desc = "Kind";
+            workMetric = metrics::Counter::ScanWorkKind;
 
             cursors.reserve(f.kinds->size());
             for (uint64_t i = 0; i < f.kinds->size(); i++) {
@@ -211,6 +218,7 @@ struct DBScan : NonCopyable {
         } else {
             indexDbi = env.dbi_Event__created_at;
             desc = "CreatedAt";
+            workMetric = metrics::Counter::ScanWorkCreatedAt;
 
             cursors.reserve(1);
             cursors.emplace_back(
@@ -285,7 +293,9 @@ struct DBQuery : NonCopyable {
 
     std::unique_ptr<DBScan> scanner;
     size_t filterGroupIndex = 0;
-    bool dead = false; // external flag
+    std::atomic<bool> dead = false; // external flag, may be set by owner while another thread runs the query
+    uint64_t stealOwner = 0; // index of owning scheduler in its QueryStealGroup
+    std::vector<uint64_t> stolenLevIds; // onEventBatch levIds found while running on another thread
     flat_hash_set<uint64_t> sentEventsFull;
     flat_hash_set<uint64_t> sentEventsCurr;
     uint64_t lastWorkChecked = 0;
@@ -337,6 +347,7 @@ struct DBQuery : NonCopyable {
 
             totalTime += currScanTime;
             totalWork += scanner->approxWork;
+            metrics::inc(sub.subdomain, scanner->workMetric, scanner->approxWork);
 
             if (logMetrics) {
                 LI << "[" << sub.connId << "] REQ='" << sub.subId.sv() << "'"
@@ -377,3 +388,91 @@ inline void foreachByFilter(lmdb::txn &txn, const tao::json::value &filter, cons
         cb(levId);
     });
 }
+
+
+// Negentropy storage needs (created_at, id) for every event matching a filter. Only the id index
+// has both in its keys, so when the filters constrain nothing but times, and match a large part
+// of the DB, scanning that index sequentially beats running a query and looking up every event.
+//
+// This is decided before any query runs, so that levIds are never collected on that path: no
+// filter limit may apply (it's at least the number of events in the DB), and the created_at index
+// must have matches for at least 1/8 of the DB. Counting stops once that many are found.
+
+inline bool canScanNegentropyIndex(lmdb::txn &txn, const NostrFilterGroup &filterGroup) {
+    MDB_stat stat;
+    if (mdb_stat(txn.handle(), env.dbi_Event__id, &stat)) throw herr("mdb_stat failed");
+
+    uint64_t numEvents = stat.ms_entries;
+    if (numEvents == 0 || filterGroup.size() == 0) return false;
+
+    for (const auto &f : filterGroup.filters) {
+        if (f.neverMatch || !f.isFullDbQuery() || f.limit < numEvents) return false;
+    }
+
+    uint64_t threshold = (numEvents + 7) / 8;
+    uint64_t matches = 0;
+
+    for (const auto &f : filterGroup.filters) {
+        env.generic_foreachFull(txn, env.dbi_Event__created_at, lmdb::to_sv<uint64_t>(f.since), lmdb::to_sv<uint64_t>(0), [&](auto k, auto v) {
+            if (lmdb::from_sv<uint64_t>(k) > f.until) return false;
+            return ++matches < threshold;
+        });
+
+        if (matches >= threshold) return true;
+    }
+
+    return false;
+}
+
+// Calls cb(created_at, id) for the events matching filterGroup, from the id index. Only for
+// filters that canScanNegentropyIndex() accepted. Events after latestEventId are skipped.
+
+inline void foreachNegentropyIndexItem(lmdb::txn &txn, const NostrFilterGroup &filterGroup, uint64_t latestEventId, const std::function<void(uint64_t, std::string_view)> &cb) {
+    env.generic_foreachFull(txn, env.dbi_Event__id, std::string(32, '\0'), lmdb::to_sv<uint64_t>(0), [&](auto k, auto v) {
+        ParsedKey_StringUint64 parsedKey(k);
+
+        if (lmdb::from_sv<uint64_t>(v) <= latestEventId) {
+            for (const auto &f : filterGroup.filters) {
+                if (f.doesMatchTimes(parsedKey.n)) {
+                    cb(parsedKey.n, parsedKey.s);
+                    break;
+                }
+            }
+        }
+
+        return true;
+    });
+}
+
+// Calls cb(created_at, id) for the levIds collected from a DBQuery, reading the events in levId
+// order. levIds gets sorted.
+
+inline void foreachNegentropyItem(lmdb::txn &txn, std::vector<uint64_t> &levIds, const std::function<void(uint64_t, std::string_view)> &cb) {
+    if (levIds.empty()) return;
+
+    std::sort(levIds.begin(), levIds.end());
+
+    auto emit = [&](std::string_view buf){
+        PackedEventView packed(buf);
+        cb(packed.created_at(), packed.id());
+    };
+
+    // Events missing here were deleted while the query was paused
+
+    if (levIds.back() - levIds.front() < levIds.size() * 4) {
+        // Dense enough that a single cursor walk is cheaper than a lookup per levId
+        size_t i = 0;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            while (i < levIds.size() && levIds[i] < ev.primaryKeyId) i++;
+            if (i == levIds.size()) return false;
+            if (levIds[i] == ev.primaryKeyId) emit(ev.buf);
+            return true;
+        }, false, levIds.front());
+    } else {
+        for (auto levId : levIds) {
+            auto view = env.lookup_Event(txn, levId);
+            if (view) emit(view->buf);
+        }
+    }
+}
@@ -4,28 +4,102 @@
 #include <zdict.h>
 
 #include <mutex>
+#include <memory>
 
 #include "golpe.h"
 
 
+// dictIds are only unique within a DB, so dictionaries are keyed by the txn's environment as well
+
+using DictKey = std::pair<MDB_env*, uint32_t>;
+
+inline DictKey makeDictKey(lmdb::txn &txn, uint32_t dictId) {
+    return DictKey{ mdb_txn_env(txn.handle()), dictId };
+}
+
+// Loaded dictionaries are shared by every thread. Superseded dictionaries (see retire()) have their CDicts
+// freed immediately, and at most events.compression.maxCachedDicts DDicts are kept, evicting the least
+// recently requested. Decompressors keep their own copies until generation changes.
+
+using DDictPtr = std::shared_ptr<ZSTD_DDict>;
+using CDictPtr = std::shared_ptr<ZSTD_CDict>;
+
 struct DictionaryBroker {
     std::mutex mutex;
-    flat_hash_map<uint32_t, ZSTD_DDict*> dicts;
+    flat_hash_map<DictKey, std::pair<DDictPtr, uint64_t>> dicts; // -> (DDict, last requested)
+    flat_hash_map<std::pair<DictKey, int>, CDictPtr> cdicts; // (dict, compression level) -> CDict
+    uint64_t requests = 0;
+    std::atomic<uint64_t> generation = 0; // bumped whenever a DDict is evicted
 
-    ZSTD_DDict *getDict(lmdb::txn &txn, uint32_t dictId) {
+    DDictPtr getDict(lmdb::txn &txn, uint32_t dictId) {
         std::lock_guard<std::mutex> guard(mutex);
 
-        auto it = dicts.find(dictId);
-        if (it != dicts.end()) return it->second;
+        auto key = makeDictKey(txn, dictId);
 
-        auto view = env.lookup_CompressionDictionary(txn, dictId);
-        if (!view) throw herr("couldn't find dictId ", dictId);
-        auto dictBuffer = view->dict();
+        auto it = dicts.find(key);
+        if (it != dicts.end()) {
+            it->second.second = ++requests;
+            return it->second.first;
+        }
+
+        auto dictBuffer = loadDict(txn, dictId);
+        DDictPtr dict(ZSTD_createDDict(dictBuffer.data(), dictBuffer.size()), ZSTD_freeDDict);
+        if (!dict) throw herr("couldn't create DDict for dictId ", dictId);
+
+        uint64_t maxDicts = std::max(cfg().events__compression__maxCachedDicts, (uint64_t)1);
+
+        while (dicts.size() >= maxDicts) {
+            auto oldest = dicts.begin();
+            for (auto i = dicts.begin(); i != dicts.end(); ++i) {
+                if (i->second.second < oldest->second.second) oldest = i;
+            }
+            dicts.erase(oldest);
+            generation++;
+        }
+
+        dicts.try_emplace(key, dict, ++requests);
+
+        return dict;
+    }
+
+    CDictPtr getCDict(lmdb::txn &txn, uint32_t dictId, int level) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto key = std::make_pair(makeDictKey(txn, dictId), level);
+
+        auto it = cdicts.find(key);
+        if (it != cdicts.end()) return it->second;
+
+        auto dictBuffer = loadDict(txn, dictId);
+        CDictPtr dict(ZSTD_createCDict(dictBuffer.data(), dictBuffer.size(), level), ZSTD_freeCDict);
+        if (!dict) throw herr("couldn't create CDict for dictId ", dictId);
 
-        auto *dict = dicts[dictId] = ZSTD_createDDict(dictBuffer.data(), dictBuffer.size());
+        cdicts.try_emplace(key, dict);
 
         return dict;
     }
+
+    // Call after dictId has been replaced by a newer dictionary. Events compressed with it can still be
+    // read: its DDict is reloaded on demand
+    void retire(lmdb::txn &txn, uint32_t dictId) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto key = makeDictKey(txn, dictId);
+
+        for (auto it = cdicts.begin(); it != cdicts.end(); ) {
+            if (it->first.first == key) cdicts.erase(it++);
+            else ++it;
+        }
+
+        if (dicts.erase(key)) generation++;
+    }
+
+  private:
+    std::string_view loadDict(lmdb::txn &txn, uint32_t dictId) {
+        auto view = env.lookup_CompressionDictionary(txn, dictId);
+        if (!view) throw herr("couldn't find dictId ", dictId);
+        return view->dict();
+    }
 };
 
 extern DictionaryBroker globalDictionaryBroker;
@@ -33,8 +107,10 @@ extern DictionaryBroker globalDictionaryBroker;
 
 struct Decompressor {
     ZSTD_DCtx *dctx;
-    flat_hash_map<uint32_t, ZSTD_DDict*> dicts;
+    flat_hash_map<DictKey, DDictPtr> dicts;
+    uint64_t dictsGeneration = 0;
     std::string buffer;
+    std::string coldBuffer; // records read from the cold tier
 
     Decompressor() {
         dctx = ZSTD_createDCtx();
@@ -51,13 +127,20 @@ struct Decompressor {
     // Return result only valid until one of: a) next call to decompress()/reserve(), or Decompressor destroyed
 
     std::string_view decompress(lmdb::txn &txn, uint32_t dictId, std::string_view src) {
-        auto it = dicts.find(dictId);
+        auto generation = globalDictionaryBroker.generation.load(std::memory_order_relaxed);
+        if (generation != dictsGeneration) {
+            dicts.clear();
+            dictsGeneration = generation;
+        }
+
+        auto key = makeDictKey(txn, dictId);
+        auto it = dicts.find(key);
         ZSTD_DDict *dict;
 
         if (it == dicts.end()) {
-            dict = dicts[dictId] = globalDictionaryBroker.getDict(txn, dictId);
+            dict = (dicts[key] = globalDictionaryBroker.getDict(txn, dictId)).get();
         } else {
-            dict = it->second;
+            dict = it->second.get();
         }
 
         auto ret = ZSTD_decompress_usingDDict(dctx, buffer.data(), buffer.size(), src.data(), src.size(), dict);
@@ -65,4 +148,45 @@ struct Decompressor {
 
         return std::string_view(buffer.data(), ret);
     }
+
+    std::string_view decompressNoDict(std::string_view src) {
+        auto ret = ZSTD_decompressDCtx(dctx, buffer.data(), buffer.size(), src.data(), src.size());
+        if (ZSTD_isError(ret)) throw herr("zstd decompression failed: ", ZSTD_getErrorName(ret));
+
+        return std::string_view(buffer.data(), ret);
+    }
+};
+
+
+struct Compressor {
+    ZSTD_CCtx *cctx;
+    std::string buffer;
+
+    Compressor() {
+        cctx = ZSTD_createCCtx();
+    }
+
+    ~Compressor() {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    // dictId of 0 means no dictionary
+    // Return result only valid until one of: a) next call to compress(), or Compressor destroyed
+
+    std::string_view compress(lmdb::txn &txn, uint32_t dictId, int level, std::string_view src) {
+        buffer.resize(ZSTD_compressBound(src.size()));
+
+        size_t ret;
+
+        if (dictId) {
+            auto dict = globalDictionaryBroker.getCDict(txn, dictId, level);
+            ret = ZSTD_compress_usingCDict(cctx, buffer.data(), buffer.size(), src.data(), src.size(), dict.get());
+        } else {
+            ret = ZSTD_compressCCtx(cctx, buffer.data(), buffer.size(), src.data(), src.size(), level);
+        }
+
+        if (ZSTD_isError(ret)) throw herr("zstd compression failed: ", ZSTD_getErrorName(ret));
+
+        return std::string_view(buffer.data(), ret);
+    }
 };
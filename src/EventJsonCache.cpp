@@ -0,0 +1,5 @@
+#include "golpe.h"
+
+#include "EventJsonCache.h"
+
+EventJsonCache eventJsonCache;
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include "golpe.h"
+
+
+// Size-bounded LRU of decompressed event JSON, shared by all threads.
+//
+// Keyed by (LMDB environment, levId), since each tenant DB has its own levId sequence. Buffers
+// are refcounted, so an evicted entry stays valid for as long as a sender still holds it.
+// Sharded by levId to keep lock contention low.
+
+struct EventJsonCache {
+    using Buf = std::shared_ptr<const std::string>;
+
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+
+    bool enabled() {
+        return maxBytesPerShard() != 0;
+    }
+
+    Buf get(MDB_env *e, uint64_t levId) {
+        auto &shard = getShard(levId);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        auto it = shard.index.find(Key{ e, levId });
+        if (it == shard.index.end()) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return it->second->buf;
+    }
+
+    void put(MDB_env *e, uint64_t levId, Buf buf) {
+        uint64_t maxBytes = maxBytesPerShard();
+        if (buf->size() > maxBytes) return;
+
+        auto &shard = getShard(levId);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        Key key{ e, levId };
+        if (shard.index.contains(key)) return; // another thread decoded it first
+
+        shard.lru.push_front(Entry{ key, std::move(buf) });
+        shard.index[key] = shard.lru.begin();
+        shard.bytes += entrySize(shard.lru.front());
+
+        while (shard.bytes > maxBytes) {
+            auto &victim = shard.lru.back();
+            shard.bytes -= entrySize(victim);
+            shard.index.erase(victim.key);
+            shard.lru.pop_back();
+        }
+    }
+
+    void erase(MDB_env *e, uint64_t levId) {
+        auto &shard = getShard(levId);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        auto it = shard.index.find(Key{ e, levId });
+        if (it == shard.index.end()) return;
+
+        shard.bytes -= entrySize(*it->second);
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+
+  private:
+    static constexpr size_t NumShards = 16;
+
+    using Key = std::pair<MDB_env*, uint64_t>;
+
+    struct Entry {
+        Key key;
+        Buf buf;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru; // most recently used at front
+        flat_hash_map<Key, std::list<Entry>::iterator> index;
+        uint64_t bytes = 0;
+    };
+
+    Shard shards[NumShards];
+
+    Shard &getShard(uint64_t levId) {
+        return shards[levId % NumShards];
+    }
+
+    static uint64_t maxBytesPerShard() {
+        return cfg().events__jsonCache__maxBytes / NumShards;
+    }
+
+    static uint64_t entrySize(const Entry &entry) {
+        return entry.buf->size() + sizeof(Entry) + 64; // rough allocator and index overhead
+    }
+};
+
+extern EventJsonCache eventJsonCache;
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Events with similar structure compress well with a shared dictionary, so dictionaries are
+// trained and selected per class of kinds
+
+enum class KindClass : uint64_t {
+    Other = 0,
+    Metadata = 1,
+    Note = 2,
+    Contacts = 3,
+    DirectMessage = 4,
+    Repost = 5,
+    Reaction = 6,
+    Zap = 7,
+    List = 8,
+    LongForm = 9,
+
+    _Count
+};
+
+constexpr uint64_t NumKindClasses = (uint64_t)KindClass::_Count;
+
+inline KindClass kindClassOf(uint64_t kind) {
+    if (kind == 0) return KindClass::Metadata;
+    if (kind == 1 || kind == 1111) return KindClass::Note;
+    if (kind == 3) return KindClass::Contacts;
+    if (kind == 4 || kind == 1059) return KindClass::DirectMessage;
+    if (kind == 6 || kind == 16) return KindClass::Repost;
+    if (kind == 7) return KindClass::Reaction;
+    if (kind == 9734 || kind == 9735) return KindClass::Zap;
+    if (kind == 30023) return KindClass::LongForm;
+    if ((kind >= 10000 && kind < 20000) || (kind >= 30000 && kind < 40000)) return KindClass::List;
+    return KindClass::Other;
+}
+
+inline const char *kindClassName(KindClass c) {
+    switch (c) {
+        case KindClass::Metadata: return "metadata";
+        case KindClass::Note: return "note";
+        case KindClass::Contacts: return "contacts";
+        case KindClass::DirectMessage: return "dm";
+        case KindClass::Repost: return "repost";
+        case KindClass::Reaction: return "reaction";
+        case KindClass::Zap: return "zap";
+        case KindClass::List: return "list";
+        case KindClass::LongForm: return "longform";
+        default: return "other";
+    }
+}
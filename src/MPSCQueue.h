@@ -0,0 +1,179 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+
+// Lock-free multi-producer single-consumer queue.
+//
+// Producers push onto an intrusive stack with a single CAS. The consumer takes the whole stack with one
+// exchange and reverses it, so messages come out in push order and a batch costs one atomic op.
+//
+// When empty, the consumer spins briefly, then yields, then parks on a condition variable (with a
+// timeout, if given). Producers only take the park mutex when the consumer has announced that it's
+// about to park.
+
+template <typename T>
+class MPSCQueue {
+    struct Node {
+        T val;
+        Node *next;
+    };
+
+    std::atomic<Node*> head = nullptr;
+    std::atomic<uint32_t> sleeping = 0;
+    std::atomic<uint32_t> woken = 0;
+    std::mutex parkMutex;
+    std::condition_variable parkCv;
+
+    static constexpr uint64_t spinIterations = 200;
+    static constexpr uint64_t yieldIterations = 20;
+
+  public:
+    MPSCQueue() {}
+    MPSCQueue(const MPSCQueue &) = delete;
+    MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+    ~MPSCQueue() {
+        freeList(head.exchange(nullptr));
+    }
+
+    void push_move(T &&val) {
+        Node *n = new Node{ std::move(val), nullptr };
+        pushChain(n, n);
+    }
+
+    void push_move_all(std::vector<T> &vals) {
+        if (vals.empty()) return;
+
+        // Link the nodes in reverse so that the chain's head is the last element
+        Node *first = nullptr, *last = nullptr;
+
+        for (auto &v : vals) {
+            Node *n = new Node{ std::move(v), first };
+            if (!last) last = n;
+            first = n;
+        }
+
+        vals.clear();
+        pushChain(first, last);
+    }
+
+    std::deque<T> pop_all_no_wait() {
+        std::deque<T> output;
+        drain(head.exchange(nullptr, std::memory_order_acquire), output);
+        return output;
+    }
+
+    // Returns an empty deque only if wake() was called
+    std::deque<T> pop_all() {
+        while (1) {
+            auto output = waitAndPop(std::chrono::steady_clock::time_point::max());
+            if (output.size() || woken.exchange(0)) return output;
+        }
+    }
+
+    // Returns an empty deque if nothing arrived before the timeout
+    template <typename Rep, typename Period>
+    std::deque<T> pop_all_wait_for(std::chrono::duration<Rep, Period> timeout) {
+        auto output = waitAndPop(std::chrono::steady_clock::now() + timeout);
+        woken.store(0, std::memory_order_relaxed);
+        return output;
+    }
+
+    // Makes a blocked (or the next) pop return, even if nothing was pushed
+    void wake() {
+        woken.store(1, std::memory_order_seq_cst);
+        unpark();
+    }
+
+  private:
+    void pushChain(Node *first, Node *last) {
+        Node *old = head.load(std::memory_order_relaxed);
+
+        do {
+            last->next = old;
+        } while (!head.compare_exchange_weak(old, first, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+        // seq_cst on both sides: either the consumer's re-check of head sees this push, or we see it sleeping
+        unpark();
+    }
+
+    void unpark() {
+        if (!sleeping.load(std::memory_order_seq_cst)) return;
+
+        {
+            std::lock_guard<std::mutex> guard(parkMutex);
+            sleeping.store(0, std::memory_order_seq_cst);
+        }
+
+        parkCv.notify_one();
+    }
+
+    std::deque<T> waitAndPop(std::chrono::steady_clock::time_point deadline) {
+        std::deque<T> output;
+
+        for (uint64_t i = 0; i < spinIterations + yieldIterations; i++) {
+            if (head.load(std::memory_order_relaxed)) {
+                drain(head.exchange(nullptr, std::memory_order_acquire), output);
+                return output;
+            }
+
+            if (i < spinIterations) {
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            } else {
+                std::this_thread::yield();
+            }
+        }
+
+        sleeping.store(1, std::memory_order_seq_cst);
+
+        if (head.load(std::memory_order_seq_cst) || woken.load(std::memory_order_seq_cst)) {
+            sleeping.store(0, std::memory_order_relaxed);
+        } else {
+            // sleeping is only cleared under parkMutex, so a notify can't be missed
+            std::unique_lock<std::mutex> lk(parkMutex);
+            auto unparked = [&]{ return sleeping.load(std::memory_order_seq_cst) == 0; };
+
+            if (deadline == std::chrono::steady_clock::time_point::max()) parkCv.wait(lk, unparked);
+            else if (!parkCv.wait_until(lk, deadline, unparked)) sleeping.store(0, std::memory_order_relaxed);
+        }
+
+        drain(head.exchange(nullptr, std::memory_order_acquire), output);
+        return output;
+    }
+
+    static void drain(Node *n, std::deque<T> &output) {
+        // Stack is newest-first: reverse into push order
+        Node *prev = nullptr;
+
+        while (n) {
+            Node *next = n->next;
+            n->next = prev;
+            prev = n;
+            n = next;
+        }
+
+        while (prev) {
+            Node *next = prev->next;
+            output.emplace_back(std::move(prev->val));
+            delete prev;
+            prev = next;
+        }
+    }
+
+    static void freeList(Node *n) {
+        while (n) {
+            Node *next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+};
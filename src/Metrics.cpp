@@ -0,0 +1,288 @@
+#include <mutex>
+#include <vector>
+#include <memory>
+
+#include "golpe.h"
+
+#include "Metrics.h"
+
+
+namespace metrics {
+
+namespace {
+
+constexpr uint32_t NumCounters = (uint32_t)Counter::_Count;
+constexpr uint32_t NumHistograms = (uint32_t)Histogram::_Count;
+constexpr uint32_t MaxTenants = 4096; // any further tenants are accounted under "_other"
+
+
+struct CounterInfo {
+    const char *family;
+    const char *label; // "" for none, otherwise key="val"
+    const char *help;
+};
+
+const CounterInfo counterInfos[NumCounters] = {
+    { "strfry_client_messages_total", "type=\"EVENT\"", "Messages received from clients, by type" },
+    { "strfry_client_messages_total", "type=\"REQ\"", "" },
+    { "strfry_client_messages_total", "type=\"CLOSE\"", "" },
+    { "strfry_client_messages_total", "type=\"AUTH\"", "" },
+    { "strfry_client_messages_total", "type=\"NEG-OPEN\"", "" },
+    { "strfry_client_messages_total", "type=\"NEG-MSG\"", "" },
+    { "strfry_client_messages_total", "type=\"NEG-CLOSE\"", "" },
+    { "strfry_client_messages_total", "type=\"other\"", "" },
+
+    { "strfry_events_total", "status=\"written\"", "Events processed by the writer, by outcome" },
+    { "strfry_events_total", "status=\"duplicate\"", "" },
+    { "strfry_events_total", "status=\"rejected\"", "" },
+
+    { "strfry_bytes_up_total", "", "Uncompressed bytes sent to clients" },
+    { "strfry_bytes_up_compressed_total", "", "Bytes sent to clients after websocket compression" },
+    { "strfry_bytes_down_total", "", "Uncompressed bytes received from clients" },
+    { "strfry_bytes_down_compressed_total", "", "Bytes received from clients before websocket decompression" },
+
+    { "strfry_dbscan_work_total", "index=\"Id\"", "Approximate work performed by REQ database scans, by index used" },
+    { "strfry_dbscan_work_total", "index=\"Tag\"", "" },
+    { "strfry_dbscan_work_total", "index=\"PubkeyKind\"", "" },
+    { "strfry_dbscan_work_total", "index=\"Pubkey\"", "" },
+    { "strfry_dbscan_work_total", "index=\"Kind\"", "" },
+    { "strfry_dbscan_work_total", "index=\"CreatedAt\"", "" },
+
+    { "strfry_compaction_events_total", "", "Events recompressed by background compaction" },
+    { "strfry_compaction_bytes_before_total", "", "Size of events recompressed by background compaction, before" },
+    { "strfry_compaction_bytes_after_total", "", "Size of events recompressed by background compaction, after" },
+    { "strfry_cold_tier_events_total", "", "Event payloads moved to cold segment files" },
+    { "strfry_ingest_duplicates_total", "", "Re-sent events answered as duplicates before signature verification" },
+};
+
+struct HistogramInfo {
+    const char *family;
+    const char *help;
+};
+
+const HistogramInfo histogramInfos[NumHistograms] = {
+    { "strfry_ingest_to_commit_microseconds", "Time from receiving an EVENT to committing it to the DB" },
+    { "strfry_req_time_to_eose_microseconds", "Time from receiving a REQ to sending its EOSE" },
+    { "strfry_monitor_fanout", "Number of live subscriptions an event was delivered to" },
+    { "strfry_writer_batch_size", "Number of events written per transaction" },
+    { "strfry_commit_duration_microseconds", "Duration of writer transactions, including commit" },
+};
+
+
+struct HistogramData {
+    std::atomic<uint64_t> buckets[NumHistogramBuckets] = {};
+    std::atomic<uint64_t> sum = 0;
+    std::atomic<uint64_t> count = 0;
+};
+
+struct Block {
+    std::atomic<uint64_t> counters[NumCounters] = {};
+    HistogramData histograms[NumHistograms];
+};
+
+struct Shard {
+    std::atomic<Block*> blocks[MaxTenants] = {};
+};
+
+// Only ever written by the shard's owner thread, so no read-modify-write needed
+inline void bump(std::atomic<uint64_t> &a, uint64_t n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::string> tenants;
+    flat_hash_map<std::string, uint32_t> tenantToSlot;
+    std::vector<std::unique_ptr<Shard>> shards; // never freed: scrapes may happen after a thread exits
+
+    Registry() {
+        tenants.emplace_back("_other");
+        tenantToSlot["_other"] = 0;
+    }
+
+    uint32_t getSlot(std::string_view tenant) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto it = tenantToSlot.find(tenant);
+        if (it != tenantToSlot.end()) return it->second;
+
+        if (tenants.size() >= MaxTenants) return 0;
+
+        uint32_t slot = tenants.size();
+        tenants.emplace_back(tenant);
+        tenantToSlot[std::string(tenant)] = slot;
+        return slot;
+    }
+
+    Shard *newShard() {
+        std::lock_guard<std::mutex> guard(mutex);
+        shards.emplace_back(std::make_unique<Shard>());
+        return shards.back().get();
+    }
+};
+
+Registry &registry() {
+    static Registry r;
+    return r;
+}
+
+
+struct ThreadState {
+    Shard *shard = nullptr;
+    flat_hash_map<std::string, Block*> tenantCache; // string keys have transparent hash/eq, so lookups by string_view don't allocate
+
+    Block *getBlock(std::string_view tenant) {
+        auto it = tenantCache.find(tenant);
+        if (it != tenantCache.end()) return it->second;
+
+        if (!shard) shard = registry().newShard();
+
+        uint32_t slot = registry().getSlot(tenant);
+        Block *b = shard->blocks[slot].load(std::memory_order_relaxed);
+
+        if (!b) {
+            b = new Block();
+            shard->blocks[slot].store(b, std::memory_order_release);
+        }
+
+        tenantCache.emplace(tenant, b);
+        return b;
+    }
+};
+
+thread_local ThreadState threadState;
+
+
+uint32_t bucketIndex(uint64_t v) {
+    if (v <= 1) return 0;
+    uint32_t b = 64 - __builtin_clzll(v - 1);
+    return std::min(b, NumHistogramBuckets - 1);
+}
+
+std::string escapeLabel(std::string_view s) {
+    std::string o;
+    o.reserve(s.size());
+
+    for (char c : s) {
+        if (c == '\\' || c == '"') o += '\\';
+        if (c == '\n') { o += "\\n"; continue; }
+        o += c;
+    }
+
+    return o;
+}
+
+}
+
+
+void inc(std::string_view tenant, Counter c, uint64_t n) {
+    bump(threadState.getBlock(tenant)->counters[(uint32_t)c], n);
+}
+
+void observe(std::string_view tenant, Histogram h, uint64_t v) {
+    auto &d = threadState.getBlock(tenant)->histograms[(uint32_t)h];
+    bump(d.buckets[bucketIndex(v)], 1);
+    bump(d.sum, v);
+    bump(d.count, 1);
+}
+
+
+void render(std::string &output) {
+    auto &r = registry();
+
+    std::vector<std::string> tenants;
+    std::vector<Shard*> shards;
+
+    {
+        std::lock_guard<std::mutex> guard(r.mutex);
+        tenants = r.tenants;
+        for (auto &s : r.shards) shards.push_back(s.get());
+    }
+
+    // Sum all shards into a snapshot per tenant
+
+    struct Snapshot {
+        bool used = false;
+        uint64_t counters[NumCounters] = {};
+        struct { uint64_t buckets[NumHistogramBuckets] = {}; uint64_t sum = 0; uint64_t count = 0; } histograms[NumHistograms];
+    };
+
+    std::vector<Snapshot> snaps(tenants.size());
+
+    for (auto *shard : shards) {
+        for (uint32_t slot = 0; slot < tenants.size(); slot++) {
+            Block *b = shard->blocks[slot].load(std::memory_order_acquire);
+            if (!b) continue;
+
+            auto &s = snaps[slot];
+            s.used = true;
+
+            for (uint32_t i = 0; i < NumCounters; i++) s.counters[i] += b->counters[i].load(std::memory_order_relaxed);
+
+            for (uint32_t i = 0; i < NumHistograms; i++) {
+                auto &src = b->histograms[i];
+                auto &dst = s.histograms[i];
+                for (uint32_t j = 0; j < NumHistogramBuckets; j++) dst.buckets[j] += src.buckets[j].load(std::memory_order_relaxed);
+                dst.sum += src.sum.load(std::memory_order_relaxed);
+                dst.count += src.count.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Counters
+
+    for (uint32_t i = 0; i < NumCounters; i++) {
+        auto &info = counterInfos[i];
+        bool firstOfFamily = i == 0 || std::string_view(counterInfos[i - 1].family) != info.family;
+
+        if (firstOfFamily) {
+            output += std::string("# HELP ") + info.family + " " + info.help + "\n";
+            output += std::string("# TYPE ") + info.family + " counter\n";
+        }
+
+        for (uint32_t slot = 0; slot < tenants.size(); slot++) {
+            if (!snaps[slot].used) continue;
+
+            output += info.family;
+            output += "{tenant=\"";
+            output += escapeLabel(tenants[slot]);
+            output += "\"";
+            if (info.label[0]) {
+                output += ",";
+                output += info.label;
+            }
+            output += "} ";
+            output += std::to_string(snaps[slot].counters[i]);
+            output += "\n";
+        }
+    }
+
+    // Histograms
+
+    for (uint32_t i = 0; i < NumHistograms; i++) {
+        auto &info = histogramInfos[i];
+
+        output += std::string("# HELP ") + info.family + " " + info.help + "\n";
+        output += std::string("# TYPE ") + info.family + " histogram\n";
+
+        for (uint32_t slot = 0; slot < tenants.size(); slot++) {
+            if (!snaps[slot].used) continue;
+
+            auto &h = snaps[slot].histograms[i];
+            std::string tenantLabel = std::string("tenant=\"") + escapeLabel(tenants[slot]) + "\"";
+            uint64_t cumulative = 0;
+
+            for (uint32_t j = 0; j < NumHistogramBuckets; j++) {
+                cumulative += h.buckets[j];
+                std::string le = j == NumHistogramBuckets - 1 ? "+Inf" : std::to_string(uint64_t(1) << j);
+                output += std::string(info.family) + "_bucket{" + tenantLabel + ",le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+            }
+
+            output += std::string(info.family) + "_sum{" + tenantLabel + "} " + std::to_string(h.sum) + "\n";
+            output += std::string(info.family) + "_count{" + tenantLabel + "} " + std::to_string(h.count) + "\n";
+        }
+    }
+}
+
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+
+
+// Lock-free metrics: Each thread writes to its own shard, so updates are plain relaxed
+// load/store pairs with no contention. Shards are summed when the metrics are scraped.
+// Every counter and histogram is kept separately per tenant.
+
+namespace metrics {
+
+enum class Counter : uint32_t {
+    MsgEvent,
+    MsgReq,
+    MsgClose,
+    MsgAuth,
+    MsgNegOpen,
+    MsgNegMsg,
+    MsgNegClose,
+    MsgOther,
+
+    EventsWritten,
+    EventsDuplicate,
+    EventsRejected,
+
+    BytesUp,
+    BytesUpCompressed,
+    BytesDown,
+    BytesDownCompressed,
+
+    ScanWorkId,
+    ScanWorkTag,
+    ScanWorkPubkeyKind,
+    ScanWorkPubkey,
+    ScanWorkKind,
+    ScanWorkCreatedAt,
+
+    CompactionEvents,
+    CompactionBytesBefore,
+    CompactionBytesAfter,
+    ColdTierEvents,
+    IngestDuplicates,
+
+    _Count
+};
+
+enum class Histogram : uint32_t {
+    IngestToCommitUs,
+    ReqTimeToEoseUs,
+    MonitorFanout,
+    WriterBatchSize,
+    CommitDurationUs,
+
+    _Count
+};
+
+// Bucket i holds values <= 2^i, last bucket is +Inf
+constexpr uint32_t NumHistogramBuckets = 32;
+
+void inc(std::string_view tenant, Counter c, uint64_t n = 1);
+void observe(std::string_view tenant, Histogram h, uint64_t v);
+
+// Render all counters and histograms in the Prometheus text exposition format
+void render(std::string &output);
+
+}
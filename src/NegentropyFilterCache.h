@@ -14,13 +14,20 @@ struct NegentropyFilterCache {
     struct FilterInfo {
         NostrFilter f;
         uint64_t treeId;
+        bool building; // still being populated, so it may not yet contain events that get deleted
     };
 
-    std::vector<FilterInfo> filters;
-    uint64_t modificationCounter = 0;
+    struct EnvFilters {
+        std::vector<FilterInfo> filters;
+        uint64_t modificationCounter = 0;
+        lmdb::dbi dbi{0}; // 0 is the main DB, never a negentropy table
+    };
+
+    flat_hash_map<MDB_env*, EnvFilters> envs; // each tenant DB has its own trees
 
     void ctx(lmdb::txn &txn, const std::function<void(const std::function<void(const PackedEventView &, bool)> &)> &cb) {
-        freshenCache(txn);
+        auto &e = freshenCache(txn);
+        auto &filters = e.filters;
 
         std::vector<std::unique_ptr<negentropy::storage::BTreeLMDB>> storages(filters.size());
 
@@ -30,30 +37,54 @@ struct NegentropyFilterCache {
 
                 if (!filter.f.doesMatch(ev)) continue;
 
-                if (!storages[i]) storages[i] = std::make_unique<negentropy::storage::BTreeLMDB>(txn, negentropyDbi, filter.treeId);
+                if (!storages[i]) storages[i] = std::make_unique<negentropy::storage::BTreeLMDB>(txn, e.dbi, filter.treeId);
 
                 if (insert) storages[i]->insert(ev.created_at(), ev.id());
-                else storages[i]->erase(ev.created_at(), ev.id());
+                else if (!filter.building || contains(*storages[i], ev.created_at(), ev.id())) storages[i]->erase(ev.created_at(), ev.id());
             }
         });
     }
 
+    // Call whenever NegentropyFilter records are added, removed or change state, so caches get refreshed
+    static void increaseModCounter(lmdb::txn &txn) {
+        auto m = env.lookup_Meta(txn, 1);
+        if (!m) throw herr("no Meta entry?");
+        env.update_Meta(txn, *m, { .negentropyModificationCounter = m->negentropyModificationCounter() + 1 });
+    }
+
+    static bool contains(negentropy::storage::BTreeLMDB &storage, uint64_t createdAt, std::string_view id) {
+        auto size = storage.size();
+        auto i = storage.findLowerBound(0, size, negentropy::Bound(createdAt, id));
+        if (i == size) return false;
+
+        const auto &item = storage.getItem(i);
+        return item.timestamp == createdAt && item.getId() == id;
+    }
+
   private:
-    void freshenCache(lmdb::txn &txn) {
+    EnvFilters &freshenCache(lmdb::txn &txn) {
+        auto &e = envs[mdb_txn_env(txn.handle())];
+        if (e.dbi.handle() == 0) e.dbi = getNegentropyDbi(txn);
+
         uint64_t curr = env.lookup_Meta(txn, 1)->negentropyModificationCounter();
 
-        if (curr != modificationCounter) {
-            filters.clear();
+        if (curr != e.modificationCounter) {
+            e.filters.clear();
 
             env.foreach_NegentropyFilter(txn, [&](auto &f){
-                filters.emplace_back(
+                if (f.state() == 2) return true; // dropping
+
+                e.filters.emplace_back(
                     NostrFilter(tao::json::from_string(f.filter()), MAX_U64),
-                    f.primaryKeyId
+                    f.primaryKeyId,
+                    f.state() == 1
                 );
                 return true;
             });
 
-            modificationCounter = curr;
+            e.modificationCounter = curr;
         }
+
+        return e;
     }
 };
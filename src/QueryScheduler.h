@@ -1,8 +1,29 @@
 #pragma once
 
+#include <mutex>
+#include <condition_variable>
+
 #include "DBQuery.h"
 
 
+struct QueryScheduler;
+
+// Schedulers in the same group (ie all threads of a pool) can steal queries from each other when idle.
+// Idle members only look for work while some member has queries to spare: they block on their inbox
+// otherwise, and wakeIdle is called when the first member gets a spare query.
+struct QueryStealGroup {
+    std::vector<std::atomic<QueryScheduler*>> members;
+    std::atomic<uint64_t> numWithSpare = 0;
+    std::function<void()> wakeIdle;
+
+    QueryStealGroup(uint64_t numMembers) : members(numMembers) {}
+
+    bool hasStealable() {
+        return numWithSpare.load(std::memory_order_relaxed) > 0;
+    }
+};
+
+
 struct QueryScheduler : NonCopyable {
     std::function<void(lmdb::txn &txn, const Subscription &sub, uint64_t levId, std::string_view eventPayload)> onEvent;
     std::function<void(lmdb::txn &txn, const Subscription &sub, const std::vector<uint64_t> &levIds)> onEventBatch;
@@ -14,9 +35,37 @@ struct QueryScheduler : NonCopyable {
 
     using ConnQueries = flat_hash_map<SubId, DBQuery*>;
     flat_hash_map<uint64_t, ConnQueries> conns; // connId -> subId -> DBQuery*
-    std::deque<DBQuery*> running;
     std::vector<uint64_t> levIdBatch;
 
+    // Protected by mutex, since other members of the steal group take queries from the back of running
+
+    std::mutex mutex;
+    std::deque<DBQuery*> running;
+
+    // Queries for paused connections are parked here until resumeConn()
+    flat_hash_set<uint64_t> pausedConns;
+    flat_hash_map<uint64_t, std::vector<DBQuery*>> parked; // connId -> DBQuery*
+
+    // Work stealing: onEvent is called by whichever thread runs the query, so it must be thread-safe.
+    // onEventBatch and onComplete are only ever called by the owner. Stolen queries that complete are
+    // passed to onStolenComplete, which should send them to the owner's handleStolenComplete().
+
+    QueryStealGroup *stealGroup = nullptr;
+    uint64_t stealGroupIndex = 0;
+    std::function<void(DBQuery *)> onStolenComplete;
+    bool hasSpare = false; // protected by mutex: counted in stealGroup->numWithSpare
+
+    // Connections that have queries being run by another member, protected by mutex. removeSub() and
+    // closeConn() wait for these to be handed back, so no events from a stolen slice can follow them.
+    flat_hash_map<uint64_t, uint64_t> stolenConns; // connId -> number of stolen queries
+    std::condition_variable stolenReturned;
+
+    void joinStealGroup(QueryStealGroup *group, uint64_t index) {
+        stealGroup = group;
+        stealGroupIndex = index;
+        group->members[index] = this;
+    }
+
     bool addSub(lmdb::txn &txn, Subscription &&sub) {
         sub.latestEventId = getMostRecentLevId(txn);
 
@@ -33,9 +82,15 @@ struct QueryScheduler : NonCopyable {
         }
 
         DBQuery *q = new DBQuery(sub);
+        q->stealOwner = stealGroupIndex;
 
         connQueries.try_emplace(q->sub.subId, q);
-        running.push_front(q);
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            running.push_front(q);
+            updateSpare();
+        }
 
         return true;
     }
@@ -54,33 +109,192 @@ struct QueryScheduler : NonCopyable {
         auto *query = findQuery(connId, subId);
         if (!query) return;
         query->dead = true;
-        conns[connId].erase(subId);
-        if (conns[connId].empty()) conns.erase(connId);
+        forgetSub(connId, subId);
+        waitForStolen(connId);
     }
 
     void closeConn(uint64_t connId) {
         auto f1 = conns.find(connId);
-        if (f1 == conns.end()) return;
+        if (f1 == conns.end()) {
+            resumeConn(connId);
+            return;
+        }
 
         for (auto &[k, v] : f1->second) v->dead = true;
 
         conns.erase(connId);
+        waitForStolen(connId);
+        resumeConn(connId); // so dead parked queries get cleaned up by process()
+    }
+
+    void pauseConn(uint64_t connId) {
+        std::lock_guard<std::mutex> guard(mutex);
+        pausedConns.insert(connId);
+    }
+
+    void resumeConn(uint64_t connId) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        pausedConns.erase(connId);
+
+        auto it = parked.find(connId);
+        if (it == parked.end()) return;
+
+        for (auto *q : it->second) running.push_back(q);
+        parked.erase(it);
+        updateSpare();
+    }
+
+    bool hasRunning() {
+        std::lock_guard<std::mutex> guard(mutex);
+        return !running.empty();
+    }
+
+    // Subdomain of the query that the next call to process() will run, so the caller can open a txn for it
+    std::optional<std::string> nextSubdomain() {
+        std::lock_guard<std::mutex> guard(mutex);
+        if (running.empty()) return std::nullopt;
+        return running.front()->sub.subdomain;
     }
 
     void process(lmdb::txn &txn) {
-        if (running.empty()) return;
+        DBQuery *q;
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+
+            if (running.empty()) return;
+
+            q = running.front();
+            running.pop_front();
+            updateSpare();
+
+            if (!q->dead && pausedConns.contains(q->sub.connId)) {
+                parked[q->sub.connId].push_back(q);
+                return;
+            }
+        }
+
+        if (q->dead) {
+            delete q;
+            return;
+        }
+
+        flushStolenBatch(txn, q);
+
+        bool complete = runSlice(txn, q, false);
+
+        if (onEventBatch) {
+            onEventBatch(txn, q->sub, levIdBatch);
+            levIdBatch.clear();
+        }
 
-        DBQuery *q = running.front();
-        running.pop_front();
+        if (complete) {
+            finish(txn, q);
+        } else {
+            std::lock_guard<std::mutex> guard(mutex);
+            running.push_back(q);
+            updateSpare();
+        }
+    }
+
+
+    // Take a query from the back of a busier member of the steal group. The caller should open a txn
+    // for the query's subdomain and pass it to processStolen().
 
+    DBQuery *steal() {
+        if (!stealGroup) return nullptr;
+
+        auto &members = stealGroup->members;
+
+        for (uint64_t i = 1; i < members.size(); i++) {
+            auto *victim = members[(stealGroupIndex + i) % members.size()].load();
+            if (!victim) continue;
+
+            std::lock_guard<std::mutex> guard(victim->mutex);
+
+            // Leave the victim at least one query to work on
+            if (victim->running.size() < 2) continue;
+
+            for (auto it = victim->running.rbegin(); it != std::prev(victim->running.rend()); ++it) {
+                DBQuery *q = *it;
+                if (q->dead || victim->pausedConns.contains(q->sub.connId)) continue;
+
+                victim->running.erase(std::next(it).base());
+                victim->updateSpare();
+                victim->stolenConns[q->sub.connId]++;
+                return q;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void processStolen(lmdb::txn &txn, DBQuery *q) {
+        bool complete = !q->dead && runSlice(txn, q, true);
+
+        auto *owner = stealGroup->members[q->stealOwner].load();
+
+        {
+            std::lock_guard<std::mutex> guard(owner->mutex);
+
+            if (!complete) {
+                owner->running.push_back(q);
+                owner->updateSpare();
+            }
+
+            auto it = owner->stolenConns.find(q->sub.connId);
+            if (--it->second == 0) owner->stolenConns.erase(it);
+            owner->stolenReturned.notify_all();
+        }
+
+        if (complete) onStolenComplete(q);
+    }
+
+    // Called by the owner when a query that completed on another thread has been handed back
+    void handleStolenComplete(lmdb::txn &txn, DBQuery *q) {
         if (q->dead) {
             delete q;
             return;
         }
 
+        flushStolenBatch(txn, q);
+        finish(txn, q);
+    }
+
+  private:
+    void forgetSub(uint64_t connId, const SubId &subId) {
+        auto it = conns.find(connId);
+        if (it == conns.end()) return;
+        it->second.erase(subId);
+        if (it->second.empty()) conns.erase(it);
+    }
+
+    void waitForStolen(uint64_t connId) {
+        if (!stealGroup) return;
+        std::unique_lock<std::mutex> lk(mutex);
+        stolenReturned.wait(lk, [&]{ return !stolenConns.contains(connId); });
+    }
+
+    // Call with mutex held, after changing running
+    void updateSpare() {
+        if (!stealGroup) return;
+
+        bool spare = running.size() >= 2; // steal() leaves each member one query
+        if (spare == hasSpare) return;
+        hasSpare = spare;
+
+        if (!spare) {
+            stealGroup->numWithSpare--;
+        } else if (stealGroup->numWithSpare++ == 0 && stealGroup->wakeIdle) {
+            stealGroup->wakeIdle();
+        }
+    }
+
+    bool runSlice(lmdb::txn &txn, DBQuery *q, bool stolen) {
         auto eventPayloadCursor = lmdb::cursor::open(txn, env.dbi_EventPayload);
 
-        bool complete = q->process(txn, [&](const auto &sub, uint64_t levId){
+        return q->process(txn, [&](const auto &sub, uint64_t levId){
             std::string_view eventPayload;
 
             if (ensureExists) {
@@ -88,24 +302,28 @@ struct QueryScheduler : NonCopyable {
                 if (!eventPayloadCursor.get(key, eventPayload, MDB_SET_KEY)) return; // If not found, was deleted while scan was paused
             }
 
+            if (q->dead) return; // the owner may have closed it during this slice, see waitForStolen()
+
             if (onEvent) onEvent(txn, sub, levId, eventPayload);
-            if (onEventBatch) levIdBatch.push_back(levId);
+
+            if (onEventBatch) {
+                if (stolen) q->stolenLevIds.push_back(levId);
+                else levIdBatch.push_back(levId);
+            }
         }, cfg().relay__queryTimesliceBudgetMicroseconds, cfg().relay__logging__dbScanPerf);
+    }
 
-        if (onEventBatch) {
-            onEventBatch(txn, q->sub, levIdBatch);
-            levIdBatch.clear();
-        }
+    void flushStolenBatch(lmdb::txn &txn, DBQuery *q) {
+        if (q->stolenLevIds.empty()) return;
+        if (onEventBatch) onEventBatch(txn, q->sub, q->stolenLevIds);
+        q->stolenLevIds.clear();
+    }
 
-        if (complete) {
-            auto connId = q->sub.connId;
-            removeSub(connId, q->sub.subId);
+    void finish(lmdb::txn &txn, DBQuery *q) {
+        forgetSub(q->sub.connId, q->sub.subId);
 
-            if (onComplete) onComplete(txn, q->sub);
+        if (onComplete) onComplete(txn, q->sub);
 
-            delete q;
-        } else {
-            running.push_back(q);
-        }
+        delete q;
     }
 };
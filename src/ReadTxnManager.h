@@ -0,0 +1,66 @@
+#pragma once
+
+#include <hoytech/time.h>
+
+#include "golpe.h"
+
+
+// Per-thread cache of read-only txns, one per environment.
+//
+// Instead of beginning and aborting a txn for every message, txns are reset when the thread goes
+// idle (releasing the snapshot but keeping the reader table slot) and renewed on next use. A txn
+// that stays active longer than maxAgeUs is renewed, so a busy thread doesn't pin old pages.
+//
+// Since LMDB only allows one active read txn per environment per thread, all read txns on the
+// owning thread should come from here. References returned by get() are only valid until the next
+// call to get() or resetAll().
+
+struct ReadTxnManager : NonCopyable {
+    uint64_t maxAgeUs;
+
+    ReadTxnManager(uint64_t maxAgeUs) : maxAgeUs(maxAgeUs) {}
+
+    // If fresh is true, the snapshot is renewed even if it is still young
+    lmdb::txn &get(defaultDb::environment &e, bool fresh = false) {
+        auto now = hoytech::curr_time_us();
+        auto it = txns.find(&e);
+
+        if (it == txns.end()) {
+            it = txns.emplace(&e, Entry{ e.txn_ro(), now, true }).first;
+            return it->second.txn;
+        }
+
+        auto &entry = it->second;
+
+        if (entry.active && (fresh || now - entry.startTime > maxAgeUs)) {
+            entry.txn.reset();
+            entry.active = false;
+        }
+
+        if (!entry.active) {
+            entry.txn.renew();
+            entry.startTime = now;
+            entry.active = true;
+        }
+
+        return entry.txn;
+    }
+
+    // Call before blocking for new messages
+    void resetAll() {
+        for (auto &[k, entry] : txns) {
+            if (!entry.active) continue;
+            entry.txn.reset();
+            entry.active = false;
+        }
+    }
+
+  private:
+    struct Entry {
+        lmdb::txn txn;
+        uint64_t startTime;
+        bool active;
+    };
+
+    flat_hash_map<defaultDb::environment*, Entry> txns;
+};
@@ -0,0 +1,5 @@
+#include "golpe.h"
+
+#include "SigVerifyCache.h"
+
+SigVerifyCache sigVerifyCache;
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <array>
+
+#include "golpe.h"
+
+#include "Bytes32.h"
+
+
+// Size-bounded LRU of recently verified (event id, signature) pairs, shared by all threads and tenants.
+//
+// The event id is always re-computed from the event's contents, so a cache hit only means the
+// signature was already checked against that id and pubkey. The full signature is stored, since
+// a different signature for the same id must still be verified.
+
+struct SigVerifyCache {
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+
+    bool enabled() {
+        return maxEntriesPerShard() != 0;
+    }
+
+    bool contains(std::string_view id, std::string_view sig) {
+        auto &shard = getShard(id);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        auto it = shard.index.find(Bytes32(id));
+        if (it == shard.index.end() || std::string_view(it->second->sig.data(), 64) != sig) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void put(std::string_view id, std::string_view sig) {
+        if (sig.size() != 64) return;
+
+        uint64_t maxEntries = maxEntriesPerShard();
+        auto &shard = getShard(id);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+
+        Bytes32 key(id);
+
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            memcpy(it->second->sig.data(), sig.data(), 64);
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            return;
+        }
+
+        shard.lru.push_front(Entry{ key, {} });
+        memcpy(shard.lru.front().sig.data(), sig.data(), 64);
+        shard.index.emplace(key, shard.lru.begin());
+
+        while (shard.lru.size() > maxEntries) {
+            shard.index.erase(shard.lru.back().id);
+            shard.lru.pop_back();
+        }
+    }
+
+  private:
+    static constexpr size_t NumShards = 16;
+
+    struct Entry {
+        Bytes32 id;
+        std::array<char, 64> sig;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<Entry> lru; // most recently used at front
+        flat_hash_map<Bytes32, std::list<Entry>::iterator> index;
+    };
+
+    Shard shards[NumShards];
+
+    Shard &getShard(std::string_view id) {
+        return shards[uint8_t(id[0]) % NumShards];
+    }
+
+    // Rounded up, so any non-zero maxEntries leaves the cache enabled
+    static uint64_t maxEntriesPerShard() {
+        return (cfg().events__sigCache__maxEntries + NumShards - 1) / NumShards;
+    }
+};
+
+extern SigVerifyCache sigVerifyCache;
@@ -60,6 +60,7 @@ struct Subscription : NonCopyable {
     // State
 
     uint64_t latestEventId = MAX_U64;
+    uint64_t receivedAt = 0; // microseconds, for time-to-EOSE metrics
 };
 
 
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <random>
+
+#include <secp256k1_schnorrsig.h>
+#include <tao/json.hpp>
+#include <hoytech/time.h>
+#include <hoytech/hex.h>
+
+#include "golpe.h"
+
+#include "events.h"
+
+
+// Samples integers in [0, n) where item i has weight 1/(i+1)^s. s=0 is uniform, s around 1 is
+// typical of social networks (a few very popular authors/hashtags, a long tail of rare ones).
+
+struct ZipfSampler {
+    std::vector<double> cdf;
+
+    ZipfSampler(uint64_t n, double s) {
+        if (n == 0) throw herr("ZipfSampler needs at least 1 item");
+
+        cdf.reserve(n);
+        double total = 0;
+
+        for (uint64_t i = 0; i < n; i++) {
+            total += 1.0 / std::pow(double(i + 1), s);
+            cdf.push_back(total);
+        }
+
+        for (auto &c : cdf) c /= total;
+    }
+
+    template <typename R>
+    uint64_t sample(R &rng) {
+        double r = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        auto it = std::lower_bound(cdf.begin(), cdf.end(), r);
+        if (it == cdf.end()) return cdf.size() - 1;
+        return it - cdf.begin();
+    }
+};
+
+
+// Generates validly signed nostr events, deterministically from a seed, so benchmarks can run
+// without an external dataset. Authors, hashtags and referenced events follow zipf distributions.
+
+struct SyntheticEvents : NonCopyable {
+    struct Params {
+        uint64_t seed = 1;
+        uint64_t numAuthors = 10'000;
+        double authorSkew = 1.0;
+        uint64_t numHashtags = 1'000;
+        double hashtagSkew = 1.0;
+        uint64_t maxTags = 4;
+        uint64_t contentSize = 140;
+        uint64_t timeSpreadSeconds = 30 * 86400; // created_at is spread over this many seconds before now
+
+        // Relative weights of kinds: profiles, notes, follow lists, reposts, reactions
+        std::vector<std::pair<uint64_t, double>> kindMix = { {0, 2}, {1, 60}, {3, 3}, {6, 5}, {7, 30} };
+    };
+
+    struct Author {
+        secp256k1_keypair keypair;
+        std::string pubkey; // 32 bytes
+    };
+
+    Params params;
+    std::mt19937_64 rng;
+    secp256k1_context *secpCtx;
+    std::vector<Author> authors;
+    ZipfSampler authorSampler;
+    ZipfSampler hashtagSampler;
+    std::discrete_distribution<size_t> kindSampler;
+    std::vector<std::string> recentIds; // ring buffer of ids for e tags
+    uint64_t recentIdsPos = 0;
+    uint64_t nowTs;
+
+    SyntheticEvents(const Params &params_) : params(params_), rng(params_.seed),
+                                             authorSampler(params_.numAuthors, params_.authorSkew),
+                                             hashtagSampler(params_.numHashtags, params_.hashtagSkew) {
+        secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY);
+        nowTs = hoytech::curr_time_s();
+
+        {
+            std::vector<double> weights;
+            for (auto &[kind, w] : params.kindMix) weights.push_back(w);
+            kindSampler = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+        }
+
+        authors.resize(params.numAuthors);
+
+        for (auto &a : authors) {
+            unsigned char seckey[32];
+
+            while (1) {
+                for (size_t i = 0; i < 32; i += 8) {
+                    uint64_t r = rng();
+                    memcpy(seckey + i, &r, 8);
+                }
+
+                if (secp256k1_keypair_create(secpCtx, &a.keypair, seckey)) break;
+            }
+
+            secp256k1_xonly_pubkey xonly;
+            unsigned char pubkeyBuf[32];
+            secp256k1_keypair_xonly_pub(secpCtx, &xonly, nullptr, &a.keypair);
+            secp256k1_xonly_pubkey_serialize(secpCtx, pubkeyBuf, &xonly);
+            a.pubkey = std::string((char*)pubkeyBuf, 32);
+        }
+    }
+
+    ~SyntheticEvents() {
+        secp256k1_context_destroy(secpCtx);
+    }
+
+    uint64_t randomAuthor() {
+        return authorSampler.sample(rng);
+    }
+
+    std::string randomAuthorHex() {
+        return to_hex(authors[randomAuthor()].pubkey);
+    }
+
+    std::string randomHashtag() {
+        return std::string("topic") + std::to_string(hashtagSampler.sample(rng));
+    }
+
+    uint64_t randomKind() {
+        return params.kindMix[kindSampler(rng)].first;
+    }
+
+    // If contentPrefix is non-empty, it is placed at the start of the content (ie to embed a timestamp)
+    tao::json::value make(std::string_view contentPrefix = "") {
+        return make(randomKind(), randomAuthor(), contentPrefix);
+    }
+
+    tao::json::value make(uint64_t kind, uint64_t authorIndex, std::string_view contentPrefix = "") {
+        auto &author = authors.at(authorIndex);
+
+        tao::json::value tags = tao::json::empty_array;
+
+        if (kind == 3) {
+            uint64_t numFollows = 1 + rng() % 100;
+            for (uint64_t i = 0; i < numFollows; i++) {
+                tags.emplace_back(tao::json::value::array({ "p", randomAuthorHex() }));
+            }
+        } else if ((kind == 6 || kind == 7) && recentIds.size()) {
+            tags.emplace_back(tao::json::value::array({ "e", to_hex(recentIds[rng() % recentIds.size()]) }));
+            tags.emplace_back(tao::json::value::array({ "p", randomAuthorHex() }));
+        } else if (kind == 1) {
+            uint64_t numTags = params.maxTags ? rng() % (params.maxTags + 1) : 0;
+            for (uint64_t i = 0; i < numTags; i++) {
+                if (rng() % 4 == 0) tags.emplace_back(tao::json::value::array({ "p", randomAuthorHex() }));
+                else tags.emplace_back(tao::json::value::array({ "t", randomHashtag() }));
+            }
+        }
+
+        std::string content(contentPrefix);
+
+        if (kind == 0) {
+            content += tao::json::to_string(tao::json::value({
+                { "name", std::string("user") + std::to_string(authorIndex) },
+                { "about", randomText(params.contentSize) },
+            }));
+        } else if (kind != 3) {
+            content += randomText(params.contentSize);
+        }
+
+        uint64_t createdAt = nowTs - (params.timeSpreadSeconds ? rng() % params.timeSpreadSeconds : 0);
+
+        tao::json::value ev = tao::json::value({
+            { "pubkey", to_hex(author.pubkey) },
+            { "created_at", createdAt },
+            { "kind", kind },
+            { "tags", std::move(tags) },
+            { "content", std::move(content) },
+        });
+
+        auto hash = nostrHash(ev);
+        ev["id"] = to_hex(hash.sv());
+        ev["sig"] = to_hex(sign(author, hash.sv()));
+
+        if (kind == 1) rememberId(std::string(hash.sv()));
+
+        return ev;
+    }
+
+  private:
+    std::string randomText(uint64_t size) {
+        static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz      ";
+        std::string o;
+        o.reserve(size);
+        for (uint64_t i = 0; i < size; i++) o += alphabet[rng() % (sizeof(alphabet) - 1)];
+        return o;
+    }
+
+    void rememberId(std::string id) {
+        const uint64_t maxRecent = 10'000;
+
+        if (recentIds.size() < maxRecent) {
+            recentIds.emplace_back(std::move(id));
+        } else {
+            recentIds[recentIdsPos++ % maxRecent] = std::move(id);
+        }
+    }
+
+    std::string sign(const Author &author, std::string_view hash) {
+        unsigned char sig[64];
+
+#ifdef SECP256K1_SCHNORRSIG_EXTRAPARAMS_INIT // see verifySig()
+        if (!secp256k1_schnorrsig_sign_custom(secpCtx, sig, (const unsigned char*)hash.data(), hash.size(), &author.keypair, nullptr)) throw herr("signing failed");
+#else
+        if (!secp256k1_schnorrsig_sign(secpCtx, sig, (const unsigned char*)hash.data(), &author.keypair, nullptr, nullptr)) throw herr("signing failed");
+#endif
+
+        return std::string((char*)sig, 64);
+    }
+};
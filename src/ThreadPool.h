@@ -1,16 +1,57 @@
 #pragma once
 
-#include <hoytech/protected_queue.h>
+#include "MPSCQueue.h"
 
 
 template <typename M>
 struct ThreadPool {
+    std::string name;
     uint64_t numThreads;
 
+    // Wraps the queue so that its depth can be read from other threads (for metrics)
+
+    struct Inbox {
+        MPSCQueue<M> queue;
+        std::atomic<uint64_t> depth = 0;
+
+        void push_move(M &&m) {
+            depth++;
+            queue.push_move(std::move(m));
+        }
+
+        void push_move_all(std::vector<M> &m) {
+            depth += m.size();
+            queue.push_move_all(m);
+        }
+
+        std::deque<M> pop_all() {
+            auto msgs = queue.pop_all();
+            depth -= msgs.size();
+            return msgs;
+        }
+
+        std::deque<M> pop_all_no_wait() {
+            auto msgs = queue.pop_all_no_wait();
+            depth -= msgs.size();
+            return msgs;
+        }
+
+        void wake() {
+            queue.wake();
+        }
+
+        template <typename Rep, typename Period>
+        std::deque<M> pop_all_wait_for(std::chrono::duration<Rep, Period> timeout) {
+            auto msgs = queue.pop_all_wait_for(timeout);
+            depth -= msgs.size();
+            return msgs;
+        }
+    };
+
     struct Thread {
         uint64_t id;
         std::thread thread;
-        hoytech::protected_queue<M> inbox;
+        Inbox inbox;
     };
 
     std::deque<Thread> pool;
@@ -22,6 +63,7 @@ struct ThreadPool {
     void init(std::string name, uint64_t numThreads_, const std::function<void(Thread &t)> &cb) {
         if (numThreads_ == 0) throw herr("must have more than 0 threads");
 
+        this->name = name;
         numThreads = numThreads_;
 
         for (size_t i = 0; i < numThreads; i++) {
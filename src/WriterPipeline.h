@@ -23,6 +23,8 @@ struct WriterPipeline {
     bool verboseReject = true;
     bool verboseCommit = true;
     std::function<void(uint64_t)> onCommit;
+    std::function<void(const tao::json::value &)> onVerified; // called from the validator thread for each event whose signature checked out (only if verifyMsg)
+    std::function<void(const tao::json::value &)> onRejected; // called from the validator thread for each event that failed validation
 
     // For logging:
 
@@ -77,9 +79,12 @@ struct WriterPipeline {
                         }
                         numLive--;
                         totalRejected++;
+                        if (onRejected) onRejected(m.eventJson);
                         continue;
                     }
 
+                    if (verifyMsg && onVerified) onVerified(m.eventJson);
+
                     writerInbox.push_move({ std::move(packedStr), std::move(jsonStr), });
                 }
             }
@@ -112,10 +117,10 @@ struct WriterPipeline {
                 std::vector<EventToWrite> newEventsToProc;
 
                 {
-                    auto txn = env.txn_ro();
+                    std::vector<EventToWrite> candidates;
 
                     while (newEvents.size()) {
-                        if (newEventsToProc.size() >= writeBatchSize) {
+                        if (candidates.size() >= writeBatchSize) {
                             // Put the rest back in the writerInbox
                             writerInbox.unshift_move_all(newEvents);
                             newEvents.clear();
@@ -132,14 +137,28 @@ struct WriterPipeline {
 
                         numLive--;
 
-                        PackedEventView packed(event.packedStr);
-                        if (lookupEventById(txn, packed.id())) {
+                        candidates.emplace_back(std::move(event));
+                    }
+
+                    std::vector<std::string_view> ids;
+                    ids.reserve(candidates.size());
+                    for (auto &ev : candidates) ids.push_back(PackedEventView(ev.packedStr).id());
+
+                    std::vector<uint64_t> existing;
+
+                    {
+                        auto txn = env.txn_ro();
+                        existing = lookupEventsById(txn, ids);
+                    }
+
+                    for (size_t i = 0; i < candidates.size(); i++) {
+                        if (existing[i]) {
                             dups++;
                             totalDups++;
                             continue;
                         }
 
-                        newEventsToProc.emplace_back(std::move(event));
+                        newEventsToProc.emplace_back(std::move(candidates[i]));
                     }
                 }
 
@@ -189,6 +208,15 @@ struct WriterPipeline {
         validatorInbox.push_move(std::move(inp));
     }
 
+    // Queues several events with a single wake-up of the validator. Empties inps
+    void writeBatch(std::vector<WriterPipelineInput> &inps) {
+        std::erase_if(inps, [](const auto &inp){ return inp.eventJson.is_null(); });
+        totalProcessed += inps.size();
+        numLive += inps.size();
+        validatorInbox.push_move_all(inps);
+        inps.clear();
+    }
+
     void write(EventToWrite &&inp) {
         totalProcessed++;
         numLive++;
@@ -0,0 +1,456 @@
+#include <docopt.h>
+#include <tao/json.hpp>
+#include <negentropy.h>
+#include <negentropy/storage/Vector.h>
+
+#include "golpe.h"
+
+#include "WSConnection.h"
+#include "SyntheticEvents.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      bench <url> [--connections=<connections>] [--duration=<duration>] [--preload=<preload>] [--publish-rate=<rate>] [--feed-rate=<rate>] [--profile-rate=<rate>] [--live-subs=<n>] [--neg-rate=<rate>] [--authors=<n>] [--author-skew=<s>] [--hashtags=<n>] [--hashtag-skew=<s>] [--seed=<seed>]
+
+    Options:
+      --connections=<connections>  Number of websocket connections [default: 10]
+      --duration=<duration>        Seconds to run the measured phase for [default: 30]
+      --preload=<preload>          Events to publish before measuring, so that queries have data [default: 10000]
+      --publish-rate=<rate>        EVENT publishes per second, across all connections [default: 100]
+      --feed-rate=<rate>           Follow-feed REQs (many authors, kinds 1 and 6) per second [default: 20]
+      --profile-rate=<rate>        Profile lookup REQs (one author, kind 0) per second [default: 50]
+      --live-subs=<n>              Long-lived subscriptions (hashtags, limit 0), spread across connections [default: 100]
+      --neg-rate=<rate>            NEG-OPEN syncs per second (time to first NEG-MSG is measured) [default: 1]
+      --authors=<n>                Number of synthetic authors [default: 1000]
+      --author-skew=<s>            Zipf exponent for author popularity (0 is uniform) [default: 1.0]
+      --hashtags=<n>               Number of synthetic hashtags [default: 500]
+      --hashtag-skew=<s>           Zipf exponent for hashtag popularity (0 is uniform) [default: 1.0]
+      --seed=<seed>                Random seed for the synthetic data [default: 1]
+)";
+
+
+namespace {
+
+enum class Phase {
+    Connecting,
+    Preload,
+    Run,
+    Drain,
+};
+
+struct LatencySamples {
+    std::vector<uint64_t> samples; // microseconds
+
+    void add(uint64_t us) {
+        samples.push_back(us);
+    }
+
+    void merge(const LatencySamples &o) {
+        samples.insert(samples.end(), o.samples.begin(), o.samples.end());
+    }
+
+    double percentileMs(double p) {
+        if (samples.empty()) return 0;
+        size_t idx = std::min(samples.size() - 1, size_t(p * samples.size()));
+        return samples[idx] / 1000.0;
+    }
+};
+
+struct BenchStats {
+    LatencySamples ok, feedEose, profileEose, live, neg;
+    uint64_t okRejected = 0;
+    uint64_t notices = 0;
+    uint64_t negErrors = 0;
+    uint64_t storedEvents = 0; // received in response to feed/profile REQs
+
+    void merge(const BenchStats &o) {
+        ok.merge(o.ok);
+        feedEose.merge(o.feedEose);
+        profileEose.merge(o.profileEose);
+        live.merge(o.live);
+        neg.merge(o.neg);
+        okRejected += o.okRejected;
+        notices += o.notices;
+        negErrors += o.negErrors;
+        storedEvents += o.storedEvents;
+    }
+};
+
+struct BenchParams {
+    std::string url;
+    uint64_t connections;
+    uint64_t preload;
+    double publishRate;
+    double feedRate;
+    double profileRate;
+    uint64_t liveSubs;
+    double negRate;
+    SyntheticEvents::Params gen;
+};
+
+struct Shared {
+    std::atomic<Phase> phase = Phase::Connecting;
+    std::atomic<uint64_t> numConnected = 0;
+    std::atomic<uint64_t> numPreloaded = 0;
+    std::atomic<uint64_t> numFailed = 0;
+};
+
+
+// Rate limiter that yields how many operations are due at a given time. Fixed intervals
+// rather than poisson arrivals, so that runs are comparable.
+
+struct Pacer {
+    uint64_t intervalUs = 0;
+    uint64_t next = 0;
+
+    void start(double ratePerSecond, uint64_t now, uint64_t offset) {
+        if (ratePerSecond <= 0) return;
+        intervalUs = std::max(uint64_t(1), uint64_t(1'000'000 / ratePerSecond));
+        next = now + offset % intervalUs;
+    }
+
+    uint64_t due(uint64_t now) {
+        if (!intervalUs || now < next) return 0;
+        uint64_t n = (now - next) / intervalUs + 1;
+        next += n * intervalUs;
+        return n;
+    }
+};
+
+
+struct BenchConnection {
+    uint64_t index;
+    const BenchParams &params;
+    Shared &shared;
+
+    WSConnection ws;
+    SyntheticEvents gen;
+    std::mt19937_64 rng;
+    std::thread thread;
+    BenchStats stats;
+
+    uint64_t preloadRemaining;
+    uint64_t preloadInFlight = 0;
+    bool preloadDone = false;
+    bool runStarted = false;
+    uint64_t nextSubId = 0;
+
+    Pacer publishPacer, feedPacer, profilePacer, negPacer;
+
+    flat_hash_map<std::string, uint64_t> pendingOks; // event id hex -> sent time
+    flat_hash_map<std::string, uint64_t> pendingReqs; // subId -> sent time
+
+    BenchConnection(uint64_t index, const BenchParams &params, Shared &shared, uint64_t preloadCount)
+        : index(index), params(params), shared(shared), ws(params.url), gen(params.gen),
+          rng(params.gen.seed * 1'000'003 + index), preloadRemaining(preloadCount) {
+        gen.rng.seed(params.gen.seed + index + 1); // same authors on every connection, different events
+        ws.reconnect = false;
+    }
+
+    void run() {
+        ws.onConnect = [&]{
+            shared.numConnected++;
+        };
+
+        ws.onDisconnect = ws.onError = [&]{
+            if (shared.phase != Phase::Drain) {
+                LE << "Bench connection " << index << " failed";
+                shared.numFailed++;
+            }
+        };
+
+        ws.onTrigger = [&]{
+            auto phase = shared.phase.load();
+            if (phase == Phase::Preload) doPreload();
+            else if (phase == Phase::Run) doRun();
+        };
+
+        ws.onMessage = [&](auto msg, uWS::OpCode, size_t){
+            handleMessage(msg);
+        };
+
+        thread = std::thread([&]{
+            setThreadName((std::string("bench ") + std::to_string(index)).c_str());
+            ws.run();
+        });
+    }
+
+    uint64_t perConnCount(uint64_t total) {
+        return total / params.connections + (index < total % params.connections ? 1 : 0);
+    }
+
+    std::string newSubId(char type) {
+        return std::string(1, type) + std::to_string(nextSubId++);
+    }
+
+    void publish(bool measured) {
+        auto now = hoytech::curr_time_us();
+        auto ev = gen.make(std::string("bench:") + std::to_string(now) + " ");
+
+        if (measured) pendingOks.emplace(ev.at("id").get_string(), now);
+        ws.send(tao::json::to_string(tao::json::value::array({ "EVENT", std::move(ev) })));
+    }
+
+    void doPreload() {
+        const uint64_t window = 500;
+
+        while (preloadRemaining && preloadInFlight < window) {
+            publish(false);
+            preloadRemaining--;
+            preloadInFlight++;
+        }
+
+        if (!preloadDone && !preloadRemaining && !preloadInFlight) {
+            preloadDone = true;
+            shared.numPreloaded++;
+        }
+    }
+
+    void doRun() {
+        uint64_t now = hoytech::curr_time_us();
+
+        if (!runStarted) {
+            runStarted = true;
+
+            publishPacer.start(params.publishRate / params.connections, now, rng());
+            feedPacer.start(params.feedRate / params.connections, now, rng());
+            profilePacer.start(params.profileRate / params.connections, now, rng());
+            negPacer.start(params.negRate / params.connections, now, rng());
+
+            for (uint64_t i = 0; i < perConnCount(params.liveSubs); i++) {
+                tao::json::value hashtags = tao::json::empty_array;
+                for (uint64_t j = 0; j < 5; j++) hashtags.emplace_back(std::string("topic") + std::to_string(gen.hashtagSampler.sample(rng)));
+
+                ws.send(tao::json::to_string(tao::json::value::array({ "REQ", newSubId('L'), tao::json::value({
+                    { "kinds", tao::json::value::array({ 1 }) },
+                    { "#t", std::move(hashtags) },
+                    { "limit", 0 },
+                }) })));
+            }
+        }
+
+        for (uint64_t n = publishPacer.due(now); n; n--) publish(true);
+
+        for (uint64_t n = feedPacer.due(now); n; n--) {
+            tao::json::value authors = tao::json::empty_array;
+            for (uint64_t j = 0; j < 50; j++) authors.emplace_back(to_hex(gen.authors[gen.authorSampler.sample(rng)].pubkey));
+
+            auto subId = newSubId('F');
+            pendingReqs.emplace(subId, hoytech::curr_time_us());
+
+            ws.send(tao::json::to_string(tao::json::value::array({ "REQ", subId, tao::json::value({
+                { "authors", std::move(authors) },
+                { "kinds", tao::json::value::array({ 1, 6 }) },
+                { "limit", 50 },
+            }) })));
+        }
+
+        for (uint64_t n = profilePacer.due(now); n; n--) {
+            auto subId = newSubId('P');
+            pendingReqs.emplace(subId, hoytech::curr_time_us());
+
+            ws.send(tao::json::to_string(tao::json::value::array({ "REQ", subId, tao::json::value({
+                { "authors", tao::json::value::array({ to_hex(gen.authors[gen.authorSampler.sample(rng)].pubkey) }) },
+                { "kinds", tao::json::value::array({ 0 }) },
+                { "limit", 1 },
+            }) })));
+        }
+
+        for (uint64_t n = negPacer.due(now); n; n--) {
+            // Empty client-side set, so the first NEG-MSG reply requires the relay to fingerprint the whole filter
+            negentropy::storage::Vector storage;
+            storage.seal();
+            negentropy::Negentropy<negentropy::storage::Vector> ne(storage, 60'000);
+
+            auto subId = newSubId('N');
+            pendingReqs.emplace(subId, hoytech::curr_time_us());
+
+            ws.send(tao::json::to_string(tao::json::value::array({
+                "NEG-OPEN",
+                subId,
+                tao::json::value({ { "kinds", tao::json::value::array({ 0 }) } }),
+                to_hex(ne.initiate()),
+            })));
+        }
+    }
+
+    void handleMessage(std::string_view msgStr) {
+        uint64_t now = hoytech::curr_time_us();
+        bool measuring = shared.phase == Phase::Run || shared.phase == Phase::Drain;
+
+        // Stored events from feed/profile REQs are only counted, not parsed
+        if (msgStr.starts_with("[\"EVENT\",\"F") || msgStr.starts_with("[\"EVENT\",\"P")) {
+            if (measuring) stats.storedEvents++;
+            return;
+        }
+
+        auto msg = tao::json::from_string(msgStr);
+        auto &arr = msg.get_array();
+        auto &type = arr.at(0).get_string();
+
+        if (type == "OK") {
+            if (preloadInFlight && !measuring) {
+                preloadInFlight--;
+                if (!arr.at(2).get_boolean()) stats.okRejected++;
+                doPreload();
+                return;
+            }
+
+            auto it = pendingOks.find(arr.at(1).get_string());
+            if (it == pendingOks.end()) return;
+            stats.ok.add(now - it->second);
+            if (!arr.at(2).get_boolean()) stats.okRejected++;
+            pendingOks.erase(it);
+        } else if (type == "EOSE") {
+            auto &subId = arr.at(1).get_string();
+            if (subId.starts_with("L")) return;
+
+            auto it = pendingReqs.find(subId);
+            if (it == pendingReqs.end()) return;
+            (subId.starts_with("F") ? stats.feedEose : stats.profileEose).add(now - it->second);
+            pendingReqs.erase(it);
+
+            ws.send(tao::json::to_string(tao::json::value::array({ "CLOSE", subId })));
+        } else if (type == "EVENT") {
+            // Live delivery: publish time was embedded at the start of the content
+            auto &content = arr.at(2).at("content").get_string();
+            if (!content.starts_with("bench:")) return;
+            auto sentAt = std::stoull(content.substr(6, content.find(' ') - 6));
+            if (measuring) stats.live.add(now - sentAt);
+        } else if (type == "NEG-MSG" || type == "NEG-ERR") {
+            auto &subId = arr.at(1).get_string();
+
+            auto it = pendingReqs.find(subId);
+            if (it == pendingReqs.end()) return;
+
+            if (type == "NEG-MSG") {
+                stats.neg.add(now - it->second);
+                ws.send(tao::json::to_string(tao::json::value::array({ "NEG-CLOSE", subId })));
+            } else {
+                stats.negErrors++;
+            }
+
+            pendingReqs.erase(it);
+        } else if (type == "NOTICE") {
+            stats.notices++;
+            LW << "NOTICE on bench connection " << index << ": " << msgStr;
+        }
+    }
+};
+
+}
+
+
+void cmd_bench(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    auto argUint = [&](const char *name){ return (uint64_t)std::stoull(args[name].asString()); };
+    auto argDouble = [&](const char *name){ return std::stod(args[name].asString()); };
+
+    BenchParams params;
+    params.url = args["<url>"].asString();
+    params.connections = argUint("--connections");
+    params.preload = argUint("--preload");
+    params.publishRate = argDouble("--publish-rate");
+    params.feedRate = argDouble("--feed-rate");
+    params.profileRate = argDouble("--profile-rate");
+    params.liveSubs = argUint("--live-subs");
+    params.negRate = argDouble("--neg-rate");
+    params.gen.seed = argUint("--seed");
+    params.gen.numAuthors = argUint("--authors");
+    params.gen.authorSkew = argDouble("--author-skew");
+    params.gen.numHashtags = argUint("--hashtags");
+    params.gen.hashtagSkew = argDouble("--hashtag-skew");
+
+    uint64_t duration = argUint("--duration");
+
+    if (params.connections == 0) throw herr("need at least 1 connection");
+
+
+    Shared shared;
+    std::vector<std::unique_ptr<BenchConnection>> conns;
+
+    LI << "Generating keys for " << params.gen.numAuthors << " authors on " << params.connections << " connections";
+
+    for (uint64_t i = 0; i < params.connections; i++) {
+        uint64_t preloadCount = params.preload / params.connections + (i < params.preload % params.connections ? 1 : 0);
+        conns.emplace_back(std::make_unique<BenchConnection>(i, params, shared, preloadCount));
+    }
+
+    for (auto &c : conns) c->run();
+
+    // A single ticker drives all connections: each one performs whatever operations are due
+
+    std::atomic<bool> tickerStop = false;
+    std::thread ticker([&]{
+        while (!tickerStop) {
+            for (auto &c : conns) c->ws.trigger();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    auto stopAll = [&]{
+        tickerStop = true;
+        ticker.join();
+
+        for (auto &c : conns) c->ws.close();
+        for (auto &c : conns) c->thread.join();
+    };
+
+    // Threads must be joined before throwing, or their destructors terminate the process
+    auto waitFor = [&](const std::function<bool()> &cond){
+        while (!cond()) {
+            if (shared.numFailed) {
+                shared.phase = Phase::Drain; // don't count the other connections closing as failures
+                stopAll();
+                throw herr("bench connection failed");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    };
+
+    waitFor([&]{ return shared.numConnected == params.connections; });
+
+    LI << "Preloading " << params.preload << " events";
+    uint64_t preloadStart = hoytech::curr_time_us();
+    shared.phase = Phase::Preload;
+    waitFor([&]{ return shared.numPreloaded == params.connections; });
+    double preloadSecs = (hoytech::curr_time_us() - preloadStart) / 1e6;
+    if (params.preload) LI << "Preload done: " << uint64_t(params.preload / preloadSecs) << " events/s";
+
+    LI << "Running for " << duration << " seconds";
+    shared.phase = Phase::Run;
+    std::this_thread::sleep_for(std::chrono::seconds(duration));
+
+    // Stop issuing requests, but allow in-flight ones to complete
+    shared.phase = Phase::Drain;
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    stopAll();
+
+
+    BenchStats total;
+    for (auto &c : conns) total.merge(c->stats);
+
+    auto report = [&](const char *name, LatencySamples &s){
+        std::sort(s.samples.begin(), s.samples.end());
+
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%-14s %10lu %10.1f %10.3f %10.3f %10.3f",
+                 name, (unsigned long)s.samples.size(), s.samples.size() / double(duration),
+                 s.percentileMs(0.5), s.percentileMs(0.99), s.percentileMs(0.999));
+        std::cout << buf << "\n";
+    };
+
+    std::cout << "               (latencies in ms)\n";
+    std::cout << "op                  count      per/s        p50        p99       p999\n";
+    report("EVENT->OK", total.ok);
+    report("feed EOSE", total.feedEose);
+    report("profile EOSE", total.profileEose);
+    report("live delivery", total.live);
+    report("NEG-OPEN", total.neg);
+
+    std::cout << "\nrejected OKs: " << total.okRejected << "  NOTICEs: " << total.notices << "  NEG-ERRs: " << total.negErrors << "  stored EVENTs: " << total.storedEvents << std::endl;
+}
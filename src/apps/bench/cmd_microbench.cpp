@@ -0,0 +1,558 @@
+#include <filesystem>
+#include <chrono>
+
+#include <docopt.h>
+#include <tao/json.hpp>
+#include <zstd.h>
+#include <zdict.h>
+#include <negentropy/storage/BTreeLMDB.h>
+#include <hoytech/protected_queue.h>
+
+#include "golpe.h"
+
+#include "SyntheticEvents.h"
+#include "ActiveMonitors.h"
+#include "DBQuery.h"
+#include "NegentropyFilterCache.h"
+#include "Decompressor.h"
+#include "events.h"
+#include "filters.h"
+#include "MPSCQueue.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      microbench [--only=<substr>] [--format=<format>] [--reps=<reps>] [--events=<events>] [--monitor-subs=<counts>] [--seed=<seed>] [--dir=<dir>]
+
+    Options:
+      --only=<substr>          Only run benchmarks whose name contains this string
+      --format=<format>        Output format: csv or json [default: csv]
+      --reps=<reps>            Timed repetitions per benchmark (median is reported) [default: 5]
+      --events=<events>        Number of synthetic events to generate [default: 50000]
+      --monitor-subs=<counts>  Comma-separated numbers of installed subscriptions for ActiveMonitors [default: 10000,100000,1000000]
+      --seed=<seed>            Random seed for the synthetic data [default: 1]
+      --dir=<dir>              Directory for temporary LMDB environments (default is a new directory in /tmp)
+)";
+
+
+namespace {
+
+volatile uint64_t benchSink; // prevents the compiler from discarding benchmarked work
+
+struct BenchResult {
+    std::string name;
+    uint64_t ops;
+    double medianNs;
+    double minNs;
+    double maxNs;
+};
+
+struct Runner {
+    std::string only;
+    uint64_t reps;
+    std::vector<BenchResult> results;
+
+    bool enabled(std::string_view name) {
+        return only.empty() || name.find(only) != std::string_view::npos;
+    }
+
+    // body() must perform exactly ops operations. One untimed warm-up run precedes the timed runs.
+    void run(const std::string &name, uint64_t ops, const std::function<void()> &body) {
+        if (!enabled(name)) return;
+
+        std::vector<double> nsPerOp;
+
+        for (uint64_t i = 0; i < reps + 1; i++) {
+            auto start = std::chrono::steady_clock::now();
+            body();
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            if (i > 0) nsPerOp.push_back(double(elapsed) / ops);
+        }
+
+        std::sort(nsPerOp.begin(), nsPerOp.end());
+        results.push_back({ name, ops, nsPerOp[nsPerOp.size() / 2], nsPerOp.front(), nsPerOp.back() });
+
+        LI << name << ": " << results.back().medianNs << " ns/op";
+    }
+};
+
+
+// Same setup as a relay tenant DB, so that dbi numbers match the global env
+
+std::unique_ptr<defaultDb::environment> openTempEnv(const std::string &dir) {
+    std::filesystem::create_directories(dir);
+
+    auto newEnv = std::make_unique<defaultDb::environment>();
+
+    unsigned int dbFlags = 0;
+    if (cfg().dbParams__noReadAhead) dbFlags |= MDB_NORDAHEAD;
+
+    if (cfg().dbParams__maxreaders > 0 || cfg().dbParams__mapsize > 0) {
+        newEnv->lmdb_env.set_max_dbs(64);
+        newEnv->lmdb_env.set_max_readers(cfg().dbParams__maxreaders);
+        newEnv->lmdb_env.set_mapsize(cfg().dbParams__mapsize);
+        newEnv->open(dir, false, dbFlags);
+    } else {
+        newEnv->open(dir, true, dbFlags);
+    }
+
+    auto txn = newEnv->txn_rw();
+    newEnv->insert_Meta(txn, CURR_DB_VERSION, 1, 1);
+    newEnv->insert_NegentropyFilter(txn, "{}", 0, 0);
+    setupNegentropyDbi(txn);
+    txn.commit();
+
+    return newEnv;
+}
+
+// Producers each push msgsPerProducer messages, and a single consumer pops in batches until it
+// has received all of them. Measures cross-thread handoff, including wakeups.
+
+template <typename Q>
+void queueHandoff(uint64_t numProducers, uint64_t msgsPerProducer) {
+    Q q;
+    uint64_t total = numProducers * msgsPerProducer;
+
+    std::thread consumer([&]{
+        uint64_t received = 0, sum = 0;
+
+        while (received < total) {
+            auto msgs = q.pop_all();
+            for (auto &m : msgs) sum += m;
+            received += msgs.size();
+        }
+
+        benchSink = sum;
+    });
+
+    std::vector<std::thread> producers;
+
+    for (uint64_t i = 0; i < numProducers; i++) {
+        producers.emplace_back([&]{
+            for (uint64_t j = 0; j < msgsPerProducer; j++) q.push_move(uint64_t(j));
+        });
+    }
+
+    for (auto &t : producers) t.join();
+    consumer.join();
+}
+
+void insertAll(defaultDb::environment &e, const std::vector<std::string> &packed, const std::vector<std::string> &jsons, uint64_t batchSize) {
+    NegentropyFilterCache neFilterCache;
+
+    for (size_t i = 0; i < packed.size(); i += batchSize) {
+        std::vector<EventToWrite> evs;
+        for (size_t j = i; j < std::min(packed.size(), i + batchSize); j++) evs.emplace_back(packed[j], jsons[j]);
+
+        auto txn = e.txn_rw();
+        writeEvents(txn, neFilterCache, evs, 0);
+        txn.commit();
+    }
+}
+
+}
+
+
+void cmd_microbench(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    Runner runner;
+    if (args["--only"]) runner.only = args["--only"].asString();
+    runner.reps = std::max(1UL, std::stoul(args["--reps"].asString()));
+    std::string format = args["--format"].asString();
+    if (format != "csv" && format != "json") throw herr("unknown format: ", format);
+    uint64_t numEvents = std::stoull(args["--events"].asString());
+    uint64_t seed = std::stoull(args["--seed"].asString());
+
+    std::vector<uint64_t> monitorSubCounts;
+    {
+        std::string s = args["--monitor-subs"].asString();
+        size_t pos = 0;
+        while (pos < s.size()) {
+            size_t comma = s.find(',', pos);
+            if (comma == std::string::npos) comma = s.size();
+            monitorSubCounts.push_back(std::stoull(s.substr(pos, comma - pos)));
+            pos = comma + 1;
+        }
+    }
+
+    std::string tmpDir;
+    bool removeTmpDir = false;
+    if (args["--dir"]) {
+        tmpDir = args["--dir"].asString();
+    } else {
+        char tmpl[] = "/tmp/strfry-microbench-XXXXXX";
+        if (!mkdtemp(tmpl)) throw herr("mkdtemp failed: ", strerror(errno));
+        tmpDir = tmpl;
+        removeTmpDir = true;
+    }
+
+
+    // Generate data
+
+    LI << "Generating " << numEvents << " events";
+
+    SyntheticEvents::Params genParams;
+    genParams.seed = seed;
+    SyntheticEvents gen(genParams);
+    std::mt19937_64 rng(seed);
+
+    std::vector<tao::json::value> evJsons;
+    std::vector<std::string> jsonStrs, packedStrs;
+
+    for (uint64_t i = 0; i < numEvents; i++) {
+        evJsons.emplace_back(gen.make());
+        jsonStrs.emplace_back(tao::json::to_string(evJsons.back()));
+        packedStrs.emplace_back(nostrJsonToPackedEvent(evJsons.back()));
+    }
+
+    auto randomAuthors = [&](uint64_t n){
+        tao::json::value o = tao::json::empty_array;
+        for (uint64_t i = 0; i < n; i++) o.emplace_back(to_hex(gen.authors[gen.authorSampler.sample(rng)].pubkey));
+        return o;
+    };
+
+    auto randomHashtags = [&](uint64_t n){
+        tao::json::value o = tao::json::empty_array;
+        for (uint64_t i = 0; i < n; i++) o.emplace_back(std::string("topic") + std::to_string(gen.hashtagSampler.sample(rng)));
+        return o;
+    };
+
+
+    // Thread handoff
+
+    for (uint64_t numProducers : { 1, 4 }) {
+        uint64_t msgsPerProducer = 250'000;
+        auto suffix = std::to_string(numProducers) + "producers";
+
+        runner.run("queueHandoff_protected_queue_" + suffix, numProducers * msgsPerProducer, [&]{
+            queueHandoff<hoytech::protected_queue<uint64_t>>(numProducers, msgsPerProducer);
+        });
+
+        runner.run("queueHandoff_MPSCQueue_" + suffix, numProducers * msgsPerProducer, [&]{
+            queueHandoff<MPSCQueue<uint64_t>>(numProducers, msgsPerProducer);
+        });
+    }
+
+
+    // Filters and PackedEvent
+
+    {
+        FilterSetBytes fsb(randomAuthors(100), true, 32, 32);
+        uint64_t ops = 1'000'000;
+
+        std::vector<std::string_view> candidates;
+        for (uint64_t i = 0; i < ops; i++) candidates.push_back(PackedEventView(packedStrs[i % packedStrs.size()]).pubkey());
+
+        runner.run("FilterSetBytes_doesMatch_100", ops, [&]{
+            uint64_t n = 0;
+            for (auto c : candidates) n += fsb.doesMatch(c);
+            benchSink = n;
+        });
+    }
+
+    {
+        NostrFilter f(tao::json::value({
+            { "authors", randomAuthors(20) },
+            { "kinds", tao::json::value::array({ 1, 6, 7 }) },
+        }), MAX_U64);
+
+        runner.run("NostrFilter_doesMatch_authorsKinds", packedStrs.size(), [&]{
+            uint64_t n = 0;
+            for (auto &p : packedStrs) n += f.doesMatch(PackedEventView(p));
+            benchSink = n;
+        });
+
+        NostrFilter ft(tao::json::value({
+            { "#t", randomHashtags(10) },
+        }), MAX_U64);
+
+        runner.run("NostrFilter_doesMatch_tags", packedStrs.size(), [&]{
+            uint64_t n = 0;
+            for (auto &p : packedStrs) n += ft.doesMatch(PackedEventView(p));
+            benchSink = n;
+        });
+    }
+
+    runner.run("PackedEventView_foreachTag", packedStrs.size(), [&]{
+        uint64_t n = 0;
+        for (auto &p : packedStrs) {
+            PackedEventView(p).foreachTag([&](char tagName, std::string_view tagVal){
+                n += tagVal.size();
+                return true;
+            });
+        }
+        benchSink = n;
+    });
+
+    runner.run("nostrJsonToPackedEvent", evJsons.size(), [&]{
+        uint64_t n = 0;
+        for (auto &j : evJsons) n += nostrJsonToPackedEvent(j).size();
+        benchSink = n;
+    });
+
+
+    // Hex codecs: hoytech's to_hex/from_hex versus hexEncode/hexDecode, for ids and for negentropy-sized payloads
+
+    {
+        std::vector<std::string> ids, idsHex;
+
+        for (auto &p : packedStrs) {
+            ids.emplace_back(PackedEventView(p).id());
+            idsHex.emplace_back(to_hex(ids.back()));
+        }
+
+        std::string payload(256 * 1024, '\0');
+        for (auto &c : payload) c = char(rng());
+        std::string payloadHex = to_hex(payload);
+        uint64_t payloadOps = 100;
+
+        runner.run("hex_encode_32_to_hex", ids.size(), [&]{
+            uint64_t n = 0;
+            for (auto &id : ids) n += to_hex(id).size();
+            benchSink = n;
+        });
+
+        runner.run("hex_encode_32_hexEncode", ids.size(), [&]{
+            uint64_t n = 0;
+            for (auto &id : ids) n += hexEncode(id).size();
+            benchSink = n;
+        });
+
+        runner.run("hex_decode_32_from_hex", idsHex.size(), [&]{
+            uint64_t n = 0;
+            for (auto &h : idsHex) n += from_hex(h, false).size();
+            benchSink = n;
+        });
+
+        runner.run("hex_decode_32_hexDecode", idsHex.size(), [&]{
+            uint64_t n = 0;
+            for (auto &h : idsHex) n += hexDecode(h).size();
+            benchSink = n;
+        });
+
+        runner.run("hex_encode_256KiB_to_hex", payloadOps, [&]{
+            uint64_t n = 0;
+            for (uint64_t i = 0; i < payloadOps; i++) n += to_hex(payload).size();
+            benchSink = n;
+        });
+
+        runner.run("hex_encode_256KiB_hexEncode", payloadOps, [&]{
+            uint64_t n = 0;
+            for (uint64_t i = 0; i < payloadOps; i++) n += hexEncode(payload).size();
+            benchSink = n;
+        });
+
+        runner.run("hex_decode_256KiB_from_hex", payloadOps, [&]{
+            uint64_t n = 0;
+            for (uint64_t i = 0; i < payloadOps; i++) n += from_hex(payloadHex, false).size();
+            benchSink = n;
+        });
+
+        runner.run("hex_decode_256KiB_hexDecode", payloadOps, [&]{
+            uint64_t n = 0;
+            for (uint64_t i = 0; i < payloadOps; i++) n += hexDecode(payloadHex).size();
+            benchSink = n;
+        });
+    }
+
+
+    // Populate a temporary DB
+
+    auto mainEnv = openTempEnv(tmpDir + "/main");
+    insertAll(*mainEnv, packedStrs, jsonStrs, 1'000);
+
+    // writeEvents: each rep inserts everything into a fresh DB
+
+    {
+        uint64_t rep = 0;
+
+        runner.run("writeEvents_batch100", packedStrs.size(), [&]{
+            auto dir = tmpDir + "/write" + std::to_string(rep++);
+            auto e = openTempEnv(dir);
+            insertAll(*e, packedStrs, jsonStrs, 100);
+            e.reset();
+            std::filesystem::remove_all(dir);
+        });
+    }
+
+
+    // DBScan, one query type per index
+
+    {
+        const uint64_t numQueries = 500;
+
+        auto idsOf = [&](uint64_t n){
+            tao::json::value o = tao::json::empty_array;
+            for (uint64_t i = 0; i < n; i++) o.emplace_back(evJsons[rng() % evJsons.size()].at("id"));
+            return o;
+        };
+
+        std::vector<std::pair<std::string, std::function<tao::json::value()>>> scanTypes = {
+            { "Id", [&]{ return tao::json::value({ { "ids", idsOf(10) } }); } },
+            { "Tag", [&]{ return tao::json::value({ { "#t", randomHashtags(3) }, { "limit", 100 } }); } },
+            { "PubkeyKind", [&]{ return tao::json::value({ { "authors", randomAuthors(20) }, { "kinds", tao::json::value::array({ 1, 6 }) }, { "limit", 100 } }); } },
+            { "Pubkey", [&]{ return tao::json::value({ { "authors", randomAuthors(20) }, { "limit", 100 } }); } },
+            { "Kind", [&]{ return tao::json::value({ { "kinds", tao::json::value::array({ 0 }) }, { "limit", 100 } }); } },
+            { "CreatedAt", [&]{ return tao::json::value({ { "limit", 100 } }); } },
+        };
+
+        for (auto &[indexName, makeFilter] : scanTypes) {
+            std::vector<tao::json::value> filters;
+            for (uint64_t i = 0; i < numQueries; i++) filters.emplace_back(makeFilter());
+
+            runner.run(std::string("DBScan_") + indexName, numQueries, [&]{
+                auto txn = mainEnv->txn_ro();
+                uint64_t n = 0;
+
+                for (auto &filter : filters) {
+                    DBQuery query(filter);
+                    query.process(txn, [&](const auto &, uint64_t levId){ n += levId; });
+                }
+
+                benchSink = n;
+            });
+        }
+    }
+
+
+    // ActiveMonitors
+
+    for (auto numSubs : monitorSubCounts) {
+        std::string name = std::string("ActiveMonitors_process_") + std::to_string(numSubs);
+        if (!runner.enabled(name)) continue;
+
+        auto txn = mainEnv->txn_ro();
+        ActiveMonitors monitors;
+
+        // Monitors use levIds to avoid re-sending, so install them as of before the first event
+        for (uint64_t i = 0; i < numSubs; i++) {
+            tao::json::value filter;
+
+            switch (rng() % 4) {
+                case 0: filter = tao::json::value({ { "authors", randomAuthors(1 + rng() % 10) } }); break;
+                case 1: filter = tao::json::value({ { "#t", randomHashtags(1 + rng() % 3) } }); break;
+                case 2: filter = tao::json::value({ { "authors", randomAuthors(1 + rng() % 10) }, { "kinds", tao::json::value::array({ 1 }) } }); break;
+                default: filter = tao::json::value({ { "#p", randomAuthors(1) } }); break;
+            }
+
+            Subscription sub(i, "s", NostrFilterGroup::unwrapped(filter), "default");
+            sub.latestEventId = 0;
+            monitors.addSub(txn, std::move(sub), 0);
+        }
+
+        std::vector<defaultDb::environment::View_Event> views;
+        mainEnv->foreach_Event(txn, [&](auto &ev){
+            views.push_back(ev);
+            return views.size() < 1'000;
+        });
+
+        // Monitors skip events they have already seen, so every rep presents the events with higher levIds
+        uint64_t offset = 0;
+
+        runner.run(name, views.size(), [&]{
+            uint64_t n = 0;
+            offset += views.size();
+
+            for (auto ev : views) {
+                ev.primaryKeyId += offset;
+                monitors.process(txn, ev, [&](RecipientList &&recipients, uint64_t){ n += recipients.size(); });
+            }
+
+            benchSink = n;
+        });
+    }
+
+
+    // Decompressor
+
+    {
+        auto txn = mainEnv->txn_rw();
+
+        std::string trainingBuf;
+        std::vector<size_t> trainingSizes;
+
+        for (size_t i = 0; i < std::min(jsonStrs.size(), size_t(10'000)); i++) {
+            trainingBuf += jsonStrs[i];
+            trainingSizes.push_back(jsonStrs[i].size());
+        }
+
+        std::string dict(100'000, '\0');
+        auto ret = ZDICT_trainFromBuffer(dict.data(), dict.size(), trainingBuf.data(), trainingSizes.data(), trainingSizes.size());
+        if (ZDICT_isError(ret)) throw herr("zstd training failed: ", ZSTD_getErrorName(ret));
+        dict.resize(ret);
+
+        uint64_t dictId = mainEnv->insert_CompressionDictionary(txn, dict);
+        txn.commit();
+
+        auto *cctx = ZSTD_createCCtx();
+        auto *cdict = ZSTD_createCDict(dict.data(), dict.size(), 3);
+
+        std::vector<std::string> withDict, withoutDict;
+
+        for (auto &j : jsonStrs) {
+            std::string buf(ZSTD_compressBound(j.size()), '\0');
+
+            auto n = ZSTD_compress_usingCDict(cctx, buf.data(), buf.size(), j.data(), j.size(), cdict);
+            withDict.emplace_back(buf.data(), n);
+
+            n = ZSTD_compressCCtx(cctx, buf.data(), buf.size(), j.data(), j.size(), 3);
+            withoutDict.emplace_back(buf.data(), n);
+        }
+
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeCCtx(cctx);
+
+        auto rtxn = mainEnv->txn_ro();
+        Decompressor decomp;
+        decomp.reserve(cfg().events__maxEventSize);
+
+        runner.run("Decompressor_decompress_dict", withDict.size(), [&]{
+            uint64_t n = 0;
+            for (auto &c : withDict) n += decomp.decompress(rtxn, dictId, c).size();
+            benchSink = n;
+        });
+
+        runner.run("Decompressor_decompress_nodict", withoutDict.size(), [&]{
+            uint64_t n = 0;
+            for (auto &c : withoutDict) {
+                auto ret = ZSTD_decompressDCtx(decomp.dctx, decomp.buffer.data(), decomp.buffer.size(), c.data(), c.size());
+                if (ZSTD_isError(ret)) throw herr("zstd decompression failed: ", ZSTD_getErrorName(ret));
+                n += ret;
+            }
+            benchSink = n;
+        });
+    }
+
+    mainEnv.reset();
+    if (removeTmpDir) std::filesystem::remove_all(tmpDir);
+
+
+    // Output
+
+    if (format == "csv") {
+        std::cout << "name,ops,median_ns_per_op,min_ns_per_op,max_ns_per_op\n";
+        for (auto &r : runner.results) {
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%s,%lu,%.2f,%.2f,%.2f", r.name.c_str(), (unsigned long)r.ops, r.medianNs, r.minNs, r.maxNs);
+            std::cout << buf << "\n";
+        }
+    } else {
+        tao::json::value output = tao::json::empty_array;
+
+        for (auto &r : runner.results) {
+            output.emplace_back(tao::json::value({
+                { "name", r.name },
+                { "ops", r.ops },
+                { "median_ns_per_op", r.medianNs },
+                { "min_ns_per_op", r.minNs },
+                { "max_ns_per_op", r.maxNs },
+            }));
+        }
+
+        std::cout << tao::json::to_string(output, 2) << "\n";
+    }
+
+    std::cout << std::flush;
+}
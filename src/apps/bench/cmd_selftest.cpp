@@ -0,0 +1,183 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+
+#include <filesystem>
+#include <iostream>
+#include <random>
+
+#include <docopt.h>
+
+#include "golpe.h"
+
+#include "ColdStorage.h"
+
+
+static const char USAGE[] =
+R"(
+    Usage:
+      selftest cold-short-write [--dir=<dir>]
+      selftest hex [--seed=<seed>]
+
+    Checks of code paths that are hard to reach from the outside, used by the scripts in test/.
+    Prints OK on success, and otherwise throws.
+
+    Modes:
+      cold-short-write   Forces a cold segment write to fail part-way, then checks that the
+                         segment is rolled back and later records are still readable
+      hex                Checks each hex codec supported by this CPU against the scalar one,
+                         including tails, misaligned input, upper-case and invalid chars
+
+    Options:
+      --dir=<dir>        Directory for the temporary LMDB environment (default is a new directory in /tmp)
+      --seed=<seed>      Random seed for generated inputs [default: 1]
+)";
+
+
+static uint64_t fileSize(const std::string &path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st)) throw herr("unable to stat ", path, ": ", strerror(errno));
+    return st.st_size;
+}
+
+static void testColdShortWrite(const std::string &dir) {
+    defaultDb::environment e;
+    e.open(dir, true, 0);
+
+    MDB_env *menv = e.lmdb_env.handle();
+    auto segPath = ColdStorage::coldDir(menv) + "/1.seg";
+
+    ColdStorage::Writer writer(menv, 1'000'000);
+
+    std::string rec1(100, 'a'), rec2(5000, 'b'), rec3(200, 'c');
+
+    auto stub1 = writer.append(1, rec1);
+    writer.sync();
+    uint64_t sizeBefore = fileSize(segPath);
+
+    // Let the next write only partially succeed: the first write() call is cut short at the
+    // limit, and the retry fails with EFBIG (SIGXFSZ is ignored so the process survives)
+
+    struct rlimit origLimit;
+    if (::getrlimit(RLIMIT_FSIZE, &origLimit)) throw herr("getrlimit failed: ", strerror(errno));
+
+    auto origHandler = ::signal(SIGXFSZ, SIG_IGN);
+
+    struct rlimit shortLimit = origLimit;
+    shortLimit.rlim_cur = sizeBefore + 1000;
+    if (::setrlimit(RLIMIT_FSIZE, &shortLimit)) throw herr("setrlimit failed: ", strerror(errno));
+
+    bool threw = false;
+    try {
+        writer.append(2, rec2);
+    } catch (std::exception &err) {
+        threw = true;
+        LI << "Expected error: " << err.what();
+    }
+
+    if (::setrlimit(RLIMIT_FSIZE, &origLimit)) throw herr("setrlimit failed: ", strerror(errno));
+    ::signal(SIGXFSZ, origHandler);
+
+    if (!threw) throw herr("append past RLIMIT_FSIZE didn't fail");
+    if (fileSize(segPath) != sizeBefore) throw herr("partial record left in segment: ", fileSize(segPath), " != ", sizeBefore);
+
+    auto stub3 = writer.append(3, rec3);
+    writer.sync();
+
+    if (fileSize(segPath) != sizeBefore + ColdStorage::RecordHeaderSize + rec3.size()) throw herr("unexpected segment size after recovery");
+
+    auto txn = e.txn_ro();
+    std::string buf;
+
+    if (coldStorage.read(txn, stub1, buf) != rec1) throw herr("record 1 mismatch");
+    if (coldStorage.read(txn, stub3, buf) != rec3) throw herr("record 3 mismatch after short write");
+}
+
+static void testHex(uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    auto randInt = [&](uint64_t n){ return std::uniform_int_distribution<uint64_t>(0, n - 1)(rng); };
+
+    auto expectThrow = [](const std::string &impl, const std::string &in, const char *what){
+        try {
+            hexDecodeWith(impl, in);
+        } catch (std::exception &) {
+            return;
+        }
+        throw herr("hex ", impl, ": decode accepted ", what);
+    };
+
+    const std::string invalidChars = std::string("gGzZ/:@`x \x7f\x80\xff", 13) + '\0';
+
+    auto impls = hexImplNames();
+    uint64_t numCases = 0;
+
+    // Lengths span several AVX2 blocks so every tail size is covered, at each alignment
+
+    for (uint64_t len = 0; len <= 200; len++) {
+        for (uint64_t offset = 0; offset < 4; offset++) {
+            std::string buf(offset + len, '\0');
+            for (auto &c : buf) c = (char)randInt(256);
+            std::string_view input = std::string_view(buf).substr(offset);
+
+            std::string ref;
+            for (auto c : input) {
+                char tmp[3];
+                snprintf(tmp, sizeof(tmp), "%02x", (unsigned)(uint8_t)c);
+                ref += tmp;
+            }
+
+            std::string mixedCase = ref;
+            for (auto &c : mixedCase) {
+                if (c >= 'a' && c <= 'f' && randInt(2)) c = c - 'a' + 'A';
+            }
+
+            for (const auto &impl : impls) {
+                if (hexEncodeWith(impl, input) != ref) throw herr("hex ", impl, ": encode mismatch at len ", len, " offset ", offset);
+                if (hexDecodeWith(impl, ref) != input) throw herr("hex ", impl, ": decode mismatch at len ", len, " offset ", offset);
+                if (hexDecodeWith(impl, mixedCase) != input) throw herr("hex ", impl, ": mixed-case decode mismatch at len ", len, " offset ", offset);
+
+                if (len) {
+                    expectThrow(impl, ref.substr(1), "odd length");
+
+                    std::string bad = ref;
+                    bad[randInt(bad.size())] = invalidChars[randInt(invalidChars.size())];
+                    expectThrow(impl, bad, "invalid char");
+                }
+
+                numCases++;
+            }
+        }
+    }
+
+    for (const auto &impl : impls) LI << "hex " << impl << ": ok";
+    LI << "hex: " << numCases << " cases";
+}
+
+
+void cmd_selftest(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    if (args["cold-short-write"].asBool()) {
+        std::string tmpDir;
+        bool removeTmpDir = false;
+        if (args["--dir"]) {
+            tmpDir = args["--dir"].asString();
+            std::filesystem::create_directories(tmpDir);
+        } else {
+            char tmpl[] = "/tmp/strfry-selftest-XXXXXX";
+            if (!mkdtemp(tmpl)) throw herr("mkdtemp failed: ", strerror(errno));
+            tmpDir = tmpl;
+            removeTmpDir = true;
+        }
+
+        testColdShortWrite(tmpDir);
+
+        if (removeTmpDir) std::filesystem::remove_all(tmpDir);
+    } else if (args["hex"].asBool()) {
+        testHex(std::stoull(args["--seed"].asString()));
+    }
+
+    std::cout << "OK" << std::endl;
+}
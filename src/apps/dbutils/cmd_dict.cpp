@@ -67,6 +67,14 @@ void cmd_dict(const std::vector<std::string> &subArgs) {
 
         btree_map<uint32_t, uint64_t> dicts;
 
+        struct KindStats {
+            uint64_t events = 0;
+            uint64_t size = 0;
+            uint64_t compressedSize = 0;
+        };
+
+        btree_map<uint64_t, KindStats> kinds;
+
         env.foreach_CompressionDictionary(txn, [&](auto &view){
             auto dictId = view.primaryKeyId;
             if (!dicts.contains(dictId)) dicts[dictId] = 0;
@@ -83,13 +91,21 @@ void cmd_dict(const std::vector<std::string> &subArgs) {
             size_t outCompressedSize;
 
             auto json = decodeEventPayload(txn, decomp, raw, &dictId, &outCompressedSize);
+            bool compressed = raw[0] != '\x00';
+            uint64_t storedSize = compressed ? outCompressedSize : json.size();
 
             totalSize += json.size();
-            totalCompressedSize += dictId ? outCompressedSize : json.size();
+            totalCompressedSize += storedSize;
+
+            if (compressed) numCompressed++;
+            if (dictId) dicts[dictId]++;
 
-            if (dictId) {
-                numCompressed++;
-                dicts[dictId]++;
+            auto ev = env.lookup_Event(txn, levId);
+            if (ev) {
+                auto &k = kinds[PackedEventView(ev->buf).kind()];
+                k.events++;
+                k.size += json.size();
+                k.compressedSize += storedSize;
             }
         }
 
@@ -103,6 +119,13 @@ void cmd_dict(const std::vector<std::string> &subArgs) {
         for (auto &[dictId, n] : dicts) {
             std::cout << "  " << dictId << " : " << n << "\n";
         }
+
+        std::cout << "\nkind : events, uncompressed size, compressed size (ratio)\n";
+
+        for (auto &[kind, k] : kinds) {
+            std::cout << "  " << kind << " : " << k.events << ", " << renderSize(k.size) << ", " << renderSize(k.compressedSize)
+                      << " (" << renderPercent(1.0 - (double)k.compressedSize / k.size) << ")\n";
+        }
     } else if (args["train"].asBool()) {
         std::string trainingBuf;
         std::vector<size_t> trainingSizes;
@@ -60,7 +60,7 @@ void cmd_export(const std::vector<std::string> &subArgs) {
             o = json;
             o.resize(o.size() - 1);
             o += ",\"fried\":\"";
-            o += to_hex(ev.buf);
+            o += hexEncode(ev.buf);
             o += "\"}\n";
 
             std::cout << o;
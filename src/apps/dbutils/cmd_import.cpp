@@ -26,7 +26,7 @@ EventToWrite parseFried(std::string &line) {
 
     if (!std::string_view(line).substr(0, i + 1).ends_with(",\"fried\":\"")) throw herr("fried parse error");
 
-    std::string packed = from_hex(std::string_view(line).substr(i + 1, line.size() - i - 3));
+    std::string packed = hexDecode(std::string_view(line).substr(i + 1, line.size() - i - 3));
 
     line[i - 9] = '}';
     line.resize(i - 8);
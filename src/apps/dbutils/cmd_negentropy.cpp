@@ -1,4 +1,5 @@
 #include <iostream>
+#include <filesystem>
 
 #include <docopt.h>
 #include "golpe.h"
@@ -12,22 +13,50 @@
 static const char USAGE[] =
 R"(
     Usage:
-      negentropy list
-      negentropy add <filter>
-      negentropy build <treeId>
+      negentropy list [--tenant=<subdomain>]
+      negentropy add [--tenant=<subdomain>] <filter>
+      negentropy build [--tenant=<subdomain>] <treeId>
+
+    Options:
+      --tenant=<subdomain>  Operate on the DB of a tenant of a multi-tenant relay, instead of the main DB
 )";
 
 
-static void increaseModCounter(lmdb::txn &txn) {
-    auto m = env.lookup_Meta(txn, 1);
-    if (!m) throw herr("no Meta entry?");
-    env.update_Meta(txn, *m, { .negentropyModificationCounter = m->negentropyModificationCounter() + 1 });
+static std::unique_ptr<defaultDb::environment> openTenantEnv(const std::string &subdomain) {
+    std::string tenantDbDir = dbDir + "/tenants/" + subdomain;
+    if (!std::filesystem::exists(tenantDbDir + "/data.mdb")) throw herr("no DB for tenant: ", subdomain);
+
+    auto tenantEnv = std::make_unique<defaultDb::environment>();
+
+    unsigned int dbFlags = 0;
+    if (cfg().dbParams__noReadAhead) dbFlags |= MDB_NORDAHEAD;
+
+    if (cfg().dbParams__maxreaders > 0 || cfg().dbParams__mapsize > 0) {
+        tenantEnv->lmdb_env.set_max_dbs(64);
+        tenantEnv->lmdb_env.set_max_readers(cfg().dbParams__maxreaders);
+        tenantEnv->lmdb_env.set_mapsize(cfg().dbParams__mapsize);
+        tenantEnv->open(tenantDbDir, false, dbFlags);
+    } else {
+        tenantEnv->open(tenantDbDir, true, dbFlags);
+    }
+
+    auto txn = tenantEnv->txn_rw();
+    auto ver = getDBVersion(txn);
+    if (ver != CURR_DB_VERSION) throw herr("tenant DB version is ", ver, ", expected ", CURR_DB_VERSION, ": start the relay to upgrade it");
+    setupNegentropyDbi(txn);
+    txn.commit();
+
+    return tenantEnv;
 }
 
 
 void cmd_negentropy(const std::vector<std::string> &subArgs) {
     std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
 
+    std::unique_ptr<defaultDb::environment> tenantEnv;
+    if (args["--tenant"]) tenantEnv = openTenantEnv(args["--tenant"].asString());
+    auto &env = tenantEnv ? *tenantEnv : ::env;
+
     if (args["list"].asBool()) {
         auto txn = env.txn_ro();
 
@@ -36,8 +65,11 @@ void cmd_negentropy(const std::vector<std::string> &subArgs) {
 
             std::cout << "tree " << treeId << "\n";
             std::cout << "  filter: " << f.filter() << "\n";
+            if (f.autoManaged()) std::cout << "  auto: created by relay\n";
+            if (f.state() == 1) std::cout << "  state: building\n";
+            else if (f.state() == 2) std::cout << "  state: dropping\n";
 
-            negentropy::storage::BTreeLMDB storage(txn, negentropyDbi, treeId);
+            negentropy::storage::BTreeLMDB storage(txn, getNegentropyDbi(txn), treeId);
             auto size = storage.size();
             std::cout << "  size: " << size << "\n";
             std::cout << "  fingerprint: " << to_hex(storage.fingerprint(0, size).sv()) << "\n";
@@ -58,14 +90,14 @@ void cmd_negentropy(const std::vector<std::string> &subArgs) {
         filterStr = tao::json::to_string(filterJson); // make canonical
 
         auto txn = env.txn_rw();
-        increaseModCounter(txn);
+        NegentropyFilterCache::increaseModCounter(txn);
 
         env.foreach_NegentropyFilter(txn, [&](auto &f){
             if (f.filter() == filterStr) throw herr("filter already exists as tree: ", f.primaryKeyId);
             return true;
         });
 
-        uint64_t treeId = env.insert_NegentropyFilter(txn, filterStr);
+        uint64_t treeId = env.insert_NegentropyFilter(txn, filterStr, 0, 0);
         txn.commit();
 
         std::cout << "created tree " << treeId << "\n";
@@ -81,7 +113,7 @@ void cmd_negentropy(const std::vector<std::string> &subArgs) {
         std::vector<Record> recs;
 
         auto txn = env.txn_rw(); // FIXME: split this into a read-only phase followed by a write
-        increaseModCounter(txn);
+        NegentropyFilterCache::increaseModCounter(txn);
 
         // Get filter
 
@@ -97,20 +129,29 @@ void cmd_negentropy(const std::vector<std::string> &subArgs) {
 
         DBQuery query(tao::json::from_string(filterStr));
 
-        while (1) {
-            bool complete = query.process(txn, [&](const auto &sub, uint64_t levId){
-                auto ev = lookupEventByLevId(txn, levId);
-                auto packed = PackedEventView(ev.buf);
-                recs.emplace_back(packed.created_at(), packed.id());
-                //memcpy(recs.back().id, packed.id().data(), 32);
-            });
+        auto addRec = [&](uint64_t createdAt, std::string_view id){
+            recs.emplace_back(createdAt, id);
+        };
+
+        if (canScanNegentropyIndex(txn, query.sub.filterGroup)) {
+            foreachNegentropyIndexItem(txn, query.sub.filterGroup, query.sub.latestEventId, addRec);
+        } else {
+            std::vector<uint64_t> levIds;
+
+            while (1) {
+                bool complete = query.process(txn, [&](const auto &sub, uint64_t levId){
+                    levIds.push_back(levId);
+                });
+
+                if (complete) break;
+            }
 
-            if (complete) break;
+            foreachNegentropyItem(txn, levIds, addRec);
         }
 
         // Store events in negentropy tree
 
-        negentropy::storage::BTreeLMDB storage(txn, negentropyDbi, treeId);
+        negentropy::storage::BTreeLMDB storage(txn, getNegentropyDbi(txn), treeId);
 
         for (const auto &r : recs) {
             storage.insert(r.created_at, r.id.sv());
@@ -1,3 +1,6 @@
+#include <deque>
+#include <mutex>
+
 #include <docopt.h>
 #include <tao/json.hpp>
 #include <hoytech/file_change_monitor.h>
@@ -6,7 +9,9 @@
 
 #include "golpe.h"
 
+#include "Bytes32.h"
 #include "WriterPipeline.h"
+#include "ActiveMonitors.h"
 #include "PluginEventSifter.h"
 #include "events.h"
 #include "filters.h"
@@ -32,20 +37,92 @@ struct RouterEvent : NonCopyable {
     struct ReconnectCron {
     };
 
-    using Var = std::variant<ConfigFileChange, DBChange, ReconnectCron>;
+    struct FlushWrites {
+    };
+
+    using Var = std::variant<ConfigFileChange, DBChange, ReconnectCron, FlushWrites>;
     Var msg;
     RouterEvent(Var &&msg_) : msg(std::move(msg_)) {}
 };
 
 
 struct ConnDesignator {
-    std::string groupName;
     std::string url;
 };
 
 
 
+// There is one connection per url, shared by all the stream groups that list it. Each group that
+// streams down has its own REQ on the connection, and incoming events are routed by sub id.
+//
+// Events going up are serialised once and queued on each connection that wants them. Only a limited
+// number are sent without an OK. Each connection has a cursor into the DB: when its queue is full,
+// or it gets disconnected, it falls behind and later catches up by re-reading events from the DB,
+// starting after the last event that was acked.
+
+struct OutgoingEvent {
+    uint64_t levId;
+    std::string idHex;
+    std::shared_ptr<std::string> msg;
+};
+
 struct Router {
+    struct Connection {
+        uWS::WebSocket<uWS::CLIENT> *ws = nullptr;
+        uint64_t started = 0;
+        std::map<std::string, std::string> activeSubs; // subId -> groupName, REQs currently open on ws
+
+        uint64_t upCursor = 0; // events up to this levId have been queued or didn't need uploading
+        std::deque<OutgoingEvent> outQueue; // not yet sent
+        flat_hash_map<std::string, std::pair<uint64_t, uint64_t>> inFlight; // idHex -> (levId, sent time), awaiting OK
+        flat_hash_map<uint64_t, uint64_t> okTimeouts; // levId -> number of times it got no OK in time
+
+        // Events that got no OK in time more than okRetries times are skipped from then on
+        bool gaveUpOn(uint64_t levId, uint64_t okRetries) {
+            auto it = okTimeouts.find(levId);
+            return it != okTimeouts.end() && it->second > okRetries;
+        }
+
+        // Forgets the timeouts of events that no rewind can reach any more
+        void pruneOkTimeouts() {
+            uint64_t lowest = upCursor + 1;
+            for (const auto &[idHex, f] : inFlight) lowest = std::min(lowest, f.first);
+            if (outQueue.size()) lowest = std::min(lowest, outQueue.front().levId);
+
+            for (auto it = okTimeouts.begin(); it != okTimeouts.end(); ) {
+                if (it->first < lowest) okTimeouts.erase(it++);
+                else ++it;
+            }
+        }
+
+        // Rewinds the cursor so that the event at levId, and everything queued or sent after it, is sent again
+        void rewindTo(uint64_t levId) {
+            upCursor = std::min(upCursor, levId - 1);
+            outQueue.clear(); // always queued after everything in flight
+
+            for (auto it = inFlight.begin(); it != inFlight.end(); ) {
+                if (it->second.first >= levId) inFlight.erase(it++);
+                else ++it;
+            }
+        }
+
+        // Rewinds the cursor so that unacked events are sent again after reconnecting
+        void rewind() {
+            for (const auto &[idHex, f] : inFlight) upCursor = std::min(upCursor, f.first - 1);
+            if (outQueue.size()) upCursor = std::min(upCursor, outQueue.front().levId - 1);
+
+            outQueue.clear();
+            inFlight.clear();
+        }
+
+        ~Connection() {
+            if (ws) {
+                ws->close();
+                ws = nullptr;
+            }
+        }
+    };
+
     struct StreamGroup : NonCopyable {
         std::string groupName;
         Router *router;
@@ -55,26 +132,16 @@ struct Router {
         std::string pluginDownCmd;
         std::string pluginUpCmd;
         std::vector<std::string> urls;
-
-        struct Connection {
-            uWS::WebSocket<uWS::CLIENT> *ws = nullptr;
-            uint64_t started = 0;
-
-            ~Connection() {
-                if (ws) {
-                    ws->close();
-                    ws = nullptr;
-                }
-            }
-        };
-        std::map<std::string, Connection> conns; // url -> Connection
+        std::string subId; // changes whenever the REQ must be re-sent
+        uint64_t monitorId; // "connId" of this group's sub in upMonitors
+        std::string monitoredSubId; // sub id installed in upMonitors, if any
 
         tao::json::value filter;
         NostrFilterGroup filterCompiled;
         PluginEventSifter pluginDown;
         PluginEventSifter pluginUp;
 
-        StreamGroup(std::string groupName, Router *router) : groupName(groupName), router(router) {
+        StreamGroup(std::string groupName, Router *router) : groupName(groupName), router(router), monitorId(router->nextMonitorId++) {
         }
 
         void configure(const tao::config::value &spec) {
@@ -113,113 +180,71 @@ struct Router {
                 urls.push_back(url.get_string());
             }
 
-            // Disconnect any urls that were deleted
-
-            {
-                std::set<std::string> unneededUrls;
-                for (auto &[url, c] : conns) unneededUrls.insert(url);
-                for (const auto &url : urls) unneededUrls.erase(url);
-                for (const auto &url : unneededUrls) conns.erase(url);
-            }
-
-
-            if (needsReconnect) {
-                for (auto &[url, c] : conns) {
-                    if (c.ws) c.ws->close();
-                }
-                conns.clear();
-            }
-
-            tryConnects();
-        }
-
+            // Connections are shared, so instead of reconnecting the REQ is replaced
 
-        void tryConnects() {
-            for (const auto &url : urls) {
-                if (conns.find(url) == conns.end()) conns.try_emplace(url);
-                auto &c = conns.at(url);
-
-                if (!c.ws && c.started + (router->connectionTimeoutUs * 2) < hoytech::curr_time_us()) {
-                    LI << groupName << ": Connecting to " << url;
-                    router->hub.connect(url, (void*)(new ConnDesignator(groupName, url)), {}, router->connectionTimeoutUs / 1'000, router->hubGroup);
-                    c.started = hoytech::curr_time_us();
-                }
-            }
+            if (needsReconnect) subId = "R" + std::to_string(router->nextSubId++);
         }
 
-        void connOpen(const std::string &url, uWS::WebSocket<uWS::CLIENT> *ws) {
-            if (!conns.contains(url)) return;
-            auto &c = conns.at(url);
-
-            if (c.ws) {
-                LI << "Already had open connection to " << url << ", closing";
-                ws->close();
-                return;
-            }
-
-            c.ws = ws;
-
-            if (dir == "down" || dir == "both") {
-                tao::json::value filterToSend = filter;
-                filterToSend["limit"] = 0;
-
-                auto msg = tao::json::to_string(tao::json::value::array({ "REQ", "X", filterToSend }));
-                ws->send(msg.data(), msg.size(), uWS::OpCode::TEXT, nullptr, nullptr, true);
-            }
+        bool streamsDown() const {
+            return dir == "down" || dir == "both";
         }
 
-        void connClose(const std::string &url, uWS::WebSocket<uWS::CLIENT> *ws) {
-            if (!conns.contains(url)) return;
-            auto &c = conns.at(url);
-
-            if (c.ws == ws) {
-                c.ws = nullptr;
-                c.started = 0;
-            }
+        bool hasUrl(const std::string &url) const {
+            return std::find(urls.begin(), urls.end(), url) != urls.end();
         }
 
-        void incomingEvent(const std::string &url, tao::json::value &evJson) {
-            if (dir == "up") return;
+        // Returns true if the event was passed on to the writer
+        bool incomingEvent(const std::string &url, tao::json::value &evJson) {
+            if (dir == "up") return false;
 
             std::string okMsg;
 
             auto res = pluginDown.acceptEvent(pluginDownCmd, evJson, EventSourceType::Stream, url, okMsg);
             if (res == PluginEventSifterResult::Accept) {
-                router->writer.write({ std::move(evJson), });
+                router->pendingWrites.push_back({ std::move(evJson), });
+                return true;
             } else {
                 if (okMsg.size()) LI << groupName << " / " << url << " : pluginDown blocked event " << evJson.at("id").get_string() << ": " << okMsg;
+                return false;
             }
         }
 
-        void outgoingEvent(lmdb::txn &txn, defaultDb::environment::View_Event &ev, std::string &responseStr, tao::json::value &evJson) {
-            if (dir == "down") return;
-            if (!filterCompiled.doesMatch(PackedEventView(ev.buf))) return;
-
-            if (responseStr.size() == 0) {
+        // Called for events that match this group's filter. Returns true if the event should be uploaded
+        // to this group's urls. out and evJson are filled in by the first group that needs them
+        bool acceptOutgoing(lmdb::txn &txn, defaultDb::environment::View_Event &ev, OutgoingEvent &out, tao::json::value &evJson) {
+            if (!out.msg) {
                 auto evStr = getEventJson(txn, router->decomp, ev.primaryKeyId);
                 evJson = tao::json::from_string(evStr);
 
-                responseStr = std::string("[\"EVENT\",");
-                responseStr += evStr;
-                responseStr += "]";
+                out.idHex = evJson.at("id").get_string();
+                out.msg = std::make_shared<std::string>("[\"EVENT\",");
+                *out.msg += evStr;
+                *out.msg += "]";
             }
 
             std::string okMsg;
 
             auto res = pluginUp.acceptEvent(pluginUpCmd, evJson, EventSourceType::Stored, "", okMsg);
-            if (res == PluginEventSifterResult::Accept) {
-                for (auto &[url, c] : conns) {
-                    if (c.ws) c.ws->send(responseStr.data(), responseStr.size(), uWS::OpCode::TEXT, nullptr, nullptr, true);
-                }
-            } else {
-                if (okMsg.size()) LI << groupName << " : pluginUp blocked event " << evJson.at("id").get_string() << ": " << okMsg;
-            }
+            if (res == PluginEventSifterResult::Accept) return true;
+
+            if (okMsg.size()) LI << groupName << " : pluginUp blocked event " << out.idHex << ": " << okMsg;
+            return false;
         }
     };
 
     std::string routerConfigFile;
     const uint64_t defaultConnectionTimeoutUs = 20'000'000;
     uint64_t connectionTimeoutUs = 0;
+    const uint64_t flushIntervalUs = 100'000;
+    const size_t maxPendingWrites = 500;
+    const size_t maxRecentEvents = 100'000;
+    const size_t defaultMaxOutQueue = 10'000;
+    size_t maxOutQueue = 0;
+    const size_t defaultMaxInFlight = 100;
+    size_t maxInFlight = 0;
+    uint64_t okTimeoutUs = 0; // defaults to connectionTimeoutUs
+    const uint64_t defaultOkRetries = 3;
+    uint64_t okRetries = 0;
 
     WriterPipeline writer;
     Decompressor decomp;
@@ -229,6 +254,16 @@ struct Router {
     uS::Async *hubTrigger = nullptr;
 
     std::map<std::string, StreamGroup> streamGroups; // group name -> StreamGroup
+    std::map<std::string, Connection> conns; // url -> Connection
+    uint64_t nextSubId = 0;
+    ActiveMonitors upMonitors; // filters of the groups that stream up, so each event is matched once
+    flat_hash_map<uint64_t, std::string> monitorGroups; // monitorId -> group name
+    uint64_t nextMonitorId = 1;
+    std::vector<WriterPipelineInput> pendingWrites;
+    flat_hash_map<Bytes32, std::string> recentEvents; // id -> sig, for events the writer recently verified
+    std::deque<Bytes32> recentEventsOrder;
+    std::mutex verifiedMutex;
+    std::vector<std::pair<Bytes32, std::string>> verifiedEvents; // from the validator thread, not yet in recentEvents
     uint64_t currEventId = 0;
     bool firstConfigLoadSuccess = false;
 
@@ -239,27 +274,54 @@ struct Router {
             currEventId = getMostRecentLevId(txn);
         }
 
+        writer.onVerified = [this](const tao::json::value &evJson){
+            auto id = hexDecode(evJson.at("id").get_string());
+            auto sig = hexDecode(evJson.at("sig").get_string());
+
+            std::lock_guard<std::mutex> guard(verifiedMutex);
+            verifiedEvents.emplace_back(Bytes32(id), std::move(sig));
+        };
+
         hubGroup = hub.createGroup<uWS::CLIENT>(uWS::PERMESSAGE_DEFLATE | uWS::SLIDING_DEFLATE_WINDOW);
 
         hubGroup->onConnection([&](uWS::WebSocket<uWS::CLIENT> *ws, uWS::HttpRequest req) {
             auto *desig = (ConnDesignator*) ws->getUserData();
-            LI << desig->groupName << ": Connected to " << desig->url;
+            LI << "Connected to " << desig->url;
 
-            if (!streamGroups.contains(desig->groupName)) {
-                // Connection to streamGroup that no longer exists
+            if (!conns.contains(desig->url)) {
+                // No stream group uses this url anymore
+                ws->close();
+                return;
+            }
+
+            auto &c = conns.at(desig->url);
+
+            if (c.ws) {
+                LI << "Already had open connection to " << desig->url << ", closing";
                 ws->close();
                 return;
             }
 
-            streamGroups.at(desig->groupName).connOpen(desig->url, ws);
+            c.ws = ws;
+            c.activeSubs.clear();
+            syncSubs(desig->url, c);
+            catchUp(desig->url, c);
+            sendQueued(c);
         });
 
         hubGroup->onDisconnection([&](uWS::WebSocket<uWS::CLIENT> *ws, int code, char *message, size_t length) {
             auto *desig = (ConnDesignator*) ws->getUserData();
-            LI << desig->groupName << ": Disconnected from " << desig->url;
+            LI << "Disconnected from " << desig->url;
+
+            if (conns.contains(desig->url)) {
+                auto &c = conns.at(desig->url);
 
-            if (streamGroups.contains(desig->groupName)) {
-                streamGroups.at(desig->groupName).connClose(desig->url, ws);
+                if (c.ws == ws) {
+                    c.ws = nullptr;
+                    c.started = 0;
+                    c.activeSubs.clear();
+                    c.rewind();
+                }
             }
 
             delete desig;
@@ -267,7 +329,7 @@ struct Router {
 
         hubGroup->onError([&](void *userData) {
             auto *desig = (ConnDesignator*) userData;
-            LI << desig->groupName << ": Error connecting to " << desig->url;
+            LI << "Error connecting to " << desig->url;
 
             delete desig;
         });
@@ -275,13 +337,13 @@ struct Router {
         hubGroup->onMessage2([&](uWS::WebSocket<uWS::CLIENT> *ws, char *message, size_t length, uWS::OpCode, size_t) {
             auto *desig = (ConnDesignator*) ws->getUserData();
 
-            if (!streamGroups.contains(desig->groupName)) {
+            if (!conns.contains(desig->url)) {
                 ws->close();
                 return;
             }
 
             try {
-                handleIncomingMessage(ws, desig, std::string_view(message, length));
+                handleIncomingMessage(conns.at(desig->url), desig->url, std::string_view(message, length));
             } catch (std::exception &e) {
                 LW << "Failed to handle incoming message config: " << e.what();
             }
@@ -310,6 +372,25 @@ struct Router {
                 // FIXME: this won't actually update the cron.repeat() frequency, so no hot reconfigs
             }
 
+            // upload limits
+
+            auto getUnsigned = [&](const char *key, uint64_t defaultVal){
+                return routerConfig.get_object().contains(key) ? routerConfig.at(key).get_unsigned() : defaultVal;
+            };
+
+            uint64_t newOkTimeoutUs = getUnsigned("okTimeout", connectionTimeoutUs / 1'000'000) * 1'000'000;
+            uint64_t newMaxInFlight = std::max(getUnsigned("maxInFlight", defaultMaxInFlight), uint64_t(1));
+            uint64_t newMaxOutQueue = std::max(getUnsigned("maxOutQueue", defaultMaxOutQueue), uint64_t(1));
+            uint64_t newOkRetries = getUnsigned("okRetries", defaultOkRetries);
+
+            if (okTimeoutUs != newOkTimeoutUs || okRetries != newOkRetries || maxInFlight != newMaxInFlight || maxOutQueue != newMaxOutQueue) {
+                okTimeoutUs = newOkTimeoutUs;
+                okRetries = newOkRetries;
+                maxInFlight = newMaxInFlight;
+                maxOutQueue = newMaxOutQueue;
+                LI << "Using upload limits: okTimeout=" << (okTimeoutUs / 1'000'000) << "s okRetries=" << okRetries << " maxInFlight=" << maxInFlight << " maxOutQueue=" << maxOutQueue;
+            }
+
             // load streamGroups
 
             for (const auto &[groupName, spec] : routerConfig.at("streams").get_object()) {
@@ -327,8 +408,17 @@ struct Router {
                 std::set<std::string> unneededGroups;
                 for (auto &[groupName, streamGroup] : streamGroups) unneededGroups.insert(groupName);
                 for (const auto &[groupName, spec] : routerConfig.at("streams").get_object()) unneededGroups.erase(groupName);
-                for (const auto &groupName : unneededGroups) streamGroups.erase(groupName);
+                for (const auto &groupName : unneededGroups) {
+                    auto monitorId = streamGroups.at(groupName).monitorId;
+                    upMonitors.closeConn(monitorId);
+                    monitorGroups.erase(monitorId);
+                    streamGroups.erase(groupName);
+                }
             }
+
+            syncMonitors();
+            tryConnects();
+            for (auto &[url, c] : conns) syncSubs(url, c);
         } catch (std::exception &e) {
             LE << "Failed to parse router config: " << e.what();
             if (!firstConfigLoadSuccess) ::exit(1);
@@ -347,14 +437,260 @@ struct Router {
             } else if (std::get_if<RouterEvent::DBChange>(&newMsg.msg)) {
                 handleDBChange();
             } else if (std::get_if<RouterEvent::ReconnectCron>(&newMsg.msg)) {
-                for (auto &[groupName, streamGroup] : streamGroups) {
-                    streamGroup.tryConnects();
+                tryConnects();
+                expireInFlight();
+            } else if (std::get_if<RouterEvent::FlushWrites>(&newMsg.msg)) {
+                flushWrites();
+            }
+        }
+    }
+
+    // Opens connections to the urls used by any stream group, and closes the rest
+
+    void tryConnects() {
+        std::set<std::string> neededUrls;
+        for (const auto &[groupName, streamGroup] : streamGroups) neededUrls.insert(streamGroup.urls.begin(), streamGroup.urls.end());
+
+        {
+            std::set<std::string> unneededUrls;
+            for (auto &[url, c] : conns) if (!neededUrls.contains(url)) unneededUrls.insert(url);
+            for (const auto &url : unneededUrls) conns.erase(url);
+        }
+
+        for (const auto &url : neededUrls) {
+            auto [it, inserted] = conns.try_emplace(url);
+            auto &c = it->second;
+            if (inserted) c.upCursor = currEventId; // only upload events that arrive from now on
+
+            if (!c.ws && c.started + (connectionTimeoutUs * 2) < hoytech::curr_time_us()) {
+                LI << "Connecting to " << url;
+                hub.connect(url, (void*)(new ConnDesignator(url)), {}, connectionTimeoutUs / 1'000, hubGroup);
+                c.started = hoytech::curr_time_us();
+            }
+        }
+    }
+
+    // Makes the REQs open on a connection match the stream groups that stream down from its url
+
+    void syncSubs(const std::string &url, Connection &c) {
+        if (!c.ws) return;
+
+        std::map<std::string, std::string> wantedSubs;
+
+        for (const auto &[groupName, streamGroup] : streamGroups) {
+            if (streamGroup.streamsDown() && streamGroup.hasUrl(url)) wantedSubs.emplace(streamGroup.subId, groupName);
+        }
+
+        for (auto it = c.activeSubs.begin(); it != c.activeSubs.end(); ) {
+            if (wantedSubs.contains(it->first)) {
+                ++it;
+                continue;
+            }
+
+            auto msg = tao::json::to_string(tao::json::value::array({ "CLOSE", it->first }));
+            c.ws->send(msg.data(), msg.size(), uWS::OpCode::TEXT, nullptr, nullptr, true);
+            it = c.activeSubs.erase(it);
+        }
+
+        for (const auto &[subId, groupName] : wantedSubs) {
+            if (c.activeSubs.contains(subId)) continue;
+
+            tao::json::value filterToSend = streamGroups.at(groupName).filter;
+            filterToSend["limit"] = 0;
+
+            auto msg = tao::json::to_string(tao::json::value::array({ "REQ", subId, filterToSend }));
+            c.ws->send(msg.data(), msg.size(), uWS::OpCode::TEXT, nullptr, nullptr, true);
+            c.activeSubs.emplace(subId, groupName);
+        }
+    }
+
+    // Installs the filters of the groups that stream up, replacing those that changed
+
+    void syncMonitors() {
+        auto txn = env.txn_ro();
+
+        for (auto &[groupName, streamGroup] : streamGroups) {
+            std::string wantedSubId = streamGroup.dir != "down" ? streamGroup.subId : "";
+            if (streamGroup.monitoredSubId == wantedSubId) continue;
+
+            upMonitors.closeConn(streamGroup.monitorId);
+            monitorGroups.erase(streamGroup.monitorId);
+            streamGroup.monitoredSubId = wantedSubId;
+
+            if (wantedSubId.empty()) continue;
+
+            Subscription sub(streamGroup.monitorId, wantedSubId, streamGroup.filterCompiled);
+            sub.latestEventId = currEventId;
+            upMonitors.addSub(txn, std::move(sub), currEventId);
+            monitorGroups.emplace(streamGroup.monitorId, groupName);
+        }
+    }
+
+    // Returns true if any stream group wants the event uploaded to url. Only used when catching up,
+    // for the few groups that list url
+
+    bool wantsOutgoing(lmdb::txn &txn, defaultDb::environment::View_Event &ev, const std::string &url, OutgoingEvent &out, tao::json::value &evJson) {
+        for (auto &[groupName, streamGroup] : streamGroups) {
+            if (streamGroup.dir == "down" || !streamGroup.hasUrl(url)) continue;
+            if (!streamGroup.filterCompiled.doesMatch(PackedEventView(ev.buf))) continue;
+            if (streamGroup.acceptOutgoing(txn, ev, out, evJson)) return true;
+        }
+
+        return false;
+    }
+
+    // Re-reads events from the DB for a connection that fell behind, until its queue is full
+
+    void catchUp(const std::string &url, Connection &c) {
+        if (!c.ws || c.upCursor >= currEventId || c.outQueue.size() >= maxOutQueue / 2) return;
+
+        auto txn = env.txn_ro();
+        bool full = false;
+
+        env.foreach_Event(txn, [&](auto &ev){
+            if (ev.primaryKeyId > currEventId) return false;
+
+            if (c.outQueue.size() >= maxOutQueue) {
+                full = true;
+                return false;
+            }
+
+            OutgoingEvent out{ ev.primaryKeyId, };
+            tao::json::value evJson;
+            if (!c.gaveUpOn(ev.primaryKeyId, okRetries) && wantsOutgoing(txn, ev, url, out, evJson)) c.outQueue.push_back(std::move(out));
+
+            c.upCursor = ev.primaryKeyId;
+            return true;
+        }, false, c.upCursor + 1);
+
+        if (!full) c.upCursor = currEventId;
+    }
+
+    void sendQueued(Connection &c) {
+        while (c.ws && c.outQueue.size() && c.inFlight.size() < maxInFlight) {
+            auto out = std::move(c.outQueue.front());
+            c.outQueue.pop_front();
+
+            c.ws->send(out.msg->data(), out.msg->size(), uWS::OpCode::TEXT, nullptr, nullptr, true);
+            c.inFlight.insert_or_assign(std::move(out.idHex), std::make_pair(out.levId, hoytech::curr_time_us()));
+        }
+    }
+
+    // Relays that don't answer with OK shouldn't stall the connection forever. Events that timed
+    // out are re-read from the DB and sent again, along with everything sent after them. Relays
+    // may never OK some events (ie if they drop them silently), so after okRetries attempts an
+    // event is given up on, and skipped by later rewinds
+
+    void expireInFlight() {
+        uint64_t now = hoytech::curr_time_us();
+
+        for (auto &[url, c] : conns) {
+            std::vector<std::pair<uint64_t, std::string>> expired; // (levId, idHex)
+
+            for (const auto &[idHex, f] : c.inFlight) {
+                if (f.second + okTimeoutUs < now) expired.emplace_back(f.first, idHex);
+            }
+
+            uint64_t oldestLevId = MAX_U64;
+            uint64_t numRetried = 0;
+
+            for (const auto &[levId, idHex] : expired) {
+                if (++c.okTimeouts[levId] > okRetries) {
+                    LW << url << " No OK received for event " << idHex << " after " << okRetries << " retries, giving up on it";
+                    c.inFlight.erase(idHex);
+                    continue;
                 }
+
+                numRetried++;
+                oldestLevId = std::min(oldestLevId, levId);
             }
+
+            if (numRetried) {
+                LW << url << " No OK received for " << numRetried << " events, re-sending from levId " << oldestLevId;
+                c.rewindTo(oldestLevId);
+            }
+
+            c.pruneOkTimeouts();
+
+            catchUp(url, c);
+            sendQueued(c);
         }
     }
 
-    void handleIncomingMessage(uWS::WebSocket<uWS::CLIENT> *ws, ConnDesignator *desig, std::string_view msg) {
+    void flushWrites() {
+        if (pendingWrites.empty()) return;
+        writer.writeBatch(pendingWrites);
+    }
+
+    // The id and signature of an EVENT message, found without parsing it. Quotes inside JSON
+    // strings are always escaped, so a "field":" sequence can only be a real field.
+    //
+    // Only events that the writer has verified are remembered, and the whole signature must match,
+    // so a copy with a forged signature is never mistaken for one that was already accepted.
+
+    struct PeekedEvent {
+        Bytes32 id;
+        std::string sig;
+    };
+
+    static std::optional<std::string> peekHexField(std::string_view msg, const std::string &field, size_t len) {
+        std::string search = "\"" + field + "\":\"";
+
+        auto pos = msg.find(search);
+        if (pos == std::string_view::npos) return std::nullopt;
+        pos += search.size();
+        if (pos + len >= msg.size() || msg[pos + len] != '"') return std::nullopt;
+
+        try {
+            return hexDecode(msg.substr(pos, len));
+        } catch (std::exception &) {
+            return std::nullopt;
+        }
+    }
+
+    static std::optional<PeekedEvent> peekEvent(std::string_view msg) {
+        if (!msg.starts_with("[\"EVENT\"")) return std::nullopt;
+
+        auto id = peekHexField(msg, "id", 64);
+        auto sig = peekHexField(msg, "sig", 128);
+        if (!id || !sig) return std::nullopt;
+
+        return PeekedEvent{ Bytes32(*id), std::move(*sig) };
+    }
+
+    bool isRecent(const PeekedEvent &ev) {
+        rememberVerified();
+
+        auto it = recentEvents.find(ev.id);
+        return it != recentEvents.end() && it->second == ev.sig;
+    }
+
+    void rememberVerified() {
+        std::vector<std::pair<Bytes32, std::string>> verified;
+
+        {
+            std::lock_guard<std::mutex> guard(verifiedMutex);
+            std::swap(verified, verifiedEvents);
+        }
+
+        for (auto &[id, sig] : verified) {
+            auto [it, inserted] = recentEvents.insert_or_assign(id, std::move(sig));
+            if (!inserted) continue;
+            recentEventsOrder.push_back(id);
+
+            if (recentEventsOrder.size() > maxRecentEvents) {
+                recentEvents.erase(recentEventsOrder.front());
+                recentEventsOrder.pop_front();
+            }
+        }
+    }
+
+    void handleIncomingMessage(Connection &c, const std::string &url, std::string_view msg) {
+        // Events that the writer already verified, from another connection or stream group, would only be dups
+
+        auto peeked = peekEvent(msg);
+        if (peeked && isRecent(*peeked)) return;
+
         auto origJson = tao::json::from_string(msg);
 
         if (!origJson.is_array()) throw herr("not an array");
@@ -364,35 +700,74 @@ struct Router {
 
         if (msgType == "EOSE") {
         } else if (msgType == "NOTICE") {
-            LW << desig->groupName << " / " << desig->url << " NOTICE: " << tao::json::to_string(origJson);
+            LW << url << " NOTICE: " << tao::json::to_string(origJson);
         } else if (msgType == "OK") {
+            if (origJson.get_array().size() < 3) throw herr("array too short");
+
             if (!origJson.get_array().at(2).get_boolean()) {
-                LW << desig->groupName << " / " << desig->url << " Event not written: " << origJson;
+                LW << url << " Event not written: " << origJson;
+            }
+
+            if (auto it = c.inFlight.find(origJson.at(1).get_string()); it != c.inFlight.end()) {
+                c.okTimeouts.erase(it->second.first);
+                c.inFlight.erase(it);
+                catchUp(url, c);
+                sendQueued(c);
             }
         } else if (msgType == "EVENT") {
             if (origJson.get_array().size() < 3) throw herr("array too short");
+
+            auto it = c.activeSubs.find(origJson.at(1).get_string());
+            if (it == c.activeSubs.end() || !streamGroups.contains(it->second)) return; // REQ was replaced or closed
+
             auto &evJson = origJson.at(2);
-            streamGroups.at(desig->groupName).incomingEvent(desig->url, evJson);
+
+            if (streamGroups.at(it->second).incomingEvent(url, evJson)) {
+                if (pendingWrites.size() >= maxPendingWrites) flushWrites();
+            }
         } else {
             LW << "Unexpected message: " << origJson;
         }
     }
 
     void handleDBChange() {
-        auto txn = env.txn_ro();
+        {
+            auto txn = env.txn_ro();
 
-        env.foreach_Event(txn, [&](auto &ev){
-            currEventId = ev.primaryKeyId;
+            env.foreach_Event(txn, [&](auto &ev){
+                uint64_t prevEventId = currEventId;
+                currEventId = ev.primaryKeyId;
 
-            std::string responseStr;
-            tao::json::value json = tao::json::null;
+                OutgoingEvent out{ ev.primaryKeyId, };
+                tao::json::value evJson;
+                std::set<std::string> wantedUrls;
 
-            for (auto &[groupName, streamGroup] : streamGroups) {
-                streamGroup.outgoingEvent(txn, ev, responseStr, json);
-            }
+                upMonitors.process(txn, ev, [&](RecipientList &&recipients, uint64_t){
+                    for (auto &r : recipients) {
+                        auto &streamGroup = streamGroups.at(monitorGroups.at(r.connId));
+                        if (streamGroup.acceptOutgoing(txn, ev, out, evJson)) wantedUrls.insert(streamGroup.urls.begin(), streamGroup.urls.end());
+                    }
+                });
 
-            return true;
-        }, false, currEventId + 1);
+                for (auto &[url, c] : conns) {
+                    if (!c.ws || c.upCursor != prevEventId) continue; // behind, catches up from the DB later
+
+                    if (wantedUrls.contains(url)) {
+                        if (c.outQueue.size() >= maxOutQueue) continue;
+                        c.outQueue.push_back(out); // shares the serialised message
+                    }
+
+                    c.upCursor = ev.primaryKeyId;
+                }
+
+                return true;
+            }, false, currEventId + 1);
+        }
+
+        for (auto &[url, c] : conns) {
+            catchUp(url, c);
+            sendQueued(c);
+        }
     }
 
     void run() {
@@ -444,6 +819,11 @@ struct Router {
             hubTrigger->send();
         });
 
+        cron.repeat(flushIntervalUs, [&]{
+            inbox.push_move(RouterEvent{RouterEvent::FlushWrites{}});
+            hubTrigger->send();
+        });
+
         cron.run();
 
 
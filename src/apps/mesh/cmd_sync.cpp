@@ -1,9 +1,13 @@
+#include <deque>
+
 #include <docopt.h>
 #include <tao/json.hpp>
 #include <negentropy.h>
 #include <negentropy/storage/Vector.h>
 #include <negentropy/storage/BTreeLMDB.h>
 #include <negentropy/storage/SubRange.h>
+#include <hoytech/time.h>
+#include <openssl/sha.h>
 
 #include "golpe.h"
 
@@ -20,43 +24,213 @@
 static const char USAGE[] =
 R"(
     Usage:
-      sync <url> [--filter=<filter>] [--dir=<dir>] [--frame-size-limit=<frame-size-limit>]
+      sync <url>... [--filter=<filter>] [--dir=<dir>] [--frame-size-limit=<frame-size-limit>] [--ranges=<ranges>] [--parallel=<parallel>] [--fresh]
 
     Options:
       --filter=<filter>  Nostr filter (either single filter object or array of filters)
       --dir=<dir>        Direction: both, down, up, none [default: both]
       --frame-size-limit=<frame-size-limit>  Limit outgoing negentropy message size (default 60k, 0 for no limit)
+      --ranges=<ranges>  Split the filter's time range into this many sub-ranges, each reconciled separately [default: 1]
+      --parallel=<parallel>  Number of sub-ranges to reconcile at the same time [default: 1]
+      --fresh            Ignore any checkpoint left by an interrupted sync, and start from scratch
+
+    With multiple URLs, all relays are reconciled concurrently, and each missing event is downloaded
+    once, from the fastest relay that has it.
 )";
 
 
+// Limits the number of items in flight to about twice the bandwidth-delay product: the delivery
+// rate measured over the last interval times the smallest observed RTT. While the window is the
+// bottleneck, RTTs stay near the minimum and it doubles each interval. Once the link or the remote
+// relay is saturated, RTTs grow with queueing and the window shrinks back.
 
-void cmd_sync(const std::vector<std::string> &subArgs) {
-    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+struct AdaptiveWindow {
+    uint64_t size;
+    uint64_t minSize;
+    uint64_t maxSize;
 
-    std::string url = args["<url>"].asString();
+    uint64_t minRttUs = MAX_U64;
+    std::atomic<uint64_t> rate = 0; // items per second, as of the last interval. Read by other threads
+    uint64_t intervalStart = 0;
+    uint64_t intervalItems = 0;
+    bool full = false; // window was the limit during this interval, so the rate measured isn't just what the caller had to send
 
-    std::string filterStr;
-    if (args["--filter"]) filterStr = args["--filter"].asString();
-    else filterStr = "{}";
-    std::string dir = args["--dir"] ? args["--dir"].asString() : "both";
-    if (dir != "both" && dir != "up" && dir != "down" && dir != "none") throw herr("invalid direction: ", dir, ". Should be one of both/up/down/none");
+    AdaptiveWindow(uint64_t initial, uint64_t minSize, uint64_t maxSize) : size(initial), minSize(minSize), maxSize(maxSize) {}
+
+    void onFull() {
+        full = true;
+    }
+
+    void sample(uint64_t items, uint64_t rttUs) {
+        uint64_t now = hoytech::curr_time_us();
+        rttUs = std::max(rttUs, uint64_t(1));
+        minRttUs = std::min(minRttUs, rttUs);
+
+        if (!intervalStart) intervalStart = now - rttUs;
+        intervalItems += items;
+
+        uint64_t elapsed = now - intervalStart;
+        if (elapsed < std::max(minRttUs * 4, uint64_t(100'000))) return;
+
+        rate = intervalItems * 1'000'000 / elapsed;
+
+        if (full) {
+            double bdp = double(intervalItems) / elapsed * minRttUs;
+            size = std::clamp(uint64_t(bdp * 2), minSize, maxSize);
+        }
+
+        intervalStart = now;
+        intervalItems = 0;
+        full = false;
+    }
+};
+
+
+// A time range within the filter, reconciled with its own NEG-OPEN. since and until are inclusive, as in filters.
+
+struct SyncRange {
+    uint64_t since;
+    uint64_t until;
+    tao::json::value filterJson;
+    std::string subId;
+    bool completed = false;
+};
+
+// Picks boundaries so each range has about the same number of local events. If there are too few
+// local events (ie when bootstrapping a new mirror), the time range is split evenly instead.
+
+static std::vector<std::pair<uint64_t, uint64_t>> splitTimeRange(negentropy::storage::StorageBase &storage, uint64_t since, uint64_t until, uint64_t numRanges) {
+    std::vector<uint64_t> bounds;
+
+    auto size = storage.size();
+
+    if (size >= numRanges * 10) {
+        for (uint64_t i = 1; i < numRanges; i++) {
+            bounds.push_back(storage.getItem(size * i / numRanges).timestamp);
+        }
+    } else {
+        const uint64_t earliest = 1'577'836'800; // 2020-01-01: older events all end up in the first range
+        uint64_t lo = std::max(since, earliest);
+        uint64_t hi = std::min(until, hoytech::curr_time_s());
+
+        if (hi > lo) {
+            for (uint64_t i = 1; i < numRanges; i++) bounds.push_back(lo + (hi - lo) * i / numRanges);
+        }
+    }
+
+    std::vector<std::pair<uint64_t, uint64_t>> output;
+    uint64_t curr = since;
+
+    for (auto b : bounds) {
+        if (b <= curr || b > until) continue;
+        output.emplace_back(curr, b - 1);
+        curr = b;
+    }
+
+    output.emplace_back(curr, until);
+
+    return output;
+}
+
+// Checkpoints are per remote relay, direction, filter and number of ranges
+
+static std::string syncCheckpointKey(const std::string &url, const std::string &dir, const tao::json::value &filterJson, uint64_t numRanges) {
+    std::string input = url + "\n" + dir + "\n" + tao::json::to_string(filterJson) + "\n" + std::to_string(numRanges);
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(input.data()), input.size(), hash);
+
+    return std::string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
+}
+
+static void appendUint64(std::string &out, uint64_t n) {
+    out += lmdb::to_sv<uint64_t>(n);
+}
+
+// The ids still to be transferred are stored as separate SyncCheckpointId records, so a checkpoint
+// only writes what changed since the last one. Keys are the checkpoint key, a type and the id.
 
-    uint64_t frameSizeLimit = 60'000; // default frame limit is 128k. Halve that (hex encoding) and subtract a bit (JSON msg overhead)
-    if (args["--frame-size-limit"]) frameSizeLimit = args["--frame-size-limit"].asLong();
+static constexpr char CheckpointHave = 'h';
+static constexpr char CheckpointNeed = 'n';
 
-    const bool doUp = dir == "both" || dir == "up";
-    const bool doDown = dir == "both" || dir == "down";
+static std::string checkpointIdKey(const std::string &checkpointKey, char type, const Bytes32 &id) {
+    std::string output = checkpointKey;
+    output += type;
+    output += id.sv();
+    return output;
+}
+
+// Restricts each filter to [since, until]. Filters that can no longer match are removed.
+
+static tao::json::value restrictFilter(const tao::json::value &filterJson, uint64_t since, uint64_t until) {
+    auto restrictOne = [&](const tao::json::value &f) -> std::optional<tao::json::value> {
+        uint64_t s = std::max(since, f.get_object().contains("since") ? f.at("since").get_unsigned() : uint64_t(0));
+        uint64_t u = std::min(until, f.get_object().contains("until") ? f.at("until").get_unsigned() : MAX_U64);
+        if (s > u) return std::nullopt;
+
+        auto output = f;
+        if (s != 0) output["since"] = s;
+        else output.get_object().erase("since");
+        if (u != MAX_U64) output["until"] = u;
+        else output.get_object().erase("until");
+        return output;
+    };
+
+    if (filterJson.is_object()) return restrictOne(filterJson).value_or(tao::json::null);
+
+    tao::json::value output = tao::json::empty_array;
+
+    for (const auto &f : filterJson.get_array()) {
+        if (auto r = restrictOne(f)) output.emplace_back(std::move(*r));
+    }
+
+    if (output.get_array().size() == 0) return tao::json::null;
+    return output;
+}
 
 
-    tao::json::value filterJson = tao::json::from_string(filterStr);
-    auto filterCompiled = NostrFilterGroup::unwrapped(filterJson);
+
+
+// What is being synced, and the local side of it. Read-only once set up, and shared by all connections.
+
+struct SyncSpec {
+    tao::json::value filterJson;
+    uint64_t filterSince = MAX_U64;
+    uint64_t filterUntil = 0;
+    std::string dir;
+    bool doUp;
+    bool doDown;
+    uint64_t frameSizeLimit;
+    uint64_t numRanges;
+    uint64_t parallel;
+    bool fresh;
 
     std::optional<uint64_t> treeId;
     negentropy::storage::Vector storageVector;
+    std::vector<SyncRange> initialRanges;
 
+    // Runs cb with the local events in [since, until]
+    void withStorage(lmdb::txn &txn, uint64_t since, uint64_t until, const std::function<void(negentropy::storage::SubRange &)> &cb) {
+        negentropy::Bound lower(since), upper(until == MAX_U64 ? MAX_U64 : until + 1);
 
-    {
-        auto txn = env.txn_ro();
+        if (treeId) {
+            negentropy::storage::BTreeLMDB storageBtree(txn, getNegentropyDbi(txn), *treeId);
+            negentropy::storage::SubRange subStorage(storageBtree, lower, upper);
+            cb(subStorage);
+        } else {
+            negentropy::storage::SubRange subStorage(storageVector, lower, upper);
+            cb(subStorage);
+        }
+    }
+
+    void setup(lmdb::txn &txn) {
+        auto filterCompiled = NostrFilterGroup::unwrapped(filterJson);
+        if (filterCompiled.filters.size() == 0) throw herr("filter will never match");
+
+        for (const auto &f : filterCompiled.filters) {
+            filterSince = std::min(filterSince, f.since);
+            filterUntil = std::max(filterUntil, f.until);
+        }
 
         auto filterJsonNoTimes = filterJson;
         if (filterJsonNoTimes.is_object()) {
@@ -66,7 +240,7 @@ void cmd_sync(const std::vector<std::string> &subArgs) {
         auto filterJsonNoTimesStr = tao::json::to_string(filterJsonNoTimes);
 
         env.foreach_NegentropyFilter(txn, [&](auto &f){
-            if (f.filter() == filterJsonNoTimesStr) {
+            if (f.filter() == filterJsonNoTimesStr && f.state() == 0) {
                 treeId = f.primaryKeyId;
                 return false;
             }
@@ -75,200 +249,562 @@ void cmd_sync(const std::vector<std::string> &subArgs) {
 
         if (!treeId) {
             DBQuery query(filterJson);
-            Decompressor decomp;
 
             uint64_t numEvents = 0;
-            std::vector<uint64_t> levIds;
 
-            while (1) {
-                bool complete = query.process(txn, [&](const auto &sub, uint64_t levId){
-                    levIds.push_back(levId);
-                    numEvents++;
-                });
+            auto addItem = [&](uint64_t createdAt, std::string_view id){
+                storageVector.insert(createdAt, id);
+                numEvents++;
+            };
 
-                if (complete) break;
-            }
+            if (canScanNegentropyIndex(txn, query.sub.filterGroup)) {
+                foreachNegentropyIndexItem(txn, query.sub.filterGroup, query.sub.latestEventId, addItem);
+            } else {
+                std::vector<uint64_t> levIds;
 
-            std::sort(levIds.begin(), levIds.end());
+                while (1) {
+                    bool complete = query.process(txn, [&](const auto &sub, uint64_t levId){
+                        levIds.push_back(levId);
+                    });
 
-            for (auto levId : levIds) {
-                auto ev = lookupEventByLevId(txn, levId);
-                PackedEventView packed(ev.buf);
-                storageVector.insert(packed.created_at(), packed.id());
+                    if (complete) break;
+                }
+
+                foreachNegentropyItem(txn, levIds, addItem);
             }
 
             LI << "Filter matches " << numEvents << " events";
 
             storageVector.seal();
         }
+
+        if (numRanges == 1) {
+            initialRanges.push_back({ filterSince, filterUntil, filterJson });
+        } else {
+            withStorage(txn, filterSince, filterUntil, [&](auto &storage){
+                for (const auto &[since, until] : splitTimeRange(storage, filterSince, filterUntil, numRanges)) {
+                    auto rangeFilter = restrictFilter(filterJson, since, until);
+                    if (!rangeFilter.is_null()) initialRanges.push_back({ since, until, std::move(rangeFilter) });
+                }
+            });
+
+            LI << "Reconciling " << initialRanges.size() << " time ranges per relay, " << parallel << " at a time";
+        }
     }
+};
+
 
+struct SyncSession;
 
+// Merges the ids that each relay has and we need, so every missing event is downloaded only once.
+// Each id is assigned to the fastest relay known to have it. If that relay fails, or doesn't
+// return a valid copy of the event, it is re-assigned to the next fastest. A returned event only
+// counts once the writer has verified it.
 
+struct SyncCoordinator {
+    SyncSpec &spec;
     WriterPipeline writer;
-    WSConnection ws(url);
-    PluginEventSifter writePolicyPlugin;
+    std::vector<std::unique_ptr<SyncSession>> sessions;
+
+    std::mutex mutex; // protects everything below, as well as SyncSession::queueDown and SyncSession::localDone
+
+    struct Need {
+        std::vector<uint32_t> holders; // sessions whose relay has this event
+        uint32_t assignedTo;
+        bool requested = false;
+        bool lost = false; // no live relay has it (but another may report it later)
+        bool received = false; // returned before EOSE, waiting for the writer to verify it
+        bool verified = false; // the writer verified a copy before EOSE
+        bool rejected = false; // the writer rejected a copy before EOSE
+        bool downloaded = false; // verified by the writer, but not necessarily written yet
+    };
 
+    flat_hash_map<Bytes32, Need> needs;
+    uint64_t numLost = 0;
+    uint64_t numAwaitingVerify = 0; // needs with received set
 
-    ws.reconnect = false;
+    SyncCoordinator(SyncSpec &spec) : spec(spec) {
+        writer.onVerified = [this](const tao::json::value &evJson){ verifyResult(evJson, true); };
+        writer.onRejected = [this](const tao::json::value &evJson){ verifyResult(evJson, false); };
+    }
 
-    ws.onConnect = [&]{
-        auto txn = env.txn_ro();
-        std::string neMsg;
+    void addNeeds(SyncSession &s, const std::vector<Bytes32> &ids);
+    std::vector<Bytes32> takeNeeds(SyncSession &s, uint64_t max);
+    void completedReq(SyncSession &s, const std::vector<Bytes32> &ids, const flat_hash_set<Bytes32> &received, const flat_hash_set<Bytes32> &blocked);
+    void failed(SyncSession &s, const std::vector<Bytes32> &inFlightIds);
+    void checkDone(); // caller must hold mutex
 
-        if (treeId) {
-            negentropy::storage::BTreeLMDB storageBtree(txn, negentropyDbi, *treeId);
+  private:
+    void verifyResult(const tao::json::value &evJson, bool valid); // called from the writer's validator thread
+    void setDownloaded(const Bytes32 &id, Need &n, bool toWriter);
+    void reassign(const Bytes32 &id, Need &n, uint32_t from, flat_hash_set<uint32_t> &toTrigger);
+};
 
-            const auto &f = filterCompiled.filters.at(0);
-            negentropy::storage::SubRange subStorage(storageBtree, negentropy::Bound(f.since), negentropy::Bound(f.until == MAX_U64 ? MAX_U64 : f.until + 1));
 
-            negentropy::Negentropy<negentropy::storage::SubRange> ne(subStorage, frameSizeLimit);
-            neMsg = ne.initiate();
-        } else {
-            negentropy::Negentropy<negentropy::storage::Vector> ne(storageVector, frameSizeLimit);
-            neMsg = ne.initiate();
-        }
+// One connection to a remote relay
 
-        ws.send(tao::json::to_string(tao::json::value::array({
-            "NEG-OPEN",
-            "N",
-            filterJson,
-            to_hex(neMsg),
-        })));
-    };
+struct SyncSession {
+    SyncCoordinator &coord;
+    SyncSpec &spec;
+    uint32_t index;
+    std::string url;
+    std::string checkpointKey;
 
-    auto doExit = [&](int status){
-        if (doDown) writer.flush();
-        ::exit(status);
+    WSConnection ws;
+    PluginEventSifter writePolicyPlugin;
+    Decompressor decomp;
+
+    std::vector<SyncRange> ranges;
+    flat_hash_map<std::string, size_t> rangeBySubId;
+    size_t nextRange = 0;
+    uint64_t activeRanges = 0;
+
+    std::vector<Bytes32> have;
+    flat_hash_set<Bytes32> seenHave;
+    std::deque<Bytes32> queueDown; // ids assigned to this session, not yet requested (may be stale: check with coord)
+    uint64_t totalHaves = 0, totalNeeds = 0;
+
+    bool alive = true; // protected by coord.mutex
+    bool localDone = false; // protected by coord.mutex
+
+    // Uploads are windowed by events awaiting an OK. Downloads are windowed by ids requested in
+    // REQs that haven't reached EOSE (we can't count on getting every EVENT, since some might've
+    // been deleted mid-query). Each REQ uses a sub id from a small pool, and is closed after EOSE.
+
+    AdaptiveWindow windowUp{100, 10, 10'000};
+    AdaptiveWindow windowDown{50, 50, 2'000};
+    uint64_t negRttUs = MAX_U64; // fastest negentropy round-trip, to estimate speed before any downloads
+    std::atomic<uint64_t> speedEstimate = 0;
+    static constexpr uint64_t maxBatchSizeDown = 250; // stay under common per-filter limits
+    static constexpr uint64_t maxReqsDown = 8;
+
+    struct ReqDown {
+        uint64_t sentAt;
+        std::vector<Bytes32> ids;
+        flat_hash_set<Bytes32> received; // requested ids that were passed to the writer
+        flat_hash_set<Bytes32> blocked; // requested ids that the write policy rejected
     };
 
-    ws.onDisconnect = ws.onError = [&]{
-        doExit(1);
+    flat_hash_map<std::string, uint64_t> inFlightUp; // id hex -> time sent
+    flat_hash_map<std::string, ReqDown> inFlightDown; // subId -> REQ
+    flat_hash_map<std::string, uint64_t> negSentAt; // subId -> time last NEG-OPEN/NEG-MSG was sent
+    std::vector<std::string> freeSubIdsDown;
+    uint64_t inFlightDownIds = 0;
+
+    // Progress is checkpointed periodically and when the connection fails. Ids that are in flight,
+    // or downloaded but not yet written, are saved as still pending. Only the changes to the pending
+    // ids since the last checkpoint are written.
+
+    enum class NeedOp {
+        Add, // this relay has it
+        Drop, // no longer needed from this relay
+        DropOnceWritten, // downloaded, remove when it's in the DB
     };
 
+    static constexpr uint64_t checkpointIntervalUs = 30'000'000;
+    uint64_t lastCheckpoint = hoytech::curr_time_us();
+    std::vector<std::pair<bool, Bytes32>> haveOps; // (added, id) since the last checkpoint
+    std::vector<std::pair<NeedOp, Bytes32>> needOps; // protected by coord.mutex, since the last checkpoint
+    std::vector<Bytes32> unwrittenNeeds; // downloaded but not yet in the DB at the last checkpoint
 
-    const uint64_t highWaterUp = 100, lowWaterUp = 50;
-    const uint64_t batchSizeDown = 50;
-    uint64_t inFlightUp = 0;
-    bool inFlightDown = false; // bool because we can't count on getting every EVENT we request (might've been deleted mid-query)
-    std::vector<Bytes32> have, need;
-    flat_hash_set<Bytes32> seenHave, seenNeed;
-    bool syncDone = false;
-    uint64_t totalHaves = 0, totalNeeds = 0;
-    Decompressor decomp;
+    std::thread thread;
 
-    ws.onMessage = [&](auto msgStr, uWS::OpCode opCode, size_t compressedSize){
-        try {
+
+    SyncSession(SyncCoordinator &coord, SyncSpec &spec, uint32_t index, const std::string &url)
+        : coord(coord), spec(spec), index(index), url(url), checkpointKey(syncCheckpointKey(url, spec.dir, spec.filterJson, spec.numRanges)), ws(url) {
+        for (uint64_t i = 0; i < maxReqsDown; i++) freeSubIdsDown.push_back(std::string("R") + std::to_string(i));
+    }
+
+    // Estimated download rate in ids per second. Can be called from any thread.
+    uint64_t speed() {
+        return speedEstimate;
+    }
+
+    void updateSpeed() {
+        if (windowDown.rate) speedEstimate = windowDown.rate.load();
+        else if (negRttUs != MAX_U64) speedEstimate = windowDown.size * 1'000'000 / std::max(negRttUs, uint64_t(1));
+    }
+
+    // With --fresh, the caller has already deleted the checkpoint
+    void restore(lmdb::txn &txn) {
+        std::vector<Bytes32> restoredNeeds;
+        std::optional<uint64_t> checkpointedAt;
+
+        env.foreach_SyncCheckpoint(txn, [&](auto &c){
+            if (c.key() != checkpointKey) return true;
+
+            auto rangesBuf = c.ranges();
+            for (size_t i = 0; i + 24 <= rangesBuf.size(); i += 24) {
+                uint64_t since = lmdb::from_sv<uint64_t>(rangesBuf.substr(i, 8));
+                uint64_t until = lmdb::from_sv<uint64_t>(rangesBuf.substr(i + 8, 8));
+                bool completed = !!lmdb::from_sv<uint64_t>(rangesBuf.substr(i + 16, 8));
+
+                auto rangeFilter = spec.numRanges == 1 ? spec.filterJson : restrictFilter(spec.filterJson, since, until);
+                if (!rangeFilter.is_null()) ranges.push_back({ since, until, std::move(rangeFilter), "", completed });
+            }
+
+            checkpointedAt = c.updatedAt();
+            return false;
+        });
+
+        if (checkpointedAt) {
+            foreachCheckpointId(txn, [&](char type, const Bytes32 &id){
+                if (type == CheckpointHave) addHave(id);
+                else if (type == CheckpointNeed) restoredNeeds.push_back(id);
+            });
+
+            uint64_t numCompleted = std::count_if(ranges.begin(), ranges.end(), [](const auto &r){ return r.completed; });
+            LI << "[" << url << "] Resuming sync checkpointed at " << *checkpointedAt << ": " << numCompleted << "/" << ranges.size() << " ranges reconciled, "
+               << have.size() << " to upload, " << restoredNeeds.size() << " to download (use --fresh to start over)";
+        }
+
+        // Ranges come from the checkpoint if there is one: recomputing them would give different boundaries once events have been synced
+        if (ranges.size() == 0) ranges = spec.initialRanges;
+
+        if (restoredNeeds.size()) coord.addNeeds(*this, restoredNeeds);
+
+        // Already in the checkpoint
+        haveOps.clear();
+        std::lock_guard<std::mutex> guard(coord.mutex);
+        needOps.clear();
+    }
+
+    void foreachCheckpointId(lmdb::txn &txn, const std::function<void(char, const Bytes32 &)> &cb) {
+        auto cursor = lmdb::cursor::open(txn, env.dbi_SyncCheckpointId);
+        std::string_view k = checkpointKey, v;
+
+        for (bool found = cursor.get(k, v, MDB_SET_RANGE); found && k.starts_with(checkpointKey); found = cursor.get(k, v, MDB_NEXT)) {
+            if (k.size() != checkpointKey.size() + 33) continue;
+            cb(k[checkpointKey.size()], Bytes32(k.substr(checkpointKey.size() + 1)));
+        }
+    }
+
+    void addHave(const Bytes32 &id) {
+        if (seenHave.contains(id)) return;
+        seenHave.insert(id);
+        have.push_back(id);
+        haveOps.emplace_back(true, id);
+    }
+
+    void saveCheckpoint() {
+        std::string rangesBuf;
+
+        for (const auto &r : ranges) {
+            appendUint64(rangesBuf, r.since);
+            appendUint64(rangesBuf, r.until);
+            appendUint64(rangesBuf, r.completed ? 1 : 0);
+        }
+
+        std::vector<std::pair<NeedOp, Bytes32>> ops;
+
+        {
+            std::lock_guard<std::mutex> guard(coord.mutex);
+            ops = needOps;
+        }
+
+        auto txn = env.txn_rw();
+        auto &dbi = env.dbi_SyncCheckpointId;
+
+        for (const auto &[added, id] : haveOps) {
+            auto key = checkpointIdKey(checkpointKey, CheckpointHave, id);
+            if (added) dbi.put(txn, key, "");
+            else dbi.del(txn, key);
+        }
+
+        // A downloaded need is only done once the event is in the DB: it may still be queued in the writer
+
+        std::vector<Bytes32> stillUnwritten;
+
+        auto dropOnceWritten = [&](const Bytes32 &id){
+            if (lookupEventById(txn, id.sv())) dbi.del(txn, checkpointIdKey(checkpointKey, CheckpointNeed, id));
+            else stillUnwritten.push_back(id);
+        };
+
+        for (const auto &id : unwrittenNeeds) dropOnceWritten(id);
+
+        for (const auto &[op, id] : ops) {
+            if (op == NeedOp::Add) dbi.put(txn, checkpointIdKey(checkpointKey, CheckpointNeed, id), "");
+            else if (op == NeedOp::Drop) dbi.del(txn, checkpointIdKey(checkpointKey, CheckpointNeed, id));
+            else dropOnceWritten(id);
+        }
+
+        deleteCheckpointHeader(txn);
+        env.insert_SyncCheckpoint(txn, checkpointKey, url, rangesBuf, hoytech::curr_time_s());
+        txn.commit();
+
+        haveOps.clear();
+        std::swap(unwrittenNeeds, stillUnwritten);
+
+        {
+            std::lock_guard<std::mutex> guard(coord.mutex);
+            needOps.erase(needOps.begin(), needOps.begin() + ops.size());
+        }
+
+        lastCheckpoint = hoytech::curr_time_us();
+    }
+
+    void deleteCheckpointHeader(lmdb::txn &txn) {
+        std::vector<uint64_t> ids;
+
+        env.foreach_SyncCheckpoint(txn, [&](auto &c){
+            if (c.key() == checkpointKey) ids.push_back(c.primaryKeyId);
+            return true;
+        });
+
+        for (auto id : ids) env.delete_SyncCheckpoint(txn, id);
+    }
+
+    void deleteCheckpoint(lmdb::txn &txn) {
+        deleteCheckpointHeader(txn);
+
+        auto cursor = lmdb::cursor::open(txn, env.dbi_SyncCheckpointId);
+        std::string_view k = checkpointKey, v;
+
+        // After a delete the cursor is on the following record, which MDB_NEXT returns
+        for (bool found = cursor.get(k, v, MDB_SET_RANGE); found && k.starts_with(checkpointKey); found = cursor.get(k, v, MDB_NEXT)) {
+            if (int rc = mdb_cursor_del(cursor.handle(), 0)) throw herr("mdb_cursor_del failed: ", mdb_strerror(rc));
+        }
+    }
+
+    void start() {
+        ws.reconnect = false;
+
+        ws.onConnect = [&]{
             auto txn = env.txn_ro();
-            tao::json::value msg = tao::json::from_string(msgStr);
-
-            if (msg.at(0) == "NEG-MSG") {
-                uint64_t origHaves = have.size(), origNeeds = need.size();
-
-                std::optional<std::string> neMsg;
-
-                try {
-                    auto inputMsg = from_hex(msg.at(2).get_string());
-
-                    std::vector<std::string> currHave, currNeed;
-
-                    if (treeId) {
-                        negentropy::storage::BTreeLMDB storageBtree(txn, negentropyDbi, *treeId);
-
-                        const auto &f = filterCompiled.filters.at(0);
-                        negentropy::storage::SubRange subStorage(storageBtree, negentropy::Bound(f.since), negentropy::Bound(f.until == MAX_U64 ? MAX_U64 : f.until + 1));
-
-                        negentropy::Negentropy<negentropy::storage::SubRange> ne(subStorage, frameSizeLimit);
-                        ne.setInitiator();
-                        neMsg = ne.reconcile(inputMsg, currHave, currNeed);
-                    } else {
-                        negentropy::Negentropy<negentropy::storage::Vector> ne(storageVector, frameSizeLimit);
-                        ne.setInitiator();
-                        neMsg = ne.reconcile(inputMsg, currHave, currNeed);
-                    }
-
-                    for (auto &idStr : currHave) {
-                        Bytes32 id(idStr);
-                        if (seenHave.contains(id)) continue;
-                        seenHave.insert(id);
-                        have.push_back(id);
-                    }
-
-                    for (auto &idStr : currNeed) {
-                        Bytes32 id(idStr);
-                        if (seenNeed.contains(id)) continue;
-                        seenNeed.insert(id);
-                        need.push_back(id);
-                    }
-                } catch (std::exception &e) {
-                    LE << "Unable to parse negentropy message from relay: " << e.what();
-                    doExit(1);
-                }
+            startRanges(txn);
+            pump();
+        };
+
+        ws.onTrigger = [&]{
+            pump();
+        };
+
+        ws.onDisconnect = ws.onError = [&]{
+            onFailure();
+        };
+
+        ws.onMessage = [&](auto msgStr, uWS::OpCode opCode, size_t compressedSize){
+            try {
+                handleMessage(msgStr);
+            } catch (std::exception &e) {
+                LE << "[" << url << "] Error processing websocket message: " << e.what();
+                LW << "MSG: " << msgStr;
+            }
+
+            pump();
+        };
+
+        thread = std::thread([this]{
+            setThreadName("sync");
+            ws.run();
+        });
+    }
+
+    void onFailure() {
+        {
+            std::lock_guard<std::mutex> guard(coord.mutex);
+            if (!alive) return;
+        }
+
+        try {
+            saveCheckpoint();
+            LI << "[" << url << "] Saved sync checkpoint, re-run the same command to resume";
+        } catch (std::exception &e) {
+            LE << "[" << url << "] Unable to save sync checkpoint: " << e.what();
+        }
 
-                totalHaves += have.size() - origHaves;
-                totalNeeds += need.size() - origNeeds;
-
-                if (!doUp) have.clear();
-                if (!doDown) need.clear();
-
-                if (neMsg) {
-                    ws.send(tao::json::to_string(tao::json::value::array({
-                        "NEG-MSG",
-                        "N",
-                        to_hex(*neMsg),
-                    })));
-                } else {
-                    syncDone = true;
-                    LI << "Set reconcile complete. Have " << totalHaves << " need " << totalNeeds;
-
-                    ws.send(tao::json::to_string(tao::json::value::array({
-                        "NEG-CLOSE",
-                        "N",
-                    })));
+        std::vector<Bytes32> inFlightIds;
+        for (const auto &[subId, req] : inFlightDown) inFlightIds.insert(inFlightIds.end(), req.ids.begin(), req.ids.end());
+
+        coord.failed(*this, inFlightIds);
+    }
+
+    void startRanges(lmdb::txn &txn) {
+        while (1) {
+            while (nextRange < ranges.size() && ranges[nextRange].completed) nextRange++;
+            if (nextRange == ranges.size() || activeRanges >= spec.parallel) break;
+
+            auto &range = ranges[nextRange];
+            range.subId = std::string("N") + std::to_string(nextRange);
+            rangeBySubId[range.subId] = nextRange;
+            nextRange++;
+            activeRanges++;
+
+            std::string neMsg;
+
+            spec.withStorage(txn, range.since, range.until, [&](auto &storage){
+                negentropy::Negentropy<negentropy::storage::SubRange> ne(storage, spec.frameSizeLimit);
+                neMsg = ne.initiate();
+            });
+
+            ws.send(tao::json::to_string(tao::json::value::array({
+                "NEG-OPEN",
+                range.subId,
+                range.filterJson,
+                hexEncode(neMsg),
+            })));
+
+            negSentAt[range.subId] = hoytech::curr_time_us();
+        }
+    }
+
+    void handleMessage(std::string_view msgStr) {
+        auto txn = env.txn_ro();
+        tao::json::value msg = tao::json::from_string(msgStr);
+
+        if (msg.at(0) == "NEG-MSG") {
+            auto it = rangeBySubId.find(msg.at(1).get_string());
+            if (it == rangeBySubId.end()) throw herr("NEG-MSG for unknown sub id");
+            auto &range = ranges[it->second];
+
+            if (auto sentIt = negSentAt.find(range.subId); sentIt != negSentAt.end()) {
+                negRttUs = std::min(negRttUs, hoytech::curr_time_us() - sentIt->second);
+                updateSpeed();
+            }
+
+            std::optional<std::string> neMsg;
+            std::vector<Bytes32> newNeeds;
+            uint64_t origHaves = have.size();
+
+            try {
+                auto inputMsg = hexDecode(msg.at(2).get_string());
+
+                std::vector<std::string> currHave, currNeed;
+
+                spec.withStorage(txn, range.since, range.until, [&](auto &storage){
+                    negentropy::Negentropy<negentropy::storage::SubRange> ne(storage, spec.frameSizeLimit);
+                    ne.setInitiator();
+                    neMsg = ne.reconcile(inputMsg, currHave, currNeed);
+                });
+
+                if (spec.doUp) {
+                    for (auto &idStr : currHave) addHave(Bytes32(idStr));
                 }
-            } else if (msg.at(0) == "OK") {
-                inFlightUp--;
 
-                if (!msg.at(2).get_boolean()) {
-                    LW << "Unable to upload event " << msg.at(1).get_string() << ": " << msg.at(3).get_string();
+                if (spec.doDown) {
+                    for (auto &idStr : currNeed) newNeeds.emplace_back(idStr);
                 }
-            } else if (msg.at(0) == "EVENT") {
-                if (msg.get_array().size() < 3) throw herr("array too short");
-                auto &evJson = msg.at(2);
-
-                std::string okMsg;
-                auto res = writePolicyPlugin.acceptEvent(cfg().relay__writePolicy__plugin, evJson, EventSourceType::Sync, url, okMsg);
-                if (res == PluginEventSifterResult::Accept) {
-                    writer.write({ std::move(evJson), });
-                } else {
-                    if (okMsg.size()) LI << "[" << ws.remoteAddr << "] write policy blocked event " << evJson.at("id").get_string() << ": " << okMsg;
+            } catch (std::exception &e) {
+                LE << "[" << url << "] Unable to parse negentropy message from relay: " << e.what();
+                ws.close();
+                onFailure();
+                return;
+            }
+
+            totalHaves += have.size() - origHaves;
+            totalNeeds += newNeeds.size();
+
+            if (newNeeds.size()) coord.addNeeds(*this, newNeeds);
+
+            if (neMsg) {
+                ws.send(tao::json::to_string(tao::json::value::array({
+                    "NEG-MSG",
+                    range.subId,
+                    hexEncode(*neMsg),
+                })));
+
+                negSentAt[range.subId] = hoytech::curr_time_us();
+            } else {
+                range.completed = true;
+                activeRanges--;
+                negSentAt.erase(range.subId);
+
+                ws.send(tao::json::to_string(tao::json::value::array({
+                    "NEG-CLOSE",
+                    range.subId,
+                })));
+
+                startRanges(txn);
+
+                if (nextRange == ranges.size() && activeRanges == 0) {
+                    LI << "[" << url << "] Set reconcile complete. Have " << totalHaves << " need " << totalNeeds;
                 }
-            } else if (msg.at(0) == "EOSE") {
-                inFlightDown = false;
-                writer.wait();
-            } else if (msg.at(0) == "NEG-ERR") {
-                LE << "Got NEG-ERR response from relay: " << msg;
-                doExit(1);
+            }
+        } else if (msg.at(0) == "OK") {
+            auto it = inFlightUp.find(msg.at(1).get_string());
+
+            if (it != inFlightUp.end()) {
+                windowUp.sample(1, hoytech::curr_time_us() - it->second);
+                haveOps.emplace_back(false, Bytes32(hexDecode(it->first)));
+                inFlightUp.erase(it);
+            }
+
+            if (!msg.at(2).get_boolean()) {
+                LW << "[" << url << "] Unable to upload event " << msg.at(1).get_string() << ": " << msg.at(3).get_string();
+            }
+        } else if (msg.at(0) == "EVENT") {
+            if (msg.get_array().size() < 3) throw herr("array too short");
+            auto &evJson = msg.at(2);
+
+            // Only counts towards the REQ if it's one of the ids requested. Otherwise the relay still needs to return it
+
+            ReqDown *req = nullptr;
+            Bytes32 id(hexDecode(evJson.at("id").get_string()));
+
+            if (auto reqIt = inFlightDown.find(msg.at(1).get_string()); reqIt != inFlightDown.end()) {
+                const auto &ids = reqIt->second.ids;
+                if (std::find(ids.begin(), ids.end(), id) != ids.end()) req = &reqIt->second;
+            }
+
+            std::string okMsg;
+            auto res = writePolicyPlugin.acceptEvent(cfg().relay__writePolicy__plugin, evJson, EventSourceType::Sync, url, okMsg);
+            if (res == PluginEventSifterResult::Accept) {
+                if (req) req->received.insert(id);
+                coord.writer.write({ std::move(evJson), });
             } else {
-                LW << "Unexpected message from relay: " << msg;
+                if (req) req->blocked.insert(id);
+                if (okMsg.size()) LI << "[" << ws.remoteAddr << "] write policy blocked event " << evJson.at("id").get_string() << ": " << okMsg;
             }
-        } catch (std::exception &e) {
-            LE << "Error processing websocket message: " << e.what();
-            LW << "MSG: " << msgStr;
+        } else if (msg.at(0) == "EOSE") {
+            auto subId = msg.at(1).get_string();
+            auto it = inFlightDown.find(subId);
+
+            if (it != inFlightDown.end()) {
+                windowDown.sample(it->second.ids.size(), hoytech::curr_time_us() - it->second.sentAt);
+                updateSpeed();
+                inFlightDownIds -= it->second.ids.size();
+                coord.completedReq(*this, it->second.ids, it->second.received, it->second.blocked);
+                inFlightDown.erase(it);
+                freeSubIdsDown.push_back(subId);
+
+                ws.send(tao::json::to_string(tao::json::value::array({
+                    "CLOSE",
+                    subId,
+                })));
+            }
+
+            coord.writer.wait();
+        } else if (msg.at(0) == "NEG-ERR") {
+            LE << "[" << url << "] Got NEG-ERR response from relay: " << msg;
+            if (spec.numRanges == 1) LE << "If the filter matches too many events, try splitting it with --ranges";
+            ws.close();
+            onFailure();
+        } else {
+            LW << "[" << url << "] Unexpected message from relay: " << msg;
         }
+    }
+
+    // Sends queued uploads and downloads, as far as the windows allow
 
-        if (doUp && have.size() > 0 && inFlightUp <= lowWaterUp) {
+    void pump() {
+        {
+            std::lock_guard<std::mutex> guard(coord.mutex);
+            if (!alive) return;
+        }
+
+        if (spec.doUp && have.size() > 0 && inFlightUp.size() <= windowUp.size / 2) {
             auto txn = env.txn_ro();
 
             uint64_t numSent = 0;
 
-            while (have.size() > 0 && inFlightUp < highWaterUp) {
+            while (have.size() > 0 && inFlightUp.size() < windowUp.size) {
                 auto id = std::move(have.back());
                 have.pop_back();
 
                 auto ev = lookupEventById(txn, id.sv());
                 if (!ev) {
-                    LW << "Couldn't upload event because not found (deleted?)";
+                    LW << "[" << url << "] Couldn't upload event because not found (deleted?)";
+                    haveOps.emplace_back(false, id);
                     continue;
                 }
 
@@ -277,38 +813,333 @@ void cmd_sync(const std::vector<std::string> &subArgs) {
                 sendEventMsg += "]";
                 ws.send(sendEventMsg);
 
+                inFlightUp[hexEncode(id.sv())] = hoytech::curr_time_us();
                 numSent++;
-                inFlightUp++;
             }
 
-            if (numSent > 0) LI << "UP: " << numSent << " events (" << have.size() << " remaining)";
+            if (have.size() > 0) windowUp.onFull();
+
+            if (numSent > 0) LI << "[" << url << "] UP: " << numSent << " events (" << have.size() << " remaining, window " << windowUp.size << ")";
         }
 
-        if (doDown && need.size() > 0 && !inFlightDown) {
-            tao::json::value ids = tao::json::empty_array;
+        if (spec.doDown) {
+            uint64_t numSent = 0;
+
+            while (freeSubIdsDown.size() > 0 && inFlightDownIds < windowDown.size) {
+                uint64_t batchSize = std::clamp(windowDown.size / maxReqsDown, uint64_t(50), maxBatchSizeDown);
+                batchSize = std::min(batchSize, windowDown.size - inFlightDownIds);
 
-            while (need.size() > 0 && ids.get_array().size() < batchSizeDown) {
-                ids.emplace_back(to_hex(need.back().sv()));
-                need.pop_back();
+                auto reqIds = coord.takeNeeds(*this, batchSize);
+                if (reqIds.size() == 0) break;
+
+                tao::json::value ids = tao::json::empty_array;
+                for (const auto &id : reqIds) ids.emplace_back(hexEncode(id.sv()));
+
+                auto subId = std::move(freeSubIdsDown.back());
+                freeSubIdsDown.pop_back();
+
+                ws.send(tao::json::to_string(tao::json::value::array({
+                    "REQ",
+                    subId,
+                    tao::json::value({
+                        { "ids", std::move(ids) }
+                    }),
+                })));
+
+                inFlightDownIds += reqIds.size();
+                numSent += reqIds.size();
+                inFlightDown[subId] = ReqDown{ hoytech::curr_time_us(), std::move(reqIds), {} };
             }
 
-            LI << "DOWN: " << ids.get_array().size() << " events (" << need.size() << " remaining)";
+            uint64_t remaining;
 
-            ws.send(tao::json::to_string(tao::json::value::array({
-                "REQ",
-                "R",
-                tao::json::value({
-                    { "ids", std::move(ids) }
-                }),
-            })));
+            {
+                std::lock_guard<std::mutex> guard(coord.mutex);
+                remaining = queueDown.size();
+            }
+
+            if (remaining > 0) windowDown.onFull();
+
+            if (numSent > 0) LI << "[" << url << "] DOWN: " << numSent << " events (" << remaining << " queued, window " << windowDown.size << ")";
+        }
+
+        if (hoytech::curr_time_us() - lastCheckpoint > checkpointIntervalUs) saveCheckpoint();
+
+        std::lock_guard<std::mutex> guard(coord.mutex);
+
+        localDone = nextRange == ranges.size() && activeRanges == 0 && have.size() == 0 && queueDown.size() == 0 && inFlightUp.size() == 0 && inFlightDown.size() == 0;
+
+        if (localDone) coord.checkDone();
+    }
+};
+
+
+void SyncCoordinator::addNeeds(SyncSession &s, const std::vector<Bytes32> &ids) {
+    std::lock_guard<std::mutex> guard(mutex);
+
+    for (const auto &id : ids) {
+        auto [it, isNew] = needs.try_emplace(id);
+        auto &n = it->second;
+
+        if (isNew) {
+            n.holders.push_back(s.index);
+            n.assignedTo = s.index;
+            s.queueDown.push_back(id);
+            s.needOps.emplace_back(SyncSession::NeedOp::Add, id);
+            continue;
+        }
+
+        if (n.downloaded) continue;
+        if (std::find(n.holders.begin(), n.holders.end(), s.index) != n.holders.end()) continue;
+
+        n.holders.push_back(s.index);
+        s.needOps.emplace_back(SyncSession::NeedOp::Add, id);
+
+        if (n.lost) {
+            n.lost = false;
+            numLost--;
+            n.assignedTo = s.index;
+            n.requested = false;
+            s.queueDown.push_back(id);
+        } else if (!n.requested && s.speed() > sessions[n.assignedTo]->speed()) {
+            n.assignedTo = s.index; // entry in the previous session's queue is now stale
+            s.queueDown.push_back(id);
+        }
+    }
+}
+
+std::vector<Bytes32> SyncCoordinator::takeNeeds(SyncSession &s, uint64_t max) {
+    std::lock_guard<std::mutex> guard(mutex);
+
+    std::vector<Bytes32> output;
+
+    while (s.queueDown.size() && output.size() < max) {
+        auto id = s.queueDown.front();
+        s.queueDown.pop_front();
+
+        auto it = needs.find(id);
+        if (it == needs.end()) continue;
+        auto &n = it->second;
+        if (n.downloaded || n.lost || n.requested || n.assignedTo != s.index) continue;
+
+        n.requested = true;
+        output.push_back(id);
+    }
 
-            inFlightDown = true;
+    return output;
+}
+
+void SyncCoordinator::completedReq(SyncSession &s, const std::vector<Bytes32> &ids, const flat_hash_set<Bytes32> &received, const flat_hash_set<Bytes32> &blocked) {
+    flat_hash_set<uint32_t> toTrigger;
+
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        for (const auto &id : ids) {
+            auto it = needs.find(id);
+            if (it == needs.end()) continue;
+            auto &n = it->second;
+            if (n.downloaded) continue;
+
+            if (blocked.contains(id)) {
+                setDownloaded(id, n, false); // the write policy would block it from any relay
+            } else if (received.contains(id) && n.verified) {
+                setDownloaded(id, n, true);
+            } else if (received.contains(id) && !n.rejected) {
+                n.received = true;
+                numAwaitingVerify++;
+            } else {
+                reassign(id, n, s.index, toTrigger);
+            }
         }
+    }
+
+    for (auto i : toTrigger) sessions[i]->ws.trigger();
+}
 
-        if (syncDone && have.size() == 0 && need.size() == 0 && inFlightUp == 0 && !inFlightDown) {
-            doExit(0);
+void SyncCoordinator::verifyResult(const tao::json::value &evJson, bool valid) {
+    std::optional<Bytes32> id;
+
+    try {
+        id.emplace(hexDecode(evJson.at("id").get_string()));
+    } catch (std::exception &) {
+        return; // never counted as received
+    }
+
+    flat_hash_set<uint32_t> toTrigger;
+
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto it = needs.find(*id);
+        if (it == needs.end()) return;
+        auto &n = it->second;
+        if (!n.requested || n.downloaded) return;
+
+        if (!n.received) {
+            // EOSE not seen yet, completedReq() will use this
+            if (valid) n.verified = true;
+            else n.rejected = true;
+            return;
+        }
+
+        n.received = false;
+        numAwaitingVerify--;
+
+        if (valid) setDownloaded(*id, n, true);
+        else reassign(*id, n, n.assignedTo, toTrigger);
+
+        // The sessions may all be done, waiting for this. checkDone() can't be called from here since it flushes the writer
+        if (numAwaitingVerify == 0) {
+            for (auto &s : sessions) {
+                if (s->alive) toTrigger.insert(s->index);
+            }
         }
+    }
+
+    for (auto i : toTrigger) sessions[i]->ws.trigger();
+}
+
+void SyncCoordinator::failed(SyncSession &s, const std::vector<Bytes32> &inFlightIds) {
+    flat_hash_set<uint32_t> toTrigger;
+
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (!s.alive) return;
+    s.alive = false;
+
+    auto release = [&](const Bytes32 &id){
+        auto it = needs.find(id);
+        if (it == needs.end()) return;
+        auto &n = it->second;
+        if (n.downloaded || n.lost || n.assignedTo != s.index) return;
+        reassign(id, n, s.index, toTrigger);
     };
 
-    ws.run();
+    for (const auto &id : s.queueDown) release(id);
+    for (const auto &id : inFlightIds) release(id);
+    s.queueDown.clear();
+
+    for (auto i : toTrigger) sessions[i]->ws.trigger();
+
+    checkDone();
+}
+
+void SyncCoordinator::setDownloaded(const Bytes32 &id, Need &n, bool toWriter) {
+    n.downloaded = true;
+
+    for (auto i : n.holders) {
+        sessions[i]->needOps.emplace_back(toWriter ? SyncSession::NeedOp::DropOnceWritten : SyncSession::NeedOp::Drop, id);
+    }
+}
+
+// The relay at from doesn't have the event after all, or has failed
+void SyncCoordinator::reassign(const Bytes32 &id, Need &n, uint32_t from, flat_hash_set<uint32_t> &toTrigger) {
+    std::erase(n.holders, from);
+    sessions[from]->needOps.emplace_back(SyncSession::NeedOp::Drop, id);
+
+    std::optional<uint32_t> best;
+
+    for (auto i : n.holders) {
+        if (!sessions[i]->alive) continue;
+        if (!best || sessions[i]->speed() > sessions[*best]->speed()) best = i;
+    }
+
+    if (!best) {
+        n.lost = true;
+        numLost++;
+        return;
+    }
+
+    n.assignedTo = *best;
+    n.requested = false;
+    n.verified = n.rejected = false;
+    sessions[*best]->queueDown.push_back(id);
+    toTrigger.insert(*best);
+}
+
+void SyncCoordinator::checkDone() {
+    bool anyFailed = false, anyAlive = false;
+
+    for (auto &s : sessions) {
+        if (!s->alive) anyFailed = true;
+        else if (!s->localDone) return;
+        else anyAlive = true;
+    }
+
+    // Downloads that fail verification are re-assigned, unless there's nothing left to re-assign them to
+    if (numAwaitingVerify && anyAlive) return;
+
+    if (spec.doDown) writer.flush();
+
+    if (numLost) LW << numLost << " events could not be downloaded from any relay";
+
+    try {
+        auto txn = env.txn_rw();
+        for (auto &s : sessions) {
+            if (s->alive) s->deleteCheckpoint(txn);
+        }
+        txn.commit();
+    } catch (std::exception &e) {
+        LE << "Unable to remove sync checkpoints: " << e.what();
+    }
+
+    ::exit(anyFailed || numLost ? 1 : 0);
+}
+
+
+void cmd_sync(const std::vector<std::string> &subArgs) {
+    std::map<std::string, docopt::value> args = docopt::docopt(USAGE, subArgs, true, "");
+
+    auto urls = args["<url>"].asStringList();
+
+    std::string filterStr;
+    if (args["--filter"]) filterStr = args["--filter"].asString();
+    else filterStr = "{}";
+
+    SyncSpec spec;
+
+    spec.dir = args["--dir"] ? args["--dir"].asString() : "both";
+    if (spec.dir != "both" && spec.dir != "up" && spec.dir != "down" && spec.dir != "none") throw herr("invalid direction: ", spec.dir, ". Should be one of both/up/down/none");
+
+    spec.frameSizeLimit = 60'000; // default frame limit is 128k. Halve that (hex encoding) and subtract a bit (JSON msg overhead)
+    if (args["--frame-size-limit"]) spec.frameSizeLimit = args["--frame-size-limit"].asLong();
+
+    spec.numRanges = args["--ranges"] ? parseUint64(args["--ranges"].asString()) : 1;
+    spec.parallel = args["--parallel"] ? parseUint64(args["--parallel"].asString()) : 1;
+    if (spec.numRanges == 0 || spec.parallel == 0) throw herr("--ranges and --parallel must be at least 1");
+    spec.fresh = args["--fresh"].asBool();
+
+    spec.doUp = spec.dir == "both" || spec.dir == "up";
+    spec.doDown = spec.dir == "both" || spec.dir == "down";
+
+    spec.filterJson = tao::json::from_string(filterStr);
+
+    SyncCoordinator coord(spec);
+
+    {
+        auto txn = env.txn_ro();
+
+        spec.setup(txn);
+
+        for (const auto &url : urls) {
+            coord.sessions.emplace_back(std::make_unique<SyncSession>(coord, spec, coord.sessions.size(), url));
+        }
+    }
+
+    if (spec.fresh) {
+        auto txn = env.txn_rw();
+        for (auto &s : coord.sessions) s->deleteCheckpoint(txn);
+        txn.commit();
+    }
+
+    {
+        auto txn = env.txn_ro();
+        for (auto &s : coord.sessions) s->restore(txn);
+    }
+
+    for (auto &s : coord.sessions) s->start();
+
+    // Sessions exit the process once everything is done
+    for (auto &s : coord.sessions) s->thread.join();
 }
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cmath>
+#include <algorithm>
+
+#include <hoytech/time.h>
+
+#include "golpe.h"
+
+
+// Bloom filter of the ids of stored events, one per tenant DB, so that ingesters can answer
+// re-sent events as duplicates without verifying their signatures.
+//
+// A filter is built in the background the first time its DB is checked, by scanning the id
+// prefix index. Until it is ready, every id "may" be present. Written events are added by the
+// writer after commit, but deleted events are never removed: a stale bit only costs an exact
+// lookup. Since event ids are already hashes, the 8-byte id prefix is used directly to derive
+// the bit positions.
+
+struct EventIdFilter {
+    struct Bloom {
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+        uint64_t numBits;
+        uint64_t numHashes;
+        uint64_t capacity;
+        std::atomic<uint64_t> added = 0;
+        std::atomic<bool> ready = false;
+
+        Bloom(uint64_t capacity, uint64_t bitsPerEvent) : capacity(capacity) {
+            uint64_t numWords = (capacity * bitsPerEvent + 63) / 64;
+            words = std::make_unique<std::atomic<uint64_t>[]>(numWords);
+            numBits = numWords * 64;
+            numHashes = std::clamp(uint64_t(std::round(bitsPerEvent * 0.693)), uint64_t(1), uint64_t(16));
+        }
+
+        void add(uint64_t prefix) {
+            forEachBit(prefix, [&](uint64_t bit){
+                words[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
+                return true;
+            });
+
+            added.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        bool mayContain(uint64_t prefix) {
+            return forEachBit(prefix, [&](uint64_t bit){
+                return !!(words[bit / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64)));
+            });
+        }
+
+        bool saturated() {
+            return added.load(std::memory_order_relaxed) > capacity;
+        }
+
+      private:
+        template<typename F>
+        bool forEachBit(uint64_t prefix, F cb) {
+            uint64_t h1 = prefix;
+            uint64_t h2 = ((prefix >> 32) | (prefix << 32)) | 1;
+
+            for (uint64_t i = 0; i < numHashes; i++) {
+                if (!cb((h1 + i * h2) % numBits)) return false;
+            }
+
+            return true;
+        }
+    };
+
+    // Returns false only if the event is certainly not stored. txn must be a read txn on tenantEnv.
+    bool mayContain(lmdb::txn &txn, defaultDb::environment &tenantEnv, std::string_view id) {
+        if (id.size() != 32) return true;
+
+        auto bloom = getOrBuild(txn, tenantEnv);
+        if (!bloom->ready.load(std::memory_order_acquire)) return true;
+
+        return bloom->mayContain(idPrefix(id));
+    }
+
+    // Call after the event has been committed
+    void add(defaultDb::environment &tenantEnv, std::string_view id) {
+        std::shared_ptr<Bloom> bloom;
+
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto it = filters.find(tenantEnv.lmdb_env.handle());
+            if (it == filters.end()) return; // not built yet: the build will see it
+            bloom = it->second;
+        }
+
+        bloom->add(idPrefix(id));
+
+        if (bloom->saturated() && bloom->ready.load(std::memory_order_acquire)) {
+            // False positive rate is now above target, so build a bigger one next time it's checked
+            std::lock_guard<std::mutex> guard(mutex);
+            auto it = filters.find(tenantEnv.lmdb_env.handle());
+            if (it != filters.end() && it->second == bloom) filters.erase(it);
+        }
+    }
+
+  private:
+    std::mutex mutex;
+    flat_hash_map<MDB_env*, std::shared_ptr<Bloom>> filters;
+
+    static uint64_t idPrefix(std::string_view id) {
+        return lmdb::from_sv<uint64_t>(id.substr(0, 8));
+    }
+
+    std::shared_ptr<Bloom> getOrBuild(lmdb::txn &txn, defaultDb::environment &tenantEnv) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto &bloom = filters[tenantEnv.lmdb_env.handle()];
+        if (bloom) return bloom;
+
+        // Registered before the build's snapshot is taken, so events committed after the
+        // snapshot are added by the writer
+
+        MDB_stat stat;
+        if (mdb_stat(txn.handle(), env.dbi_Event__idPrefix, &stat)) throw herr("mdb_stat failed");
+
+        uint64_t capacity = std::max(uint64_t(stat.ms_entries) * 2, uint64_t(65536));
+        bloom = std::make_shared<Bloom>(capacity, std::max(cfg().relay__dupFilter__bitsPerEvent, uint64_t(1)));
+
+        std::thread([&tenantEnv, bloom]{
+            uint64_t startTime = hoytech::curr_time_us();
+            uint64_t n = 0;
+
+            try {
+                auto txn = tenantEnv.txn_ro();
+                auto cursor = lmdb::cursor::open(txn, env.dbi_Event__idPrefix);
+                std::string_view k, v;
+
+                for (bool found = cursor.get(k, v, MDB_FIRST); found; found = cursor.get(k, v, MDB_NEXT)) {
+                    bloom->add(lmdb::from_sv<uint64_t>(k));
+                    n++;
+                }
+            } catch (std::exception &e) {
+                LE << "Error building event id filter: " << e.what();
+                return;
+            }
+
+            bloom->ready.store(true, std::memory_order_release);
+
+            LI << "Built event id filter: " << n << " events, " << (bloom->numBits / 8 / 1024) << " KiB, in " << (hoytech::curr_time_us() - startTime) / 1000 << "ms";
+        }).detach();
+
+        return bloom;
+    }
+};
+
+extern EventIdFilter eventIdFilter;
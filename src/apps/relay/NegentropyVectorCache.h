@@ -0,0 +1,129 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+#include <algorithm>
+
+#include <tao/json.hpp>
+#include <negentropy/storage/Vector.h>
+#include <hoytech/time.h>
+
+#include "golpe.h"
+
+
+// Sealed negentropy storage vectors built for NEG-OPEN filters that have no pre-computed BTree,
+// shared by all negentropy threads so repeated syncs of the same filter can skip the DB scan.
+//
+// Keyed by (LMDB environment, canonical filter JSON). Each entry records the most recent levId it
+// reflects, so that a hit only needs to add events written since then, and the environment's
+// deleteGenerations value from before its snapshot, so that any deletion since turns it into a miss.
+// Deletions by other processes aren't seen, so entries are also dropped after a maximum age. Sealed
+// vectors are only read, and are refcounted so that evicting one doesn't affect sessions still using it.
+
+struct NegentropyVectorCache {
+    using VectorPtr = std::shared_ptr<negentropy::storage::Vector>;
+
+    struct Entry {
+        VectorPtr vec;
+        uint64_t latestEventId; // vec includes all matching events with levId <= this
+        uint64_t createdAt; // when the full scan was done, in seconds
+        uint64_t deleteGeneration;
+    };
+
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+
+    bool enabled() {
+        return cfg().relay__negentropy__vectorCache__maxBytes != 0;
+    }
+
+    // Sorts and de-duplicates the array values of a filter, so that equivalent filters share an entry
+    static std::string canonicalKey(const tao::json::value &filterJson) {
+        if (!filterJson.is_object()) return tao::json::to_string(filterJson);
+
+        tao::json::value canonical = filterJson;
+
+        for (auto &[k, v] : canonical.get_object()) {
+            if (!v.is_array()) continue;
+            auto &arr = v.get_array();
+            std::sort(arr.begin(), arr.end());
+            arr.erase(std::unique(arr.begin(), arr.end()), arr.end());
+        }
+
+        return tao::json::to_string(canonical); // object keys are already ordered
+    }
+
+    std::optional<Entry> get(MDB_env *e, const std::string &filterStr, uint64_t deleteGeneration) {
+        std::lock_guard<std::mutex> guard(mutex);
+
+        auto it = entries.find(Key{ e, filterStr });
+
+        if (it != entries.end() && (it->second.entry.deleteGeneration != deleteGeneration ||
+                                    it->second.entry.createdAt + cfg().relay__negentropy__vectorCache__maxAgeSeconds < hoytech::curr_time_s())) {
+            bytes -= entrySize(it->second.entry);
+            entries.erase(it);
+            it = entries.end();
+        }
+
+        if (it == entries.end()) {
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return std::nullopt;
+        }
+
+        it->second.lastUsed = ++useCounter;
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return it->second.entry;
+    }
+
+    void put(MDB_env *e, const std::string &filterStr, Entry entry) {
+        uint64_t maxBytes = cfg().relay__negentropy__vectorCache__maxBytes;
+        if (entrySize(entry) > maxBytes) return;
+
+        std::lock_guard<std::mutex> guard(mutex);
+
+        Key key{ e, filterStr };
+
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            // Another thread got a newer one in first
+            if (it->second.entry.deleteGeneration >= entry.deleteGeneration && it->second.entry.latestEventId >= entry.latestEventId) return;
+            bytes -= entrySize(it->second.entry);
+            entries.erase(it);
+        }
+
+        bytes += entrySize(entry);
+        entries.emplace(key, Slot{ std::move(entry), ++useCounter });
+
+        while (bytes > maxBytes) {
+            auto victim = entries.begin();
+
+            for (auto i = entries.begin(); i != entries.end(); ++i) {
+                if (i->second.lastUsed < victim->second.lastUsed) victim = i;
+            }
+
+            bytes -= entrySize(victim->second.entry);
+            entries.erase(victim);
+        }
+    }
+
+  private:
+    using Key = std::pair<MDB_env*, std::string>;
+
+    struct Slot {
+        Entry entry;
+        uint64_t lastUsed;
+    };
+
+    std::mutex mutex;
+    flat_hash_map<Key, Slot> entries; // few and large, so eviction just searches for the LRU
+    uint64_t bytes = 0;
+    uint64_t useCounter = 0;
+
+    static uint64_t entrySize(const Entry &entry) {
+        return entry.vec->size() * sizeof(negentropy::Item) + 256;
+    }
+};
+
+extern NegentropyVectorCache negentropyVectorCache;
@@ -0,0 +1,367 @@
+#include <zstd.h>
+#include <zdict.h>
+
+#include "RelayServer.h"
+#include "KindClass.h"
+#include "ColdStorage.h"
+
+
+struct Compactor {
+    std::string subdomain;
+    defaultDb::environment &tenantEnv;
+
+    Decompressor decomp;
+    Compressor comp;
+
+    Compactor(std::string subdomain, defaultDb::environment &tenantEnv) : subdomain(subdomain), tenantEnv(tenantEnv) {}
+
+    // Returns kindClass -> dictId
+    std::vector<uint64_t> loadDicts(lmdb::txn &txn, std::vector<uint64_t> *trainedAt = nullptr) {
+        std::vector<uint64_t> dictIds(NumKindClasses, 0);
+        if (trainedAt) trainedAt->assign(NumKindClasses, 0);
+
+        tenantEnv.foreach_KindDictionary(txn, [&](auto &view){
+            if (view.kindClass() < NumKindClasses) {
+                dictIds[view.kindClass()] = view.dictId();
+                if (trainedAt) (*trainedAt)[view.kindClass()] = view.trainedAt();
+            }
+            return true;
+        });
+
+        return dictIds;
+    }
+
+    void trainDicts() {
+        uint64_t now = hoytech::curr_time_s();
+        std::vector<bool> needsTraining(NumKindClasses);
+        bool anyNeeded = false;
+
+        {
+            auto txn = tenantEnv.txn_ro();
+            std::vector<uint64_t> trainedAt;
+            auto dictIds = loadDicts(txn, &trainedAt);
+
+            for (uint64_t c = 0; c < NumKindClasses; c++) {
+                needsTraining[c] = dictIds[c] == 0 || trainedAt[c] + cfg().relay__compaction__dictRefreshSeconds < now;
+                if (needsTraining[c]) anyNeeded = true;
+            }
+        }
+
+        if (!anyNeeded) return;
+
+        // Sample the most recent events of each class that needs a dictionary
+
+        uint64_t samplesPerClass = cfg().relay__compaction__trainingSamples;
+        uint64_t scanLimit = samplesPerClass * 20;
+
+        std::vector<std::string> trainingBufs(NumKindClasses);
+        std::vector<std::vector<size_t>> trainingSizes(NumKindClasses);
+
+        {
+            auto txn = tenantEnv.txn_ro();
+            auto cursor = lmdb::cursor::open(txn, tenantEnv.dbi_EventPayload);
+
+            std::string_view k, v;
+            uint64_t scanned = 0;
+
+            for (bool found = cursor.get(k, v, MDB_LAST); found && scanned < scanLimit; found = cursor.get(k, v, MDB_PREV)) {
+                scanned++;
+
+                uint64_t levId = lmdb::from_sv<uint64_t>(k);
+                auto ev = tenantEnv.lookup_Event(txn, levId);
+                if (!ev) continue;
+
+                auto c = (uint64_t)kindClassOf(PackedEventView(ev->buf).kind());
+                if (!needsTraining[c] || trainingSizes[c].size() >= samplesPerClass) continue;
+
+                auto json = decodeEventPayload(txn, decomp, v, nullptr, nullptr);
+                trainingBufs[c] += json;
+                trainingSizes[c].push_back(json.size());
+            }
+        }
+
+        for (uint64_t c = 0; c < NumKindClasses; c++) {
+            if (!needsTraining[c] || trainingSizes[c].size() < cfg().relay__compaction__minTrainingSamples) continue;
+
+            std::string dict(cfg().relay__compaction__dictSize, '\0');
+
+            auto ret = ZDICT_trainFromBuffer(dict.data(), dict.size(), trainingBufs[c].data(), trainingSizes[c].data(), trainingSizes[c].size());
+            if (ZDICT_isError(ret)) {
+                LW << "Compaction: zstd training failed for " << subdomain << "/" << kindClassName((KindClass)c) << ": " << ZSTD_getErrorName(ret);
+                continue;
+            }
+
+            dict.resize(ret);
+
+            auto txn = tenantEnv.txn_rw();
+
+            uint64_t newDictId = tenantEnv.insert_CompressionDictionary(txn, dict);
+            uint64_t oldDictId = 0;
+            bool updated = false;
+
+            tenantEnv.foreach_KindDictionary(txn, [&](auto &view){
+                if (view.kindClass() == c) {
+                    oldDictId = view.dictId();
+                    tenantEnv.update_KindDictionary(txn, view, { .dictId = newDictId, .trainedAt = now });
+                    updated = true;
+                    return false;
+                }
+                return true;
+            });
+
+            if (!updated) tenantEnv.insert_KindDictionary(txn, c, newDictId, now);
+
+            txn.commit();
+
+            if (oldDictId) {
+                auto rtxn = tenantEnv.txn_ro();
+                globalDictionaryBroker.retire(rtxn, oldDictId);
+            }
+
+            LI << "Compaction: trained dictionary " << newDictId << " for " << subdomain << "/" << kindClassName((KindClass)c)
+               << " from " << trainingSizes[c].size() << " events";
+        }
+    }
+
+    // Recompress one batch of events after the cursor that aren't yet compressed with a dictionary. Returns false when caught up.
+    //
+    // Compression happens in a read txn, so the write txn only has to store the results and is
+    // held for as little time as possible.
+
+    bool compressBatch() {
+        struct Compressed {
+            uint64_t levId;
+            std::string payload;
+            std::string orig;
+        };
+
+        std::vector<Compressed> results;
+        uint64_t cursorPos;
+        bool more = true;
+
+        {
+            auto txn = tenantEnv.txn_ro();
+
+            auto state = tenantEnv.lookup_CompactionState(txn, 1);
+            cursorPos = state ? state->levIdCursor() : 0;
+
+            auto dictIds = loadDicts(txn);
+            uint64_t cutoff = hoytech::curr_time_s() - cfg().relay__compaction__minAgeSeconds;
+
+            auto cursor = lmdb::cursor::open(txn, tenantEnv.dbi_EventPayload);
+            uint64_t startLevId = cursorPos + 1;
+            std::string_view k = lmdb::to_sv<uint64_t>(startLevId), v;
+            uint64_t examined = 0;
+
+            for (bool found = cursor.get(k, v, MDB_SET_RANGE); ; found = cursor.get(k, v, MDB_NEXT)) {
+                if (!found) {
+                    more = false;
+                    break;
+                }
+
+                if (examined++ >= cfg().relay__compaction__batchSize) break;
+
+                uint64_t levId = lmdb::from_sv<uint64_t>(k);
+
+                auto ev = tenantEnv.lookup_Event(txn, levId);
+                if (!ev) {
+                    cursorPos = levId;
+                    continue;
+                }
+
+                PackedEventView packed(ev->buf);
+
+                // levIds roughly follow arrival order, so stop at the first recent event
+                if (packed.created_at() > cutoff) {
+                    more = false;
+                    break;
+                }
+
+                cursorPos = levId;
+
+                if (v.size() == 0 || v[0] == '\x01' || v[0] == '\x03') continue; // already compressed with a dictionary, or in cold tier
+
+                uint64_t dictId = dictIds[(uint64_t)kindClassOf(packed.kind())];
+                if (!dictId) continue;
+
+                auto json = decodeEventPayload(txn, decomp, v, nullptr, nullptr);
+
+                std::string newVal;
+                encodeEventPayload(txn, comp, dictId, cfg().relay__compaction__level, 0, json, newVal);
+                if (newVal.size() >= v.size()) continue; // not worth it
+
+                results.emplace_back(Compressed{ levId, std::move(newVal), std::string(v) });
+            }
+        }
+
+        uint64_t bytesBefore = 0, bytesAfter = 0, numWritten = 0;
+
+        {
+            auto txn = tenantEnv.txn_rw();
+
+            for (auto &r : results) {
+                // Only replace if the payload is unchanged (could have been deleted or rewritten in the meantime)
+                std::string_view curr;
+                if (!tenantEnv.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(r.levId), curr)) continue;
+                if (curr != r.orig) continue;
+
+                tenantEnv.dbi_EventPayload.put(txn, lmdb::to_sv<uint64_t>(r.levId), r.payload);
+
+                bytesBefore += r.orig.size();
+                bytesAfter += r.payload.size();
+                numWritten++;
+            }
+
+            auto state = tenantEnv.lookup_CompactionState(txn, 1);
+            if (state) tenantEnv.update_CompactionState(txn, *state, { .levIdCursor = cursorPos });
+            else tenantEnv.insert_CompactionState(txn, cursorPos, 0);
+
+            txn.commit();
+        }
+
+        if (numWritten) {
+            metrics::inc(subdomain, metrics::Counter::CompactionEvents, numWritten);
+            metrics::inc(subdomain, metrics::Counter::CompactionBytesBefore, bytesBefore);
+            metrics::inc(subdomain, metrics::Counter::CompactionBytesAfter, bytesAfter);
+        }
+
+        return more;
+    }
+
+    // Move one batch of payloads older than coldTier.minAgeSeconds to cold segments. Returns false when caught up.
+    //
+    // Segments are synced before the stubs are committed, so a crash can only leave unreferenced
+    // records at the end of a segment.
+
+    bool migrateBatch(ColdStorage::Writer &writer) {
+        struct Migrated {
+            uint64_t levId;
+            std::string stub;
+            std::string orig;
+        };
+
+        std::vector<Migrated> results;
+        uint64_t cursorPos;
+        bool more = true;
+
+        {
+            auto txn = tenantEnv.txn_ro();
+
+            auto state = tenantEnv.lookup_CompactionState(txn, 1);
+            cursorPos = state ? state->coldLevIdCursor() : 0;
+
+            auto dictIds = loadDicts(txn);
+            uint64_t cutoff = hoytech::curr_time_s() - cfg().relay__coldTier__minAgeSeconds;
+
+            auto cursor = lmdb::cursor::open(txn, tenantEnv.dbi_EventPayload);
+            uint64_t startLevId = cursorPos + 1;
+            std::string_view k = lmdb::to_sv<uint64_t>(startLevId), v;
+            uint64_t examined = 0;
+            std::string record;
+
+            for (bool found = cursor.get(k, v, MDB_SET_RANGE); ; found = cursor.get(k, v, MDB_NEXT)) {
+                if (!found) {
+                    more = false;
+                    break;
+                }
+
+                if (examined++ >= cfg().relay__compaction__batchSize) break;
+
+                uint64_t levId = lmdb::from_sv<uint64_t>(k);
+
+                auto ev = tenantEnv.lookup_Event(txn, levId);
+                if (!ev) {
+                    cursorPos = levId;
+                    continue;
+                }
+
+                PackedEventView packed(ev->buf);
+
+                if (packed.created_at() > cutoff) {
+                    more = false;
+                    break;
+                }
+
+                cursorPos = levId;
+
+                if (v.size() == 0 || v[0] == '\x03') continue;
+
+                if (v[0] == '\x00') {
+                    uint64_t dictId = dictIds[(uint64_t)kindClassOf(packed.kind())];
+                    encodeEventPayload(txn, comp, dictId, cfg().relay__compaction__level, 1, v.substr(1), record);
+                } else {
+                    record = v;
+                }
+
+                results.emplace_back(Migrated{ levId, writer.append(levId, record), std::string(v) });
+            }
+        }
+
+        if (results.size()) writer.sync();
+
+        uint64_t numWritten = 0;
+
+        {
+            auto txn = tenantEnv.txn_rw();
+
+            for (auto &r : results) {
+                std::string_view curr;
+                if (!tenantEnv.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(r.levId), curr)) continue;
+                if (curr != r.orig) continue; // deleted or rewritten since it was copied
+
+                tenantEnv.dbi_EventPayload.put(txn, lmdb::to_sv<uint64_t>(r.levId), r.stub);
+                numWritten++;
+            }
+
+            auto state = tenantEnv.lookup_CompactionState(txn, 1);
+            if (state) tenantEnv.update_CompactionState(txn, *state, { .coldLevIdCursor = cursorPos });
+            else tenantEnv.insert_CompactionState(txn, 0, cursorPos);
+
+            txn.commit();
+        }
+
+        if (numWritten) metrics::inc(subdomain, metrics::Counter::ColdTierEvents, numWritten);
+
+        return more;
+    }
+};
+
+
+void RelayServer::runCompaction() {
+    setThreadName("compaction");
+
+    while (1) {
+        std::vector<std::pair<std::string, defaultDb::environment*>> tenants;
+
+        {
+            std::lock_guard<std::mutex> lock(tenantEnvsMutex);
+            for (auto &[subdomain, tenantEnv] : tenantEnvs) tenants.emplace_back(subdomain, tenantEnv.get());
+        }
+
+        for (auto &[subdomain, tenantEnv] : tenants) {
+            try {
+                Compactor compactor(subdomain, *tenantEnv);
+
+                if (cfg().relay__compaction__enabled) {
+                    compactor.trainDicts();
+
+                    while (compactor.compressBatch()) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(cfg().relay__compaction__batchPauseMilliseconds));
+                    }
+                }
+
+                if (cfg().relay__coldTier__enabled) {
+                    ColdStorage::Writer writer(tenantEnv->lmdb_env.handle(), cfg().relay__coldTier__segmentMaxBytes);
+
+                    while (compactor.migrateBatch(writer)) {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(cfg().relay__compaction__batchPauseMilliseconds));
+                    }
+                }
+            } catch (std::exception &e) {
+                LE << "Compaction failed for " << subdomain << ": " << e.what();
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::seconds(cfg().relay__compaction__intervalSeconds));
+    }
+}
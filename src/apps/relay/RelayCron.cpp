@@ -8,6 +8,8 @@ void RelayServer::runCron() {
 
     cron.setupCb = []{ setThreadName("cron"); };
 
+    NegentropyFilterCache neFilterCache; // keyed by tenant DB, and only used from the cron thread
+
 
     // Delete expired events for all tenants
 
@@ -53,12 +55,13 @@ void RelayServer::runCron() {
 
             if (expiredLevIds.size() > 0) {
                 auto txn = tenantEnv->txn_rw();
-                NegentropyFilterCache neFilterCache;
 
                 uint64_t numDeleted = deleteEvents(txn, neFilterCache, expiredLevIds);
 
                 txn.commit();
 
+                if (numDeleted) deleteGenerations.bump(tenantEnv->lmdb_env.handle());
+
                 if (numDeleted) LI << "Deleted " << numDeleted << " events for subdomain " << subdomain << " (ephemeral=" << numEphemeral << " expired=" << numExpired << ")";
             }
         }
@@ -1,13 +1,17 @@
 #include "RelayServer.h"
 #include "TenantManager.h"
+#include "ReadTxnManager.h"
+#include "EventIdFilter.h"
+#include "NegentropyVectorCache.h"
 
 
 void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
     secp256k1_context *secpCtx = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
-    Decompressor decomp;
     flat_hash_map<uint64_t, AuthStatus*> connIdToAuthStatus;
+    ReadTxnManager txns(cfg().relay__maxReadTxnAgeMilliseconds * 1000);
 
     while(1) {
+        txns.resetAll();
         auto newMsgs = thr.inbox.pop_all();
 
         std::vector<MsgWriter> writerMsgs;
@@ -15,10 +19,6 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgIngester::ClientMessage>(&newMsg.msg)) {
                 try {
-                    // Get tenant database for this connection
-                    auto& tenantEnv = getTenantEnv(msg->subdomain);
-                    auto txn = tenantEnv.txn_ro();
-
                     if (msg->payload.starts_with('[')) {
                         auto payload = tao::json::from_string(msg->payload);
 
@@ -29,11 +29,22 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
 
                         auto &cmd = jsonGetString(arr[0], "first element not a command like REQ");
 
+                        metrics::inc(msg->subdomain,
+                            cmd == "EVENT" ? metrics::Counter::MsgEvent :
+                            cmd == "REQ" ? metrics::Counter::MsgReq :
+                            cmd == "CLOSE" ? metrics::Counter::MsgClose :
+                            cmd == "AUTH" ? metrics::Counter::MsgAuth :
+                            cmd == "NEG-OPEN" ? metrics::Counter::MsgNegOpen :
+                            cmd == "NEG-MSG" ? metrics::Counter::MsgNegMsg :
+                            cmd == "NEG-CLOSE" ? metrics::Counter::MsgNegClose :
+                            metrics::Counter::MsgOther);
+
                         if (cmd == "EVENT") {
                             if (cfg().relay__logging__dumpInEvents) LI << "[" << msg->connId << "] dumpInEvent: " << msg->payload; 
 
                             try {
-                                ingesterProcessEvent(txn, msg->connId, connIdToAuthStatus, msg->ipAddr, msg->subdomain, secpCtx, arr[1], writerMsgs);
+                                auto &txn = txns.get(getTenantEnv(msg->subdomain));
+                                ingesterProcessEvent(txn, msg->connId, connIdToAuthStatus, msg->ipAddr, msg->subdomain, msg->receivedAt, secpCtx, arr[1], writerMsgs);
                             } catch (std::exception &e) {
                                 sendOKResponse(msg->connId, arr[1].is_object() && arr[1].at("id").is_string() ? arr[1].at("id").get_string() : "?",
                                                false, std::string("invalid: ") + e.what());
@@ -51,7 +62,7 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                             if (cfg().relay__logging__dumpInReqs) LI << "[" << msg->connId << "] dumpInReq: " << msg->payload; 
 
                             try {
-                                ingesterProcessReq(txn, msg->connId, msg->subdomain, arr);
+                                ingesterProcessReq(msg->connId, msg->subdomain, msg->receivedAt, arr);
                             } catch (std::exception &e) {
                                 sendNoticeError(msg->connId, std::string("bad req: ") + e.what());
                             }
@@ -59,7 +70,7 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                             if (cfg().relay__logging__dumpInReqs) LI << "[" << msg->connId << "] dumpInReq: " << msg->payload; 
 
                             try {
-                                ingesterProcessClose(txn, msg->connId, arr);
+                                ingesterProcessClose(msg->connId, arr);
                             } catch (std::exception &e) {
                                 sendNoticeError(msg->connId, std::string("bad close: ") + e.what());
                             }
@@ -67,7 +78,7 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
                             if (!cfg().relay__negentropy__enabled) throw herr("negentropy disabled");
 
                             try {
-                                ingesterProcessNegentropy(txn, decomp, msg->connId, msg->subdomain, arr);
+                                ingesterProcessNegentropy(msg->connId, msg->subdomain, arr);
                             } catch (std::exception &e) {
                                 sendNoticeError(msg->connId, std::string("negentropy error: ") + e.what());
                             }
@@ -97,9 +108,52 @@ void RelayServer::runIngester(ThreadPool<MsgIngester>::Thread &thr) {
     }
 }
 
-void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, flat_hash_map<uint64_t, AuthStatus*> &connIdToAuthStatus, std::string ipAddr, std::string subdomain, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output) {
+void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, flat_hash_map<uint64_t, AuthStatus*> &connIdToAuthStatus, std::string ipAddr, std::string subdomain, uint64_t receivedAt, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output) {
     std::string packedStr, jsonStr;
 
+    auto &tenantEnv = getTenantEnv(subdomain);
+    bool maybeStored = true;
+
+    auto isProtected = [](PackedEventView packed){
+        bool foundProtected = false;
+
+        packed.foreachTag([&](char tagName, std::string_view tagVal){
+            if (tagName == '-') {
+                foundProtected = true;
+                return false;
+            }
+            return true;
+        });
+
+        return foundProtected;
+    };
+
+    if (cfg().relay__dupFilter__enabled) {
+        // Re-sent events are common, so answer them before the expensive parsing and signature verification.
+        // Replying "duplicate" to a forged event with the id of a stored one is harmless, since nothing is written.
+        // The stored event has the same id, so its pubkey and tags are the ones this event claims: if its author
+        // can't write to this tenant or it is protected, take the full path so it gets the usual response.
+
+        const tao::json::value *idVal = origJson.is_object() ? origJson.find("id") : nullptr;
+
+        if (idVal && idVal->is_string() && idVal->get_string().size() == 64) {
+            std::string id = hexDecode(idVal->get_string());
+            maybeStored = eventIdFilter.mayContain(txn, tenantEnv, id);
+
+            auto existing = maybeStored ? lookupEventById(txn, id) : std::nullopt;
+
+            if (existing) {
+                PackedEventView stored(existing->buf);
+
+                if (g_tenantManager.canWriteToTenant(subdomain, std::string(stored.pubkey())) && !isProtected(stored)) {
+                    metrics::inc(subdomain, metrics::Counter::IngestDuplicates);
+                    sendOKResponse(connId, idVal->get_string(), true, "duplicate: have this event");
+                    return;
+                }
+            }
+        }
+    }
+
     parseAndVerifyEvent(origJson, secpCtx, true, true, packedStr, jsonStr);
 
     PackedEventView packed(packedStr);
@@ -108,28 +162,18 @@ void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, flat_has
     std::string eventPubkey = std::string(packed.pubkey());
     if (!g_tenantManager.canWriteToTenant(subdomain, eventPubkey)) {
         LI << "Access denied: pubkey " << eventPubkey << " cannot write to tenant " << subdomain;
-        sendOKResponse(connId, to_hex(packed.id()), false, "restricted: access denied to this tenant");
+        sendOKResponse(connId, hexEncode(packed.id()), false, "restricted: access denied to this tenant");
         return;
     }
 
     {
-        bool foundProtected = false;
-
-        packed.foreachTag([&](char tagName, std::string_view tagVal){
-            if (tagName == '-') {
-                foundProtected = true;
-                return false;
-            }
-            return true;
-        });
-
-        if (foundProtected) {
+        if (isProtected(packed)) {
             // NIP-70 protected events must be rejected unless published by an authenticated public key
             // that matches the event author, so we do all the AUTH flow here
             if (cfg().relay__serviceUrl.empty()) {
                 // except if we don't have a serviceUrl, in that case just fail
                 LI << "Protected event and no serviceUrl configured, skipping";
-                sendOKResponse(connId, to_hex(packed.id()), false, "blocked: event marked as protected");
+                sendOKResponse(connId, hexEncode(packed.id()), false, "blocked: event marked as protected");
                 return;
             }
 
@@ -141,37 +185,37 @@ void RelayServer::ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, flat_has
                 connIdToAuthStatus.emplace(connId, authStatus);
                 LI << "Protected event, requesting AUTH";
                 sendAuthChallenge(connId, authStatus->challenge);
-                sendOKResponse(connId, to_hex(packed.id()), false, "auth-required: event marked as protected");
+                sendOKResponse(connId, hexEncode(packed.id()), false, "auth-required: event marked as protected");
                 return;
             }
 
             const auto authed = (*as->second).authed;
             if (authed.empty()) {
                 // not authenticated
-                sendOKResponse(connId, to_hex(packed.id()), false, "auth-required: event marked as protected");
+                sendOKResponse(connId, hexEncode(packed.id()), false, "auth-required: event marked as protected");
                 return;
             } else if (authed != packed.pubkey()) {
                 // authenticated as someone else
-                sendOKResponse(connId, to_hex(packed.id()), false, "restricted: must be published by the author");
+                sendOKResponse(connId, hexEncode(packed.id()), false, "restricted: must be published by the author");
                 return;
             }
             // otherwise we proceed to accept the event
         }
     }
 
-    {
+    if (maybeStored) {
         auto existing = lookupEventById(txn, packed.id());
         if (existing) {
             LI << "Duplicate event, skipping";
-            sendOKResponse(connId, to_hex(packed.id()), true, "duplicate: have this event");
+            sendOKResponse(connId, hexEncode(packed.id()), true, "duplicate: have this event");
             return;
         }
     }
 
-    output.emplace_back(MsgWriter{MsgWriter::AddEvent{connId, std::move(ipAddr), subdomain, std::move(packedStr), std::move(jsonStr)}});
+    output.emplace_back(MsgWriter{MsgWriter::AddEvent{connId, std::move(ipAddr), subdomain, std::move(packedStr), std::move(jsonStr), receivedAt}});
 }
 
-void RelayServer::ingesterProcessReq(lmdb::txn &txn, uint64_t connId, std::string subdomain, const tao::json::value &arr) {
+void RelayServer::ingesterProcessReq(uint64_t connId, std::string subdomain, uint64_t receivedAt, const tao::json::value &arr) {
     if (arr.get_array().size() < 2 + 1) throw herr("arr too small");
     if (arr.get_array().size() > 2 + cfg().relay__maxReqFilterSize) throw herr("arr too big");
 
@@ -180,11 +224,12 @@ void RelayServer::ingesterProcessReq(lmdb::txn &txn, uint64_t connId, std::strin
     // For now, we only control write access (EVENT messages)
     
     Subscription sub(connId, jsonGetString(arr[1], "REQ subscription id was not a string"), NostrFilterGroup(arr), subdomain);
+    sub.receivedAt = receivedAt;
 
     tpReqWorker.dispatch(connId, MsgReqWorker{MsgReqWorker::NewSub{std::move(sub), subdomain}});
 }
 
-void RelayServer::ingesterProcessClose(lmdb::txn &txn, uint64_t connId, const tao::json::value &arr) {
+void RelayServer::ingesterProcessClose(uint64_t connId, const tao::json::value &arr) {
     if (arr.get_array().size() != 2) throw herr("arr too small/big");
 
     tpReqWorker.dispatch(connId, MsgReqWorker{MsgReqWorker::RemoveSub{connId, SubId(jsonGetString(arr[1], "CLOSE subscription id was not a string"))}});
@@ -238,10 +283,10 @@ void RelayServer::ingesterProcessAuth(uint64_t connId, flat_hash_map<uint64_t, A
     // set the connection as authenticated with this pubkey
     (*as->second).authed = packed.pubkey();
 
-    sendOKResponse(connId, to_hex(packed.id()), true, "successfully authenticated");
+    sendOKResponse(connId, hexEncode(packed.id()), true, "successfully authenticated");
 }
 
-void RelayServer::ingesterProcessNegentropy(lmdb::txn &txn, Decompressor &decomp, uint64_t connId, std::string subdomain, const tao::json::value &arr) {
+void RelayServer::ingesterProcessNegentropy(uint64_t connId, std::string subdomain, const tao::json::value &arr) {
     const auto &subscriptionStr = jsonGetString(arr[1], "NEG-OPEN subscription id was not a string");
 
     if (arr.at(0) == "NEG-OPEN") {
@@ -254,17 +299,22 @@ void RelayServer::ingesterProcessNegentropy(lmdb::txn &txn, Decompressor &decomp
         NostrFilterGroup filter = NostrFilterGroup::unwrapped(filterJson, maxFilterLimit);
         Subscription sub(connId, subscriptionStr, std::move(filter), subdomain);
 
+        std::string fullFilterStr = NegentropyVectorCache::canonicalKey(filterJson);
+
         if (filterJson.is_object()) {
             filterJson.get_object().erase("since");
             filterJson.get_object().erase("until");
         }
         std::string filterStr = tao::json::to_string(filterJson);
 
-        std::string negPayload = from_hex(jsonGetString(arr.at(3), "negentropy payload not a string"));
+        // A tree holds every matching event, so it can't stand in for a filter with a limit
+        bool treeCandidate = filterJson.is_object() && !filterJson.get_object().contains("limit");
+
+        std::string negPayload = hexDecode(jsonGetString(arr.at(3), "negentropy payload not a string"));
 
-        tpNegentropy.dispatch(connId, MsgNegentropy{MsgNegentropy::NegOpen{std::move(sub), subdomain, std::move(filterStr), std::move(negPayload)}});
+        tpNegentropy.dispatch(connId, MsgNegentropy{MsgNegentropy::NegOpen{std::move(sub), subdomain, std::move(filterStr), std::move(fullFilterStr), std::move(negPayload), treeCandidate}});
     } else if (arr.at(0) == "NEG-MSG") {
-        std::string negPayload = from_hex(jsonGetString(arr.at(2), "negentropy payload not a string"));
+        std::string negPayload = hexDecode(jsonGetString(arr.at(2), "negentropy payload not a string"));
         tpNegentropy.dispatch(connId, MsgNegentropy{MsgNegentropy::NegMsg{connId, SubId(subscriptionStr), std::move(negPayload)}});
     } else if (arr.at(0) == "NEG-CLOSE") {
         tpNegentropy.dispatch(connId, MsgNegentropy{MsgNegentropy::NegClose{connId, SubId(subscriptionStr)}});
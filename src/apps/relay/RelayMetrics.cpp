@@ -0,0 +1,78 @@
+#include "RelayServer.h"
+#include "SigVerifyCache.h"
+#include "NegentropyVectorCache.h"
+
+
+std::string RelayServer::renderMetrics() {
+    std::string output;
+
+    // Queue depths
+
+    output += "# HELP strfry_inbox_depth Messages waiting in each thread's inbox\n";
+    output += "# TYPE strfry_inbox_depth gauge\n";
+
+    auto renderPool = [&](auto &tp){
+        for (auto &t : tp.pool) {
+            output += "strfry_inbox_depth{pool=\"" + tp.name + "\",thread=\"" + std::to_string(t.id) + "\"} ";
+            output += std::to_string(t.inbox.depth.load(std::memory_order_relaxed));
+            output += "\n";
+        }
+    };
+
+    renderPool(tpWebsocket);
+    renderPool(tpIngester);
+    renderPool(tpWriter);
+    renderPool(tpReqWorker);
+    renderPool(tpReqMonitor);
+    renderPool(tpNegentropy);
+
+    // Back-pressure
+
+    output += "# HELP strfry_backpressure_throttled_connections Connections currently above the send buffer soft limit\n";
+    output += "# TYPE strfry_backpressure_throttled_connections gauge\n";
+    output += "strfry_backpressure_throttled_connections " + std::to_string(backpressureStats.throttledConns.load()) + "\n";
+
+    output += "# HELP strfry_backpressure_throttled_total Times a connection crossed the send buffer soft limit\n";
+    output += "# TYPE strfry_backpressure_throttled_total counter\n";
+    output += "strfry_backpressure_throttled_total " + std::to_string(backpressureStats.totalThrottled.load()) + "\n";
+
+    output += "# HELP strfry_backpressure_dropped_total Connections closed for crossing the send buffer hard limit\n";
+    output += "# TYPE strfry_backpressure_dropped_total counter\n";
+    output += "strfry_backpressure_dropped_total " + std::to_string(backpressureStats.totalDropped.load()) + "\n";
+
+    // Decoded event JSON cache
+
+    output += "# HELP strfry_event_json_cache_hits_total Compressed events served from the decoded JSON cache\n";
+    output += "# TYPE strfry_event_json_cache_hits_total counter\n";
+    output += "strfry_event_json_cache_hits_total " + std::to_string(eventJsonCache.hits.load()) + "\n";
+
+    output += "# HELP strfry_event_json_cache_misses_total Compressed events that had to be decompressed\n";
+    output += "# TYPE strfry_event_json_cache_misses_total counter\n";
+    output += "strfry_event_json_cache_misses_total " + std::to_string(eventJsonCache.misses.load()) + "\n";
+
+    // Verified signature cache
+
+    output += "# HELP strfry_sig_cache_hits_total Event signatures found in the verified signature cache\n";
+    output += "# TYPE strfry_sig_cache_hits_total counter\n";
+    output += "strfry_sig_cache_hits_total " + std::to_string(sigVerifyCache.hits.load()) + "\n";
+
+    output += "# HELP strfry_sig_cache_misses_total Event signatures that had to be verified\n";
+    output += "# TYPE strfry_sig_cache_misses_total counter\n";
+    output += "strfry_sig_cache_misses_total " + std::to_string(sigVerifyCache.misses.load()) + "\n";
+
+    // Negentropy vector cache
+
+    output += "# HELP strfry_negentropy_vector_cache_hits_total NEG-OPEN requests served from a cached result set\n";
+    output += "# TYPE strfry_negentropy_vector_cache_hits_total counter\n";
+    output += "strfry_negentropy_vector_cache_hits_total " + std::to_string(negentropyVectorCache.hits.load()) + "\n";
+
+    output += "# HELP strfry_negentropy_vector_cache_misses_total NEG-OPEN requests that needed a DB query\n";
+    output += "# TYPE strfry_negentropy_vector_cache_misses_total counter\n";
+    output += "strfry_negentropy_vector_cache_misses_total " + std::to_string(negentropyVectorCache.misses.load()) + "\n";
+
+    // Per-tenant counters and histograms
+
+    metrics::render(output);
+
+    return output;
+}
@@ -117,11 +117,15 @@ defaultDb::environment& RelayServer::getTenantEnv(const std::string& subdomain)
         auto s = newEnv->lookup_Meta(txn, 1);
         if (!s) {
             newEnv->insert_Meta(txn, CURR_DB_VERSION, 1, 1);
-            newEnv->insert_NegentropyFilter(txn, "{}");
-                        
-            // Set up Negentropy database for this tenant
-            negentropy::storage::BTreeLMDB::setupDB(txn, "negentropy");
+            newEnv->insert_NegentropyFilter(txn, "{}", 0, 0);
+        } else if (s->dbVersion() == 3) {
+            LI << "Upgrading tenant database for subdomain " << subdomain << " to version " << CURR_DB_VERSION;
+            backfillIdPrefixIndex(txn);
+            newEnv->update_Meta(txn, *s, { .dbVersion = CURR_DB_VERSION });
         }
+
+        // Open (and if necessary create) this tenant's negentropy table
+        setupNegentropyDbi(txn);
         
         txn.commit();
     }
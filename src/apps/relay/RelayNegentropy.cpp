@@ -5,12 +5,20 @@
 
 #include "RelayServer.h"
 #include "QueryScheduler.h"
+#include "ReadTxnManager.h"
+#include "NegentropyVectorCache.h"
+
+
+NegentropyVectorCache negentropyVectorCache;
 
 
 struct NegentropyViews {
     struct MemoryView {
         std::string initialMsg;
-        negentropy::storage::Vector storageVector;
+        std::string filterStr; // without since/until. Empty if usage shouldn't count towards an auto tree
+        std::string fullFilterStr; // key in negentropyVectorCache
+        uint64_t deleteGeneration; // from before the query's snapshot
+        NegentropyVectorCache::VectorPtr storageVector = std::make_shared<negentropy::storage::Vector>(); // may be shared with other views once sealed
         std::vector<uint64_t> levIds;
         uint64_t startTime = hoytech::curr_time_us();
     };
@@ -25,7 +33,7 @@ struct NegentropyViews {
     using ConnViews = flat_hash_map<SubId, UserView>;
     flat_hash_map<uint64_t, ConnViews> conns; // connId -> subId -> UserView
 
-    bool addMemoryView(uint64_t connId, const SubId &subId, const std::string &initialMsg) {
+    bool addMemoryView(uint64_t connId, const SubId &subId, const std::string &initialMsg, const std::string &filterStr, const std::string &fullFilterStr, uint64_t deleteGeneration, NegentropyVectorCache::VectorPtr sealed = nullptr) {
         {
             auto *existing = findView(connId, subId);
             if (existing) removeView(connId, subId);
@@ -38,7 +46,10 @@ struct NegentropyViews {
             return false;
         }
 
-        connViews.try_emplace(subId, UserView{ MemoryView{ initialMsg, } });
+        MemoryView view{ initialMsg, filterStr, fullFilterStr, deleteGeneration, };
+        if (sealed) view.storageVector = sealed;
+
+        connViews.try_emplace(subId, UserView{ std::move(view) });
 
         return true;
     }
@@ -90,6 +101,7 @@ struct NegentropyViews {
 void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
     QueryScheduler queries;
     NegentropyViews views;
+    ReadTxnManager txns(cfg().relay__maxReadTxnAgeMilliseconds * 1000);
 
 
     auto handleReconcile = [&](uint64_t connId, const SubId &subId, negentropy::StorageBase &storage, const std::string &msg) {
@@ -114,13 +126,84 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
         sendToConn(connId, tao::json::to_string(tao::json::value::array({
             "NEG-MSG",
             subId.str(),
-            to_hex(resp)
+            hexEncode(resp)
         })));
     };
 
 
+    // Returns a sealed vector for the filter from the cache, after adding any events written since it was built
+
+    auto getCachedVector = [&](lmdb::txn &txn, defaultDb::environment &tenantEnv, const Subscription &sub, const std::string &fullFilterStr, uint64_t deleteGeneration) -> NegentropyVectorCache::VectorPtr {
+        if (!negentropyVectorCache.enabled()) return nullptr;
+
+        MDB_env *e = mdb_txn_env(txn.handle());
+        auto entry = negentropyVectorCache.get(e, fullFilterStr, deleteGeneration);
+        if (!entry) return nullptr;
+
+        uint64_t latestEventId = getMostRecentLevId(txn);
+        if (entry->latestEventId >= latestEventId) return entry->vec;
+
+        // With a client-supplied limit, new events can push older ones out of the result, so the vector can't just be extended
+        for (const auto &f : sub.filterGroup.filters) {
+            if (f.limit <= cfg().relay__negentropy__maxSyncEvents) return nullptr;
+        }
+
+        std::vector<std::pair<uint64_t, std::string>> newItems;
+        bool tooMany = false;
+
+        tenantEnv.foreach_Event(txn, [&](auto &ev){
+            PackedEventView packed(ev.buf);
+
+            if (sub.filterGroup.doesMatch(packed)) {
+                newItems.emplace_back(packed.created_at(), std::string(packed.id()));
+
+                if (entry->vec->size() + newItems.size() > cfg().relay__negentropy__maxSyncEvents) {
+                    tooMany = true;
+                    return false;
+                }
+            }
+
+            return true;
+        }, false, entry->latestEventId + 1);
+
+        if (tooMany) return nullptr;
+
+        if (newItems.size()) {
+            auto vec = std::make_shared<negentropy::storage::Vector>();
+
+            try {
+                for (size_t i = 0; i < entry->vec->size(); i++) {
+                    const auto &item = entry->vec->getItem(i);
+                    vec->insert(item.timestamp, item.getId());
+                }
+
+                for (auto &[createdAt, id] : newItems) vec->insert(createdAt, id);
+
+                vec->seal();
+            } catch (std::exception &) {
+                // An event was deleted and re-written since the vector was built
+                return nullptr;
+            }
+
+            entry->vec = vec;
+        }
+
+        entry->latestEventId = latestEventId;
+        negentropyVectorCache.put(e, fullFilterStr, *entry);
+
+        return entry->vec;
+    };
+
+
     queries.ensureExists = false;
 
+    if (negentropyStealGroup) {
+        queries.joinStealGroup(negentropyStealGroup.get(), thr.id);
+        queries.onStolenComplete = [&](DBQuery *q){
+            tpNegentropy.dispatch(q->sub.connId, MsgNegentropy{MsgNegentropy::QueryComplete{q}});
+        };
+    }
+
     queries.onEventBatch = [&](lmdb::txn &txn, const auto &sub, const std::vector<uint64_t> &levIds){
         auto *userView = views.findView(sub.connId, sub.subId);
         if (!userView) return;
@@ -133,17 +216,13 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
         }
     };
 
-    queries.onComplete = [&](lmdb::txn &txn, Subscription &sub){
-        auto *userView = views.findView(sub.connId, sub.subId);
-        if (!userView) return;
-
-        auto *view = std::get_if<NegentropyViews::MemoryView>(userView);
-        if (!view) throw herr("bad variant, expected memory view");
+    // Memory views are filled either by a query, or for filters on times only, from the id index
 
-        LI << "[" << sub.connId << "] Negentropy query matched " << view->levIds.size() << " events in "
-           << (hoytech::curr_time_us() - view->startTime) << "us";
+    auto checkViewSize = [&](const Subscription &sub, NegentropyViews::MemoryView &view, uint64_t numMatched){
+        LI << "[" << sub.connId << "] Negentropy query matched " << numMatched << " events in "
+           << (hoytech::curr_time_us() - view.startTime) << "us";
 
-        if (view->levIds.size() > cfg().relay__negentropy__maxSyncEvents) {
+        if (numMatched > cfg().relay__negentropy__maxSyncEvents) {
             LI << "[" << sub.connId << "] Negentropy query size exceeded " << cfg().relay__negentropy__maxSyncEvents;
 
             sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({
@@ -154,34 +233,61 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
             })));
 
             views.removeView(sub.connId, sub.subId);
-            return;
+            return false;
         }
 
-        std::sort(view->levIds.begin(), view->levIds.end());
+        return true;
+    };
 
-        for (auto levId : view->levIds) {
-            try {
-                auto ev = lookupEventByLevId(txn, levId);
-                PackedEventView packed(ev.buf);
-                view->storageVector.insert(packed.created_at(), packed.id());
-            } catch (std::exception &) {
-                // levId was deleted when query was paused
-            }
+    auto completeView = [&](lmdb::txn &txn, const Subscription &sub, NegentropyViews::MemoryView &view){
+        view.storageVector->seal();
+
+        if (view.filterStr.size()) {
+            negentropyUsage.recordQuery(sub.subdomain, view.filterStr, hoytech::curr_time_us() - view.startTime);
         }
 
-        view->levIds.clear();
-        view->levIds.shrink_to_fit();
+        if (negentropyVectorCache.enabled()) {
+            negentropyVectorCache.put(mdb_txn_env(txn.handle()), view.fullFilterStr, { view.storageVector, sub.latestEventId, hoytech::curr_time_s(), view.deleteGeneration });
+        }
+
+        // handleReconcile() may remove the view
+        auto storageVector = view.storageVector;
+        auto initialMsg = std::move(view.initialMsg);
+        view.initialMsg = "";
+
+        handleReconcile(sub.connId, sub.subId, *storageVector, initialMsg);
+    };
+
+    queries.onComplete = [&](lmdb::txn &txn, Subscription &sub){
+        auto *userView = views.findView(sub.connId, sub.subId);
+        if (!userView) return;
+
+        auto *view = std::get_if<NegentropyViews::MemoryView>(userView);
+        if (!view) throw herr("bad variant, expected memory view");
 
-        view->storageVector.seal();
+        if (!checkViewSize(sub, *view, view->levIds.size())) return;
 
-        handleReconcile(sub.connId, sub.subId, view->storageVector, view->initialMsg);
+        foreachNegentropyItem(txn, view->levIds, [&](uint64_t createdAt, std::string_view id){
+            view->storageVector->insert(createdAt, id);
+        });
 
-        view->initialMsg = "";
+        view->levIds.clear();
+        view->levIds.shrink_to_fit();
+
+        completeView(txn, sub, *view);
     };
 
 
     while(1) {
-        auto newMsgs = queries.running.empty() ? thr.inbox.pop_all() : thr.inbox.pop_all_no_wait();
+        std::deque<MsgNegentropy> newMsgs;
+
+        if (queries.hasRunning()) {
+            newMsgs = thr.inbox.pop_all_no_wait();
+        } else {
+            txns.resetAll();
+            if (queries.stealGroup && queries.stealGroup->hasStealable()) newMsgs = thr.inbox.pop_all_wait_for(std::chrono::milliseconds(1)); // wake up to look for work to steal
+            else newMsgs = thr.inbox.pop_all(); // returns early if the steal group gets work to spare
+        }
 
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgNegentropy::NegOpen>(&newMsg.msg)) {
@@ -189,13 +295,16 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
                 auto subId = msg->sub.subId;
                 auto& subdomain = msg->subdomain;
                 std::optional<uint64_t> treeId;
+                std::string usageFilterStr = msg->treeCandidate ? msg->filterStr : "";
 
-                // Get tenant database for this subdomain
+                // Get tenant database for this subdomain. If cached vectors are used, the snapshot must
+                // be taken after reading deleteGeneration, so that it reflects every deletion counted
                 auto& tenantEnv = getTenantEnv(subdomain);
-                auto txn = tenantEnv.txn_ro();
+                uint64_t deleteGeneration = deleteGenerations.get(tenantEnv.lmdb_env.handle());
+                auto &txn = txns.get(tenantEnv, negentropyVectorCache.enabled());
 
                 tenantEnv.foreach_NegentropyFilter(txn, [&](auto &f){
-                    if (f.filter() == msg->filterStr) {
+                    if (f.filter() == msg->filterStr && f.state() == 0) {
                         treeId = f.primaryKeyId;
                         return false;
                     }
@@ -203,7 +312,9 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
                 });
 
                 if (treeId) {
-                    negentropy::storage::BTreeLMDB storage(txn, negentropyDbi, *treeId);
+                    negentropyUsage.recordTree(subdomain, *treeId);
+
+                    negentropy::storage::BTreeLMDB storage(txn, getNegentropyDbi(txn), *treeId);
 
                     const auto &f = msg->sub.filterGroup.filters.at(0);
                     negentropy::storage::SubRange subStorage(storage, negentropy::Bound(f.since), negentropy::Bound(f.until == MAX_U64 ? MAX_U64 : f.until + 1));
@@ -213,12 +324,40 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
                         queries.removeSub(connId, subId);
                         sendNoticeError(connId, std::string("too many concurrent NEG requests"));
                     }
+                } else if (auto vec = getCachedVector(txn, tenantEnv, msg->sub, msg->fullFilterStr, deleteGeneration)) {
+                    if (msg->treeCandidate) negentropyUsage.recordQuery(subdomain, msg->filterStr, 0);
+
+                    if (!views.addMemoryView(connId, subId, "", usageFilterStr, msg->fullFilterStr, deleteGeneration, vec)) {
+                        sendNoticeError(connId, std::string("too many concurrent NEG requests"));
+                        continue;
+                    }
+
+                    handleReconcile(connId, subId, *vec, msg->negPayload);
+                } else if (canScanNegentropyIndex(txn, msg->sub.filterGroup)) {
+                    queries.removeSub(connId, subId);
+
+                    if (!views.addMemoryView(connId, subId, msg->negPayload, usageFilterStr, msg->fullFilterStr, deleteGeneration)) {
+                        sendNoticeError(connId, std::string("too many concurrent NEG requests"));
+                        continue;
+                    }
+
+                    auto *view = std::get_if<NegentropyViews::MemoryView>(views.findView(connId, subId));
+                    msg->sub.latestEventId = getMostRecentLevId(txn);
+                    uint64_t numMatched = 0;
+
+                    // The filters have no limit below the size of the DB, so this inserts at most maxSyncEvents + 1 items
+                    foreachNegentropyIndexItem(txn, msg->sub.filterGroup, msg->sub.latestEventId, [&](uint64_t createdAt, std::string_view id){
+                        view->storageVector->insert(createdAt, id);
+                        numMatched++;
+                    });
+
+                    if (checkViewSize(msg->sub, *view, numMatched)) completeView(txn, msg->sub, *view);
                 } else {
                     if (!queries.addSub(txn, std::move(msg->sub))) {
                         sendNoticeError(connId, std::string("too many concurrent REQs"));
                     }
 
-                    if (!views.addMemoryView(connId, subId, msg->negPayload)) {
+                    if (!views.addMemoryView(connId, subId, msg->negPayload, usageFilterStr, msg->fullFilterStr, deleteGeneration)) {
                         queries.removeSub(connId, subId);
                         sendNoticeError(connId, std::string("too many concurrent NEG requests"));
                     }
@@ -238,17 +377,17 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
                 }
 
                 if (auto *view = std::get_if<NegentropyViews::MemoryView>(userView)) {
-                    if (!view->storageVector.sealed) {
+                    if (!view->storageVector->sealed) {
                         sendNoticeError(msg->connId, "negentropy error: got NEG-MSG before NEG-OPEN complete");
                         continue;
                     }
-                    handleReconcile(msg->connId, msg->subId, view->storageVector, msg->negPayload);
+                    handleReconcile(msg->connId, msg->subId, *view->storageVector, msg->negPayload);
                 } else if (auto *view = std::get_if<NegentropyViews::StatelessView>(userView)) {
                     // Get tenant database for this subscription
                     auto& tenantEnv = getTenantEnv(view->sub.subdomain);
-                    auto txn = tenantEnv.txn_ro();
+                    auto &txn = txns.get(tenantEnv);
                     
-                    negentropy::storage::BTreeLMDB storage(txn, negentropyDbi, view->treeId);
+                    negentropy::storage::BTreeLMDB storage(txn, getNegentropyDbi(txn), view->treeId);
 
                     const auto &f = view->sub.filterGroup.filters.at(0);
                     negentropy::storage::SubRange subStorage(storage, negentropy::Bound(f.since), negentropy::Bound(f.until == MAX_U64 ? MAX_U64 : f.until + 1));
@@ -261,7 +400,23 @@ void RelayServer::runNegentropy(ThreadPool<MsgNegentropy>::Thread &thr) {
             } else if (auto msg = std::get_if<MsgNegentropy::CloseConn>(&newMsg.msg)) {
                 queries.closeConn(msg->connId);
                 views.closeConn(msg->connId);
+            } else if (auto msg = std::get_if<MsgNegentropy::QueryComplete>(&newMsg.msg)) {
+                auto& tenantEnv = getTenantEnv(msg->query->sub.subdomain);
+                auto &txn = txns.get(tenantEnv);
+                queries.handleStolenComplete(txn, msg->query);
             }
         }
+
+        // Continue queries that were paused after exhausting their timeslice, or help out another thread
+
+        if (auto subdomain = queries.nextSubdomain()) {
+            auto& tenantEnv = getTenantEnv(*subdomain);
+            auto &txn = txns.get(tenantEnv);
+            queries.process(txn);
+        } else if (auto *q = queries.steal()) {
+            auto& tenantEnv = getTenantEnv(q->sub.subdomain);
+            auto &txn = txns.get(tenantEnv);
+            queries.processStolen(txn, q);
+        }
     }
 }
@@ -0,0 +1,244 @@
+#include <negentropy/storage/BTreeLMDB.h>
+
+#include "RelayServer.h"
+#include "DBQuery.h"
+
+
+// Automatically maintained negentropy trees
+//
+// Filters that are NEG-OPENed often enough get a NegentropyFilter tree, so their syncs become
+// stateless. A tree is first inserted in the "building" state: from then on the writer adds new
+// events to it, while this thread inserts the events that existed before, in small write txns.
+// It is served once complete. Trees that haven't been used for a while are "dropped": the writer
+// stops maintaining them, they are emptied in small write txns, and then the record is removed.
+// Trees created with "strfry negentropy add" are never touched.
+
+struct NegentropyTreeManager {
+    RelayServer &server;
+    std::string subdomain;
+    defaultDb::environment &tenantEnv;
+
+    NegentropyTreeManager(RelayServer &server, const std::string &subdomain) : server(server), subdomain(subdomain), tenantEnv(server.getTenantEnv(subdomain)) {}
+
+    void setState(uint64_t treeId, uint64_t state) {
+        auto txn = tenantEnv.txn_rw();
+
+        auto view = tenantEnv.lookup_NegentropyFilter(txn, treeId);
+        if (!view) throw herr("couldn't find treeId: ", treeId);
+        tenantEnv.update_NegentropyFilter(txn, *view, { .state = state });
+        NegentropyFilterCache::increaseModCounter(txn);
+
+        txn.commit();
+    }
+
+    uint64_t build(const std::string &filterStr) {
+        uint64_t treeId, buildLevId;
+
+        // The writer adds every new matching event to a tree, which a limit would contradict
+        {
+            auto filterJson = tao::json::from_string(filterStr);
+            if (!filterJson.is_object() || filterJson.get_object().contains("limit")) throw herr("can't build an auto tree for filter: ", filterStr);
+        }
+
+        // Once this is committed, the writer adds all later events
+
+        {
+            auto txn = tenantEnv.txn_rw();
+            treeId = tenantEnv.insert_NegentropyFilter(txn, filterStr, 1, 1);
+            NegentropyFilterCache::increaseModCounter(txn);
+            buildLevId = getMostRecentLevId(txn);
+            txn.commit();
+        }
+
+        LI << "[" << subdomain << "] Building negentropy tree " << treeId << " for filter " << filterStr;
+
+        // Find earlier events. The query is limited to one more than maxSyncEvents, which is enough
+        // to know the tree is too big, so a broad filter doesn't collect every levId in the DB
+
+        std::vector<uint64_t> levIds;
+        uint64_t maxEvents = cfg().relay__negentropy__maxSyncEvents;
+
+        {
+            auto txn = tenantEnv.txn_ro();
+
+            DBQuery query(tao::json::from_string(filterStr), maxEvents + 1);
+            query.sub.latestEventId = buildLevId;
+
+            while (!query.process(txn, [&](const auto &, uint64_t levId){ levIds.push_back(levId); })) {}
+        }
+
+        if (levIds.size() > maxEvents) {
+            LI << "[" << subdomain << "] Filter matches too many events for a negentropy tree: more than " << maxEvents;
+            drop(treeId);
+            return 0;
+        }
+
+        std::sort(levIds.begin(), levIds.end());
+
+        // Insert them in batches. Events deleted in the meantime were either skipped by the writer
+        // (not yet in the tree) or are skipped here.
+
+        uint64_t batchSize = std::max(cfg().relay__negentropy__autoTrees__batchSize, uint64_t(1));
+
+        for (size_t i = 0; i < levIds.size(); i += batchSize) {
+            auto txn = tenantEnv.txn_rw();
+            negentropy::storage::BTreeLMDB storage(txn, getNegentropyDbi(txn), treeId);
+
+            for (size_t j = i; j < std::min(levIds.size(), i + batchSize); j++) {
+                auto ev = tenantEnv.lookup_Event(txn, levIds[j]);
+                if (!ev) continue;
+
+                PackedEventView packed(ev->buf);
+                storage.insert(packed.created_at(), packed.id());
+            }
+
+            storage.flush();
+            txn.commit();
+        }
+
+        setState(treeId, 0);
+
+        LI << "[" << subdomain << "] Negentropy tree " << treeId << " ready with " << levIds.size() << " events";
+
+        return treeId;
+    }
+
+    void drop(uint64_t treeId) {
+        setState(treeId, 2);
+
+        uint64_t batchSize = std::max(cfg().relay__negentropy__autoTrees__batchSize, uint64_t(1));
+
+        while (1) {
+            auto txn = tenantEnv.txn_rw();
+            negentropy::storage::BTreeLMDB storage(txn, getNegentropyDbi(txn), treeId);
+
+            auto size = storage.size();
+
+            if (size == 0) {
+                tenantEnv.delete_NegentropyFilter(txn, treeId);
+                NegentropyFilterCache::increaseModCounter(txn);
+                txn.commit();
+                break;
+            }
+
+            std::vector<std::pair<uint64_t, std::string>> items;
+
+            storage.iterate(0, std::min(size, batchSize), [&](const auto &item, size_t){
+                items.emplace_back(item.timestamp, std::string(item.getId()));
+                return true;
+            });
+
+            for (const auto &[createdAt, id] : items) storage.erase(createdAt, id);
+
+            storage.flush();
+            txn.commit();
+        }
+
+        LI << "[" << subdomain << "] Dropped negentropy tree " << treeId;
+    }
+};
+
+
+void RelayServer::runNegentropyTrees() {
+    setThreadName("negTrees");
+
+    uint64_t startTime = hoytech::curr_time_s();
+    bool firstRun = true;
+
+    while (1) {
+        std::this_thread::sleep_for(std::chrono::seconds(cfg().relay__negentropy__autoTrees__intervalSeconds));
+
+        flat_hash_map<std::pair<std::string, std::string>, NegentropyUsage::FilterUsage> usage;
+        flat_hash_map<std::pair<std::string, uint64_t>, uint64_t> treeLastUsed;
+
+        {
+            std::lock_guard<std::mutex> guard(negentropyUsage.mutex);
+            std::swap(usage, negentropyUsage.filters);
+            treeLastUsed = negentropyUsage.treeLastUsed;
+        }
+
+        std::vector<std::string> subdomains;
+
+        {
+            std::lock_guard<std::mutex> guard(tenantEnvsMutex);
+            for (auto &[subdomain, e] : tenantEnvs) subdomains.push_back(subdomain);
+        }
+
+        uint64_t now = hoytech::curr_time_s();
+
+        for (const auto &subdomain : subdomains) {
+            try {
+                NegentropyTreeManager mgr(*this, subdomain);
+
+                struct TreeInfo {
+                    uint64_t treeId;
+                    std::string filterStr;
+                    bool autoManaged;
+                    uint64_t state;
+                };
+
+                std::vector<TreeInfo> trees;
+
+                {
+                    auto txn = mgr.tenantEnv.txn_ro();
+                    mgr.tenantEnv.foreach_NegentropyFilter(txn, [&](auto &f){
+                        trees.push_back({ f.primaryKeyId, std::string(f.filter()), !!f.autoManaged(), f.state() });
+                        return true;
+                    });
+                }
+
+                uint64_t numAuto = 0;
+
+                for (const auto &t : trees) {
+                    if (!t.autoManaged) continue;
+
+                    if (t.state != 0) {
+                        // Left over from a restart: Nothing else is working on it, so throw it away
+                        if (firstRun) mgr.drop(t.treeId);
+                        continue;
+                    }
+
+                    auto it = treeLastUsed.find(std::make_pair(subdomain, t.treeId));
+                    uint64_t lastUsed = it == treeLastUsed.end() ? startTime : it->second;
+
+                    if (lastUsed + cfg().relay__negentropy__autoTrees__dropAfterSeconds < now) {
+                        LI << "[" << subdomain << "] Negentropy tree " << t.treeId << " unused since " << lastUsed;
+                        mgr.drop(t.treeId);
+
+                        std::lock_guard<std::mutex> guard(negentropyUsage.mutex);
+                        negentropyUsage.treeLastUsed.erase(std::make_pair(subdomain, t.treeId));
+                        continue;
+                    }
+
+                    numAuto++;
+                }
+
+                // Promote the most expensive of the frequently synced filters
+
+                std::vector<std::pair<uint64_t, std::string>> candidates; // (costUs, filterStr)
+
+                for (const auto &[key, u] : usage) {
+                    if (key.first != subdomain || u.syncs < cfg().relay__negentropy__autoTrees__minSyncs) continue;
+
+                    bool exists = std::any_of(trees.begin(), trees.end(), [&](const auto &t){ return t.filterStr == key.second; });
+                    if (!exists) candidates.emplace_back(u.costUs, key.second);
+                }
+
+                std::sort(candidates.rbegin(), candidates.rend());
+
+                for (const auto &[costUs, filterStr] : candidates) {
+                    if (numAuto >= cfg().relay__negentropy__autoTrees__maxPerTenant) break;
+
+                    if (auto treeId = mgr.build(filterStr)) {
+                        negentropyUsage.recordTree(subdomain, treeId);
+                        numAuto++;
+                    }
+                }
+            } catch (std::exception &e) {
+                LE << "[" << subdomain << "] Error maintaining negentropy trees: " << e.what();
+            }
+        }
+
+        firstRun = false;
+    }
+}
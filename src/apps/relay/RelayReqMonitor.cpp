@@ -1,6 +1,7 @@
 #include "RelayServer.h"
 
 #include "ActiveMonitors.h"
+#include "ReadTxnManager.h"
 
 
 
@@ -11,8 +12,41 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
     std::unordered_map<std::string, std::unique_ptr<hoytech::file_change_monitor>> dbChangeWatchers;
     
     Decompressor decomp;
+    ReadTxnManager txns(cfg().relay__maxReadTxnAgeMilliseconds * 1000);
+
+    // Live events for connections that are over their back-pressure soft limit are held
+    // back as levIds, and sent once the connection has drained. If too many pile up, the
+    // connection is closed: sending later events directly would deliver them out of order
+
+    struct DeferredDeliveries {
+        std::string subdomain;
+        std::vector<std::pair<SubId, uint64_t>> items; // subId, levId
+    };
+
+    flat_hash_set<uint64_t> pausedConns;
+    flat_hash_set<uint64_t> droppedConns; // being closed, nothing more is sent to them
+    flat_hash_map<uint64_t, DeferredDeliveries> deferred; // connId -> DeferredDeliveries
+
+    auto flushDeferred = [&](uint64_t connId){
+        auto it = deferred.find(connId);
+        if (it == deferred.end()) return;
+
+        auto& tenantEnv = getTenantEnv(it->second.subdomain);
+        auto &txn = txns.get(tenantEnv);
+
+        for (auto &[subId, levId] : it->second.items) {
+            try {
+                sendEvent(connId, subId, getEventJsonCached(txn, decomp, levId).json);
+            } catch (std::exception &) {
+                // event was deleted while delivery was deferred
+            }
+        }
+
+        deferred.erase(it);
+    };
 
     while (1) {
+        txns.resetAll();
         auto newMsgs = thr.inbox.pop_all();
 
         for (auto &newMsg : newMsgs) {
@@ -39,14 +73,14 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
                 }
                 
                 auto& tenantEnv = getTenantEnv(subdomain);
-                auto txn = tenantEnv.txn_ro();
+                auto &txn = txns.get(tenantEnv, true); // must be at least as recent as the snapshot the REQ scan used
                 
                 uint64_t latestEventId = getMostRecentLevId(txn);
                 if (currEventIds[subdomain] > latestEventId) currEventIds[subdomain] = latestEventId;
 
                 tenantEnv.foreach_Event(txn, [&](auto &ev){
                     if (msg->sub.filterGroup.doesMatch(PackedEventView(ev.buf))) {
-                        sendEvent(connId, msg->sub.subId, getEventJson(txn, decomp, ev.primaryKeyId));
+                        sendEvent(connId, msg->sub.subId, getEventJsonCached(txn, decomp, ev.primaryKeyId).json);
                     }
 
                     return true;
@@ -62,24 +96,62 @@ void RelayServer::runReqMonitor(ThreadPool<MsgReqMonitor>::Thread &thr) {
                 for (auto& [subdomain, monitors] : monitorsBySubdomain) {
                     monitors->removeSub(msg->connId, msg->subId);
                 }
+
+                auto it = deferred.find(msg->connId);
+                if (it != deferred.end()) {
+                    std::erase_if(it->second.items, [&](const auto &item){ return item.first == msg->subId; });
+                }
             } else if (auto msg = std::get_if<MsgReqMonitor::CloseConn>(&newMsg.msg)) {
                 // Close connection in all subdomains
                 for (auto& [subdomain, monitors] : monitorsBySubdomain) {
                     monitors->closeConn(msg->connId);
                 }
+
+                pausedConns.erase(msg->connId);
+                droppedConns.erase(msg->connId);
+                deferred.erase(msg->connId);
+            } else if (auto msg = std::get_if<MsgReqMonitor::PauseConn>(&newMsg.msg)) {
+                pausedConns.insert(msg->connId);
+            } else if (auto msg = std::get_if<MsgReqMonitor::ResumeConn>(&newMsg.msg)) {
+                pausedConns.erase(msg->connId);
+                if (!droppedConns.contains(msg->connId)) flushDeferred(msg->connId);
             } else if (auto msg = std::get_if<MsgReqMonitor::DBChange>(&newMsg.msg)) {
                 auto& subdomain = msg->subdomain;
                 auto it = monitorsBySubdomain.find(subdomain);
                 if (it != monitorsBySubdomain.end()) {
                     auto& monitors = it->second;
                     auto& tenantEnv = getTenantEnv(subdomain);
-                    auto txn = tenantEnv.txn_ro();
+                    auto &txn = txns.get(tenantEnv, true); // must see the write that triggered this
                     
                     uint64_t latestEventId = getMostRecentLevId(txn);
                     
                     tenantEnv.foreach_Event(txn, [&](auto &ev){
                         monitors->process(txn, ev, [&](RecipientList &&recipients, uint64_t levId){
-                            sendEventToBatch(std::move(recipients), std::string(getEventJson(txn, decomp, levId)));
+                            if (pausedConns.size() || droppedConns.size()) {
+                                std::erase_if(recipients, [&](const auto &r){
+                                    if (droppedConns.contains(r.connId)) return true;
+                                    if (!pausedConns.contains(r.connId)) return false;
+
+                                    auto &d = deferred[r.connId];
+
+                                    if (d.items.size() >= cfg().relay__backpressure__maxDeferredEvents) {
+                                        deferred.erase(r.connId);
+                                        droppedConns.insert(r.connId);
+                                        closeSlowConn(r.connId, "too many deferred events");
+                                        return true;
+                                    }
+
+                                    d.subdomain = subdomain;
+                                    d.items.emplace_back(r.subId, levId);
+                                    return true;
+                                });
+
+                                if (recipients.empty()) return;
+                            }
+
+                            metrics::observe(subdomain, metrics::Histogram::MonitorFanout, recipients.size());
+
+                            sendEventToBatch(std::move(recipients), getEventJsonCached(txn, decomp, levId).share());
                         });
                         return true;
                     }, false, currEventIds[subdomain] + 1);
@@ -1,22 +1,40 @@
 #include "RelayServer.h"
 #include "QueryScheduler.h"
+#include "ReadTxnManager.h"
 
 
 void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
     Decompressor decomp;
     QueryScheduler queries;
+    ReadTxnManager txns(cfg().relay__maxReadTxnAgeMilliseconds * 1000);
 
     queries.onEvent = [&](lmdb::txn &txn, const auto &sub, uint64_t levId, std::string_view eventPayload){
-        sendEvent(sub.connId, sub.subId, decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr));
+        sendEvent(sub.connId, sub.subId, getEventJsonCached(txn, decomp, levId, eventPayload).json);
     };
 
+    if (reqWorkerStealGroup) {
+        queries.joinStealGroup(reqWorkerStealGroup.get(), thr.id);
+        queries.onStolenComplete = [&](DBQuery *q){
+            tpReqWorker.dispatch(q->sub.connId, MsgReqWorker{MsgReqWorker::QueryComplete{q}});
+        };
+    }
+
     queries.onComplete = [&](lmdb::txn &, Subscription &sub){
+        metrics::observe(sub.subdomain, metrics::Histogram::ReqTimeToEoseUs, hoytech::curr_time_us() - sub.receivedAt);
         sendToConn(sub.connId, tao::json::to_string(tao::json::value::array({ "EOSE", sub.subId.str() })));
         tpReqMonitor.dispatch(sub.connId, MsgReqMonitor{MsgReqMonitor::NewSub{std::move(sub), sub.subdomain}});
     };
 
     while(1) {
-        auto newMsgs = queries.running.empty() ? thr.inbox.pop_all() : thr.inbox.pop_all_no_wait();
+        std::deque<MsgReqWorker> newMsgs;
+
+        if (queries.hasRunning()) {
+            newMsgs = thr.inbox.pop_all_no_wait();
+        } else {
+            txns.resetAll();
+            if (queries.stealGroup && queries.stealGroup->hasStealable()) newMsgs = thr.inbox.pop_all_wait_for(std::chrono::milliseconds(1)); // wake up to look for work to steal
+            else newMsgs = thr.inbox.pop_all(); // returns early if the steal group gets work to spare
+        }
 
         for (auto &newMsg : newMsgs) {
             if (auto msg = std::get_if<MsgReqWorker::NewSub>(&newMsg.msg)) {
@@ -24,7 +42,7 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
                 
                 // Get tenant database for this subscription
                 auto& tenantEnv = getTenantEnv(msg->subdomain);
-                auto txn = tenantEnv.txn_ro();
+                auto &txn = txns.get(tenantEnv);
 
                 if (!queries.addSub(txn, std::move(msg->sub))) {
                     sendNoticeError(connId, std::string("too many concurrent REQs"));
@@ -37,7 +55,27 @@ void RelayServer::runReqWorker(ThreadPool<MsgReqWorker>::Thread &thr) {
             } else if (auto msg = std::get_if<MsgReqWorker::CloseConn>(&newMsg.msg)) {
                 queries.closeConn(msg->connId);
                 tpReqMonitor.dispatch(msg->connId, MsgReqMonitor{MsgReqMonitor::CloseConn{msg->connId}});
+            } else if (auto msg = std::get_if<MsgReqWorker::PauseConn>(&newMsg.msg)) {
+                queries.pauseConn(msg->connId);
+            } else if (auto msg = std::get_if<MsgReqWorker::ResumeConn>(&newMsg.msg)) {
+                queries.resumeConn(msg->connId);
+            } else if (auto msg = std::get_if<MsgReqWorker::QueryComplete>(&newMsg.msg)) {
+                auto& tenantEnv = getTenantEnv(msg->query->sub.subdomain);
+                auto &txn = txns.get(tenantEnv);
+                queries.handleStolenComplete(txn, msg->query);
             }
         }
+
+        // Continue scans that were paused after exhausting their timeslice, or help out another thread
+
+        if (auto subdomain = queries.nextSubdomain()) {
+            auto& tenantEnv = getTenantEnv(*subdomain);
+            auto &txn = txns.get(tenantEnv);
+            queries.process(txn);
+        } else if (auto *q = queries.steal()) {
+            auto& tenantEnv = getTenantEnv(q->sub.subdomain);
+            auto &txn = txns.get(tenantEnv);
+            queries.processStolen(txn, q);
+        }
     }
 }
@@ -21,9 +21,13 @@
 #include "filters.h"
 #include "jsonParseUtils.h"
 #include "Decompressor.h"
+#include "Metrics.h"
 
 
 
+struct DBQuery;
+struct QueryStealGroup;
+
 
 struct MsgWebsocket : NonCopyable {
     struct Send {
@@ -38,13 +42,18 @@ struct MsgWebsocket : NonCopyable {
 
     struct SendEventToBatch {
         RecipientList list;
-        std::string evJson;
+        EventJsonCache::Buf evJson; // shared with eventJsonCache, so not copied per batch
+    };
+
+    struct CloseSlowConn {
+        uint64_t connId;
+        std::string reason;
     };
 
     struct GracefulShutdown {
     };
 
-    using Var = std::variant<Send, SendBinary, SendEventToBatch, GracefulShutdown>;
+    using Var = std::variant<Send, SendBinary, SendEventToBatch, CloseSlowConn, GracefulShutdown>;
     Var msg;
     MsgWebsocket(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -55,6 +64,7 @@ struct MsgIngester : NonCopyable {
         std::string ipAddr;
         std::string subdomain;  // Add subdomain for multi-tenant support
         std::string payload;
+        uint64_t receivedAt; // microseconds
     };
 
     struct CloseConn {
@@ -73,6 +83,7 @@ struct MsgWriter : NonCopyable {
         std::string subdomain;  // Add subdomain for multi-tenant support
         std::string packedStr;
         std::string jsonStr;
+        uint64_t receivedAt; // microseconds
     };
 
     struct CloseConn {
@@ -99,7 +110,19 @@ struct MsgReqWorker : NonCopyable {
         uint64_t connId;
     };
 
-    using Var = std::variant<NewSub, RemoveSub, CloseConn>;
+    struct PauseConn {
+        uint64_t connId;
+    };
+
+    struct ResumeConn {
+        uint64_t connId;
+    };
+
+    struct QueryComplete {
+        DBQuery *query; // stolen by another thread and completed there
+    };
+
+    using Var = std::variant<NewSub, RemoveSub, CloseConn, PauseConn, ResumeConn, QueryComplete>;
     Var msg;
     MsgReqWorker(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -123,7 +146,15 @@ struct MsgReqMonitor : NonCopyable {
         std::string subdomain;  // Add subdomain for multi-tenant support
     };
 
-    using Var = std::variant<NewSub, RemoveSub, CloseConn, DBChange>;
+    struct PauseConn {
+        uint64_t connId;
+    };
+
+    struct ResumeConn {
+        uint64_t connId;
+    };
+
+    using Var = std::variant<NewSub, RemoveSub, CloseConn, DBChange, PauseConn, ResumeConn>;
     Var msg;
     MsgReqMonitor(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -133,7 +164,9 @@ struct MsgNegentropy : NonCopyable {
         Subscription sub;
         std::string subdomain;  // Add subdomain for multi-tenant support
         std::string filterStr;
+        std::string fullFilterStr; // including since/until
         std::string negPayload;
+        bool treeCandidate; // single filter without a limit, so usage counts towards an auto tree
     };
 
     struct NegMsg {
@@ -151,7 +184,11 @@ struct MsgNegentropy : NonCopyable {
         uint64_t connId;
     };
 
-    using Var = std::variant<NegOpen, NegMsg, NegClose, CloseConn>;
+    struct QueryComplete {
+        DBQuery *query; // stolen by another thread and completed there
+    };
+
+    using Var = std::variant<NegOpen, NegMsg, NegClose, CloseConn, QueryComplete>;
     Var msg;
     MsgNegentropy(Var &&msg_) : msg(std::move(msg_)) {}
 };
@@ -188,18 +225,57 @@ struct RelayServer {
     ThreadPool<MsgReqMonitor> tpReqMonitor;
     ThreadPool<MsgNegentropy> tpNegentropy;
     std::thread cronThread;
+    std::thread compactionThread;
+    std::thread negentropyTreesThread;
     std::thread signalHandlerThread;
 
+    // Set if work stealing is enabled for the pool
+    std::unique_ptr<QueryStealGroup> reqWorkerStealGroup;
+    std::unique_ptr<QueryStealGroup> negentropyStealGroup;
+
+    // Slow-consumer back-pressure (updated by websocket thread, readable by any thread)
+
+    struct BackpressureStats {
+        std::atomic<uint64_t> throttledConns = 0; // currently above the soft limit
+        std::atomic<uint64_t> totalThrottled = 0; // number of times any connection crossed the soft limit
+        std::atomic<uint64_t> totalDropped = 0; // connections closed for crossing the hard limit
+    } backpressureStats;
+
+    // NEG-OPEN usage, recorded by negentropy threads and used to pick filters to maintain trees for
+
+    struct NegentropyUsage {
+        struct FilterUsage {
+            uint64_t syncs = 0;
+            uint64_t costUs = 0;
+        };
+
+        std::mutex mutex;
+        flat_hash_map<std::pair<std::string, std::string>, FilterUsage> filters; // (subdomain, filterStr) -> usage since last collected
+        flat_hash_map<std::pair<std::string, uint64_t>, uint64_t> treeLastUsed; // (subdomain, treeId) -> unix time
+
+        void recordQuery(const std::string &subdomain, const std::string &filterStr, uint64_t costUs) {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto &u = filters[std::make_pair(subdomain, filterStr)];
+            u.syncs++;
+            u.costUs += costUs;
+        }
+
+        void recordTree(const std::string &subdomain, uint64_t treeId) {
+            std::lock_guard<std::mutex> guard(mutex);
+            treeLastUsed[std::make_pair(subdomain, treeId)] = hoytech::curr_time_s();
+        }
+    } negentropyUsage;
+
     void run();
 
     void runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr);
 
     void runIngester(ThreadPool<MsgIngester>::Thread &thr);
-    void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, flat_hash_map<uint64_t, AuthStatus*> &connIdToAuthStatus, std::string ipAddr, std::string subdomain, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output);
-    void ingesterProcessReq(lmdb::txn &txn, uint64_t connId, std::string subdomain, const tao::json::value &origJson);
-    void ingesterProcessClose(lmdb::txn &txn, uint64_t connId, const tao::json::value &origJson);
+    void ingesterProcessEvent(lmdb::txn &txn, uint64_t connId, flat_hash_map<uint64_t, AuthStatus*> &connIdToAuthStatus, std::string ipAddr, std::string subdomain, uint64_t receivedAt, secp256k1_context *secpCtx, const tao::json::value &origJson, std::vector<MsgWriter> &output);
+    void ingesterProcessReq(uint64_t connId, std::string subdomain, uint64_t receivedAt, const tao::json::value &origJson);
+    void ingesterProcessClose(uint64_t connId, const tao::json::value &origJson);
     void ingesterProcessAuth(uint64_t connId, flat_hash_map<uint64_t, AuthStatus*> connIdToAuthStatus, secp256k1_context *secpCtx, const tao::json::value &eventJson);
-    void ingesterProcessNegentropy(lmdb::txn &txn, Decompressor &decomp, uint64_t connId, std::string subdomain, const tao::json::value &origJson);
+    void ingesterProcessNegentropy(uint64_t connId, std::string subdomain, const tao::json::value &origJson);
 
     void runWriter(ThreadPool<MsgWriter>::Thread &thr);
 
@@ -211,8 +287,14 @@ struct RelayServer {
 
     void runCron();
 
+    void runCompaction();
+
+    void runNegentropyTrees();
+
     void runSignalHandler();
 
+    std::string renderMetrics();
+
     // Utils (can be called by any thread)
 
     void sendToConn(uint64_t connId, std::string &&payload) {
@@ -240,11 +322,17 @@ struct RelayServer {
         sendToConn(connId, std::move(reply));
     }
 
-    void sendEventToBatch(RecipientList &&list, std::string &&evJson) {
+    void sendEventToBatch(RecipientList &&list, EventJsonCache::Buf evJson) {
         tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::SendEventToBatch{std::move(list), std::move(evJson)}});
         hubTrigger->send();
     }
 
+    // Sends a NOTICE and closes the connection
+    void closeSlowConn(uint64_t connId, std::string &&reason) {
+        tpWebsocket.dispatch(0, MsgWebsocket{MsgWebsocket::CloseSlowConn{connId, std::move(reason)}});
+        hubTrigger->send();
+    }
+
     void sendNoticeError(uint64_t connId, std::string &&payload) {
         LI << "sending error to [" << connId << "]: " << payload;
         auto reply = tao::json::value::array({ "NOTICE", std::string("ERROR: ") + payload });
@@ -32,6 +32,10 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
             uint64_t bytesDown = 0;
             uint64_t bytesDownCompressed = 0;
         } stats;
+        uint64_t bufferedBytes = 0; // queued in uWS but not yet written to the socket
+        bool throttled = false;
+        bool closing = false;
+        std::function<void(Connection&)> *updateBackpressure = nullptr;
 
         Connection(uWS::WebSocket<uWS::SERVER> *p, uint64_t connId_)
             : websocket(p), connId(connId_), connectedTimestamp(hoytech::curr_time_us()) { }
@@ -49,6 +53,28 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
     tempBuf.reserve(cfg().events__maxEventSize + MAX_SUBID_SIZE + 100);
 
 
+    // Crossing the soft limit pauses REQ scans and live deliveries for the connection.
+    // They are resumed once it drains to half of the soft limit (hysteresis).
+
+    std::function<void(Connection&)> updateBackpressure = [&](Connection &c){
+        uint64_t softLimit = cfg().relay__backpressure__softLimitBytes;
+        if (softLimit == 0) return;
+
+        if (!c.throttled && c.bufferedBytes > softLimit) {
+            c.throttled = true;
+            backpressureStats.throttledConns++;
+            backpressureStats.totalThrottled++;
+            tpReqWorker.dispatch(c.connId, MsgReqWorker{MsgReqWorker::PauseConn{c.connId}});
+            tpReqMonitor.dispatch(c.connId, MsgReqMonitor{MsgReqMonitor::PauseConn{c.connId}});
+        } else if (c.throttled && c.bufferedBytes <= softLimit / 2) {
+            c.throttled = false;
+            backpressureStats.throttledConns--;
+            tpReqWorker.dispatch(c.connId, MsgReqWorker{MsgReqWorker::ResumeConn{c.connId}});
+            tpReqMonitor.dispatch(c.connId, MsgReqMonitor{MsgReqMonitor::ResumeConn{c.connId}});
+        }
+    };
+
+
     auto supportedNips = []{
         tao::json::value output = tao::json::value::array({ 1, 2, 4, 9, 11, 22, 28, 40, 70, 77 });
         if (cfg().relay__info__nips.size() == 0) return output;
@@ -176,7 +202,10 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
         std::string host = req.getHeader("host").toString();
         std::string url = req.getUrl().toString();
 
-        if (url == "/.well-known/nodeinfo") {
+        if (url == "/metrics" && cfg().relay__metrics__enabled) {
+            auto rendered = preGenerateHttpResponse("text/plain; version=0.0.4", renderMetrics());
+            res->write(rendered.data(), rendered.size());
+        } else if (url == "/.well-known/nodeinfo") {
             auto nodeInfo = getNodeInfoHttpResponse(host);
             res->write(nodeInfo.data(), nodeInfo.size());
         } else if (url == "/nodeinfo/2.1") {
@@ -195,6 +224,7 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
         uint64_t connId = nextConnectionId++;
 
         Connection *c = new Connection(ws, connId);
+        c->updateBackpressure = &updateBackpressure;
 
         // Extract subdomain from host header and path for multi-tenant support
         std::string host = req.getHeader("host").toString();
@@ -248,7 +278,10 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
 
         tpIngester.dispatch(connId, MsgIngester{MsgIngester::CloseConn{connId}});
 
+        if (c->throttled) backpressureStats.throttledConns--;
+
         connIdToConnection.erase(connId);
+        ws->setUserData(nullptr); // pending send callbacks must not touch the deleted connection
         delete c;
 
         if (gracefulShutdown) {
@@ -265,24 +298,56 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
 
         c.stats.bytesDown += length;
         c.stats.bytesDownCompressed += compressedSize;
+        metrics::inc(c.subdomain, metrics::Counter::BytesDown, length);
+        metrics::inc(c.subdomain, metrics::Counter::BytesDownCompressed, compressedSize);
 
-        tpIngester.dispatch(c.connId, MsgIngester{MsgIngester::ClientMessage{c.connId, c.ipAddr, c.subdomain, std::string(message, length)}});
+        tpIngester.dispatch(c.connId, MsgIngester{MsgIngester::ClientMessage{c.connId, c.ipAddr, c.subdomain, std::string(message, length), hoytech::curr_time_us()}});
     });
 
 
     std::function<void()> asyncCb = [&]{
         auto newMsgs = thr.inbox.pop_all_no_wait();
 
+        auto closeSlowConsumer = [&](Connection &c, std::string_view reason){
+            std::string notice = tao::json::to_string(tao::json::value::array({ "NOTICE", std::string("ERROR: slow consumer, ") + std::string(reason) }));
+            c.websocket->send(notice.data(), notice.size(), uWS::OpCode::TEXT, nullptr, nullptr, true);
+            c.websocket->close(1008, "slow consumer", 13);
+            c.closing = true;
+            backpressureStats.totalDropped++;
+        };
+
         auto doSend = [&](uint64_t connId, std::string_view payload, uWS::OpCode opCode){
             auto it = connIdToConnection.find(connId);
             if (it == connIdToConnection.end()) return;
             auto &c = *it->second;
+            if (c.closing) return;
 
             size_t compressedSize;
-            auto cb = [](uWS::WebSocket<uWS::SERVER> *webSocket, void *data, bool cancelled, void *reserved){};
-            c.websocket->send(payload.data(), payload.size(), opCode, cb, nullptr, true, &compressedSize);
+            auto cb = [](uWS::WebSocket<uWS::SERVER> *webSocket, void *data, bool cancelled, void *reserved){
+                if (cancelled) return;
+                auto *c = (Connection*)webSocket->getUserData();
+                if (!c) return;
+
+                uint64_t size = (uint64_t)(uintptr_t)data;
+                c->bufferedBytes -= std::min(size, c->bufferedBytes);
+                (*c->updateBackpressure)(*c);
+            };
+
+            // Incremented before sending since the callback is invoked immediately if the socket is writable
+            c.bufferedBytes += payload.size();
+            c.websocket->send(payload.data(), payload.size(), opCode, cb, (void*)(uintptr_t)payload.size(), true, &compressedSize);
             c.stats.bytesUp += payload.size();
             c.stats.bytesUpCompressed += compressedSize;
+            metrics::inc(c.subdomain, metrics::Counter::BytesUp, payload.size());
+            metrics::inc(c.subdomain, metrics::Counter::BytesUpCompressed, compressedSize);
+
+            updateBackpressure(c);
+
+            uint64_t hardLimit = cfg().relay__backpressure__hardLimitBytes;
+            if (hardLimit && c.bufferedBytes > hardLimit) {
+                LW << "[" << connId << "] Closing slow consumer: " << renderSize(c.bufferedBytes) << " buffered";
+                closeSlowConsumer(c, "send buffer limit exceeded");
+            }
         };
 
         for (auto &newMsg : newMsgs) {
@@ -291,10 +356,12 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
             } else if (auto msg = std::get_if<MsgWebsocket::SendBinary>(&newMsg.msg)) {
                 doSend(msg->connId, msg->payload, uWS::OpCode::BINARY);
             } else if (auto msg = std::get_if<MsgWebsocket::SendEventToBatch>(&newMsg.msg)) {
-                tempBuf.reserve(13 + MAX_SUBID_SIZE + msg->evJson.size());
+                const auto &evJson = *msg->evJson;
+
+                tempBuf.reserve(13 + MAX_SUBID_SIZE + evJson.size());
                 tempBuf.resize(10 + MAX_SUBID_SIZE);
                 tempBuf += "\",";
-                tempBuf += msg->evJson;
+                tempBuf += evJson;
                 tempBuf += "]";
 
                 for (auto &item : msg->list) {
@@ -302,8 +369,14 @@ void RelayServer::runWebsocket(ThreadPool<MsgWebsocket>::Thread &thr) {
                     auto *p = tempBuf.data() + MAX_SUBID_SIZE - subIdSv.size();
                     memcpy(p, "[\"EVENT\",\"", 10);
                     memcpy(p + 10, subIdSv.data(), subIdSv.size());
-                    doSend(item.connId, std::string_view(p, 13 + subIdSv.size() + msg->evJson.size()), uWS::OpCode::TEXT);
+                    doSend(item.connId, std::string_view(p, 13 + subIdSv.size() + evJson.size()), uWS::OpCode::TEXT);
                 }
+            } else if (auto msg = std::get_if<MsgWebsocket::CloseSlowConn>(&newMsg.msg)) {
+                auto it = connIdToConnection.find(msg->connId);
+                if (it == connIdToConnection.end() || it->second->closing) continue;
+
+                LW << "[" << msg->connId << "] Closing slow consumer: " << msg->reason;
+                closeSlowConsumer(*it->second, msg->reason);
             } else if (std::get_if<MsgWebsocket::GracefulShutdown>(&newMsg.msg)) {
                 LW << "Initiating graceful shutdown: " << connIdToConnection.size() << " connections remaining";
                 gracefulShutdown = true;
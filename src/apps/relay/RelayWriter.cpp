@@ -1,6 +1,7 @@
 #include "RelayServer.h"
 
 #include "PluginEventSifter.h"
+#include "EventIdFilter.h"
 
 
 void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
@@ -47,7 +48,7 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
                     newEvents.emplace_back(msg->packedStr, msg->jsonStr, msg);
                 } else {
                     PackedEventView packed(msg->packedStr);
-                    auto eventIdHex = to_hex(packed.id());
+                    auto eventIdHex = hexEncode(packed.id());
 
                     if (okMsg.size()) LI << "[" << msg->connId << "] write policy blocked event " << eventIdHex << ": " << okMsg;
 
@@ -68,16 +69,38 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
         
         for (auto &[subdomain, events] : eventsBySubdomain) {
             try {
+                uint64_t startTime = hoytech::curr_time_us();
+
                 auto& tenantEnv = getTenantEnv(subdomain);
+                MDB_env *e = tenantEnv.lmdb_env.handle();
+                uint64_t deleteGeneration = deleteGenerations.get(e);
+
                 auto txn = tenantEnv.txn_rw();
                 writeEvents(txn, neFilterCache, events);
                 txn.commit();
+
+                if (deleteGenerations.get(e) != deleteGeneration) deleteGenerations.bump(e); // replaced or deleted events
+
+                if (cfg().relay__dupFilter__enabled) {
+                    for (auto &newEvent : events) {
+                        if (newEvent.status == EventWriteStatus::Written) eventIdFilter.add(tenantEnv, PackedEventView(newEvent.packedStr).id());
+                    }
+                }
+
+                uint64_t now = hoytech::curr_time_us();
+                metrics::observe(subdomain, metrics::Histogram::CommitDurationUs, now - startTime);
+                metrics::observe(subdomain, metrics::Histogram::WriterBatchSize, events.size());
+
+                for (auto &newEvent : events) {
+                    MsgWriter::AddEvent *addEventMsg = static_cast<MsgWriter::AddEvent*>(newEvent.userData);
+                    metrics::observe(subdomain, metrics::Histogram::IngestToCommitUs, now - addEventMsg->receivedAt);
+                }
             } catch (std::exception &e) {
                 LE << "Error writing " << events.size() << " events for subdomain " << subdomain << ": " << e.what();
 
                 for (auto &newEvent : events) {
                     PackedEventView packed(newEvent.packedStr);
-                    auto eventIdHex = to_hex(packed.id());
+                    auto eventIdHex = hexEncode(packed.id());
                     MsgWriter::AddEvent *addEventMsg = static_cast<MsgWriter::AddEvent*>(newEvent.userData);
 
                     std::string message = "Write error: ";
@@ -94,16 +117,18 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
         for (auto &[subdomain, events] : eventsBySubdomain) { // Iterate over the events that were actually processed
             for (auto &newEvent : events) { // Iterate over the events that were actually processed
                 PackedEventView packed(newEvent.packedStr);
-                auto eventIdHex = to_hex(packed.id());
+                auto eventIdHex = hexEncode(packed.id());
                 std::string message;
                 bool written = false;
 
                 if (newEvent.status == EventWriteStatus::Written) {
                     LI << "Inserted event. id=" << eventIdHex << " levId=" << newEvent.levId;
                     written = true;
+                    metrics::inc(subdomain, metrics::Counter::EventsWritten);
                 } else if (newEvent.status == EventWriteStatus::Duplicate) {
                     message = "duplicate: have this event";
                     written = true;
+                    metrics::inc(subdomain, metrics::Counter::EventsDuplicate);
                 } else if (newEvent.status == EventWriteStatus::Replaced) {
                     message = "replaced: have newer event";
                 } else if (newEvent.status == EventWriteStatus::Deleted) {
@@ -112,6 +137,7 @@ void RelayServer::runWriter(ThreadPool<MsgWriter>::Thread &thr) {
 
                 if (newEvent.status != EventWriteStatus::Written) {
                     LI << "Rejected event. " << message << ", id=" << eventIdHex;
+                    if (newEvent.status != EventWriteStatus::Duplicate) metrics::inc(subdomain, metrics::Counter::EventsRejected);
                 }
 
                 MsgWriter::AddEvent *addEventMsg = static_cast<MsgWriter::AddEvent*>(newEvent.userData);
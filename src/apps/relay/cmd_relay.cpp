@@ -2,8 +2,12 @@
 #include <signal.h>
 
 #include "RelayServer.h"
+#include "QueryScheduler.h"
+#include "EventIdFilter.h"
 
 
+EventIdFilter eventIdFilter;
+
 
 static void checkConfig() {
     if (cfg().relay__info__pubkey.size()) {
@@ -54,6 +58,16 @@ void RelayServer::run() {
         runWriter(thr);
     });
 
+    if (cfg().relay__workStealing__reqWorker) {
+        reqWorkerStealGroup = std::make_unique<QueryStealGroup>(cfg().relay__numThreads__reqWorker);
+        reqWorkerStealGroup->wakeIdle = [this]{ for (auto &t : tpReqWorker.pool) t.inbox.wake(); };
+    }
+
+    if (cfg().relay__workStealing__negentropy) {
+        negentropyStealGroup = std::make_unique<QueryStealGroup>(cfg().relay__numThreads__negentropy);
+        negentropyStealGroup->wakeIdle = [this]{ for (auto &t : tpNegentropy.pool) t.inbox.wake(); };
+    }
+
     tpReqWorker.init("ReqWorker", cfg().relay__numThreads__reqWorker, [this](auto &thr){
         runReqWorker(thr);
     });
@@ -70,6 +84,18 @@ void RelayServer::run() {
         runCron();
     });
 
+    if (cfg().relay__compaction__enabled || cfg().relay__coldTier__enabled) {
+        compactionThread = std::thread([this]{
+            runCompaction();
+        });
+    }
+
+    if (cfg().relay__negentropy__autoTrees__enabled) {
+        negentropyTreesThread = std::thread([this]{
+            runNegentropyTrees();
+        });
+    }
+
     signalHandlerThread = std::thread([this]{
         runSignalHandler();
     });
@@ -1,5 +1,5 @@
 #pragma once
 
-const uint64_t CURR_DB_VERSION = 3;
+const uint64_t CURR_DB_VERSION = 4;
 const size_t MAX_SUBID_SIZE = 71; // Statically allocated size in SubId
 const size_t MAX_INDEXED_TAG_VAL_SIZE = 255;
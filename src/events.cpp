@@ -1,8 +1,16 @@
+#include <charconv>
+
 #include <openssl/sha.h>
 #include <negentropy.h>
 
 #include "events.h"
 #include "jsonParseUtils.h"
+#include "KindClass.h"
+#include "ColdStorage.h"
+#include "SigVerifyCache.h"
+
+
+DeleteGenerations deleteGenerations;
 
 
 std::string nostrJsonToPackedEvent(const tao::json::value &v) {
@@ -10,8 +18,8 @@ std::string nostrJsonToPackedEvent(const tao::json::value &v) {
 
     // Extract values from JSON, add strings to builder
 
-    auto id = from_hex(jsonGetString(v.at("id"), "event id field was not a string"), false);
-    auto pubkey = from_hex(jsonGetString(v.at("pubkey"), "event pubkey field was not a string"), false);
+    auto id = hexDecode(jsonGetString(v.at("id"), "event id field was not a string"));
+    auto pubkey = hexDecode(jsonGetString(v.at("pubkey"), "event pubkey field was not a string"));
     uint64_t created_at = jsonGetUnsigned(v.at("created_at"), "event created_at field was not an integer");
     uint64_t kind = jsonGetUnsigned(v.at("kind"), "event kind field was not an integer");
 
@@ -37,7 +45,7 @@ std::string nostrJsonToPackedEvent(const tao::json::value &v) {
 
         if (tagName == "e" || tagName == "p") {
             if (tagVal.size() != 64) throw herr("unexpected size for fixed-size tag: ", tagName);
-            tagVal = from_hex(tagVal, false);
+            tagVal = hexDecode(tagVal);
 
             tagBuilder.add(tagName[0], tagVal);
         } else if (tagName == "expiration") {
@@ -108,8 +116,15 @@ void verifyNostrEvent(secp256k1_context *secpCtx, PackedEventView packed, const
     auto hash = nostrHash(origJson);
     if (hash != Bytes32(packed.id())) throw herr("bad event id");
 
-    bool valid = verifySig(secpCtx, from_hex(jsonGetString(origJson.at("sig"), "event sig was not a string"), false), packed.id(), packed.pubkey());
+    auto sig = hexDecode(jsonGetString(origJson.at("sig"), "event sig was not a string"));
+
+    bool cache = sigVerifyCache.enabled();
+    if (cache && sigVerifyCache.contains(packed.id(), sig)) return;
+
+    bool valid = verifySig(secpCtx, sig, packed.id(), packed.pubkey());
     if (!valid) throw herr("bad signature");
+
+    if (cache) sigVerifyCache.put(packed.id(), sig);
 }
 
 void verifyNostrEventJsonSize(std::string_view jsonStr) {
@@ -163,17 +178,69 @@ void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *se
 
 
 
+// Point lookups go through Event__idPrefix, which is keyed by only the first 8 bytes of the id.
+// Colliding prefixes are resolved by checking the full id in the packed event.
+
+static uint64_t idPrefix(std::string_view id) {
+    return lmdb::from_sv<uint64_t>(id.substr(0, 8));
+}
+
+static std::optional<defaultDb::environment::View_Event> probeIdPrefix(lmdb::txn &txn, lmdb::cursor &cursor, std::string_view id) {
+    uint64_t prefix = idPrefix(id);
+    std::string_view k = lmdb::to_sv<uint64_t>(prefix), v;
+
+    for (bool found = cursor.get(k, v, MDB_SET_KEY); found; found = cursor.get(k, v, MDB_NEXT_DUP)) {
+        auto view = env.lookup_Event(txn, lmdb::from_sv<uint64_t>(v));
+        if (view && PackedEventView(view->buf).id() == id) return view;
+    }
+
+    return std::nullopt;
+}
+
 std::optional<defaultDb::environment::View_Event> lookupEventById(lmdb::txn &txn, std::string_view id) {
-    std::optional<defaultDb::environment::View_Event> output;
+    if (id.size() != 32) return std::nullopt;
 
-    env.generic_foreachFull(txn, env.dbi_Event__id, makeKey_StringUint64(id, 0), lmdb::to_sv<uint64_t>(0), [&](auto k, auto v) {
-        if (k.starts_with(id)) output = env.lookup_Event(txn, lmdb::from_sv<uint64_t>(v));
-        return false;
-    });
+    auto cursor = lmdb::cursor::open(txn, env.dbi_Event__idPrefix);
+    return probeIdPrefix(txn, cursor, id);
+}
+
+std::vector<uint64_t> lookupEventsById(lmdb::txn &txn, const std::vector<std::string_view> &ids) {
+    std::vector<uint64_t> output(ids.size(), 0);
+
+    // Probe in key order so that consecutive lookups mostly land on pages the cursor already has
+
+    std::vector<std::pair<uint64_t, size_t>> order;
+    order.reserve(ids.size());
+
+    for (size_t i = 0; i < ids.size(); i++) {
+        if (ids[i].size() == 32) order.emplace_back(idPrefix(ids[i]), i);
+    }
+
+    std::sort(order.begin(), order.end());
+
+    auto cursor = lmdb::cursor::open(txn, env.dbi_Event__idPrefix);
+
+    for (auto &[prefix, i] : order) {
+        auto view = probeIdPrefix(txn, cursor, ids[i]);
+        if (view) output[i] = view->primaryKeyId;
+    }
 
     return output;
 }
 
+void backfillIdPrefixIndex(lmdb::txn &txn) {
+    uint64_t n = 0;
+
+    env.foreach_Event(txn, [&](auto &ev){
+        uint64_t prefix = idPrefix(PackedEventView(ev.buf).id());
+        env.dbi_Event__idPrefix.put(txn, lmdb::to_sv<uint64_t>(prefix), lmdb::to_sv<uint64_t>(ev.primaryKeyId));
+        n++;
+        return true;
+    });
+
+    LI << "Added " << n << " events to id prefix index";
+}
+
 defaultDb::environment::View_Event lookupEventByLevId(lmdb::txn &txn, uint64_t levId) {
     auto view = env.lookup_Event(txn, levId);
     if (!view) throw herr("unable to lookup event by levId");
@@ -199,6 +266,7 @@ std::string_view decodeEventPayload(lmdb::txn &txn, Decompressor &decomp, std::s
 
     if (raw[0] == '\x00') {
         if (outDictId) *outDictId = 0;
+        if (outCompressedSize) *outCompressedSize = raw.size() - 1;
         return raw.substr(1);
     } else if (raw[0] == '\x01') {
         raw = raw.substr(1);
@@ -212,6 +280,19 @@ std::string_view decodeEventPayload(lmdb::txn &txn, Decompressor &decomp, std::s
         if (outDictId) *outDictId = dictId;
         if (outCompressedSize) *outCompressedSize = raw.size();
         return buf;
+    } else if (raw[0] == '\x02') {
+        raw = raw.substr(1);
+
+        decomp.reserve(cfg().events__maxEventSize);
+        std::string_view buf = decomp.decompressNoDict(raw);
+
+        if (outDictId) *outDictId = 0;
+        if (outCompressedSize) *outCompressedSize = raw.size();
+        return buf;
+    } else if (raw[0] == '\x03') {
+        auto record = coldStorage.read(txn, raw, decomp.coldBuffer);
+        if (record.size() == 0 || record[0] == '\x03') throw herr("bad record in cold segment");
+        return decodeEventPayload(txn, decomp, record, outDictId, outCompressedSize);
     } else {
         throw herr("Unexpected first byte in EventPayload");
     }
@@ -232,7 +313,101 @@ std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t lev
     return decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr);
 }
 
+// Same as getEventJson(), except compressed events are looked up in/added to eventJsonCache.
+// If eventPayload is empty, it is looked up. Uncompressed events are returned directly from the DB.
 
+EventJsonRef getEventJsonCached(lmdb::txn &txn, Decompressor &decomp, uint64_t levId, std::string_view eventPayload) {
+    if (eventPayload.empty()) {
+        bool found = env.dbi_EventPayload.get(txn, lmdb::to_sv<uint64_t>(levId), eventPayload);
+        if (!found) throw herr("couldn't find event in EventPayload");
+    }
+
+    if (eventPayload[0] == '\x00' || !eventJsonCache.enabled()) {
+        return EventJsonRef{ decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr), nullptr };
+    }
+
+    auto *e = mdb_txn_env(txn.handle());
+
+    if (auto buf = eventJsonCache.get(e, levId)) return EventJsonRef{ *buf, buf };
+
+    auto buf = std::make_shared<const std::string>(decodeEventPayload(txn, decomp, eventPayload, nullptr, nullptr));
+    eventJsonCache.put(e, levId, buf);
+
+    return EventJsonRef{ *buf, buf };
+}
+
+
+
+
+// Writes the EventPayload record for json to out. Compressed with dictId if non-zero, otherwise
+// without a dictionary if at least noDictMinSize (when non-zero). Stored uncompressed if that is
+// no larger.
+
+void encodeEventPayload(lmdb::txn &txn, Compressor &comp, uint32_t dictId, int level, uint64_t noDictMinSize, std::string_view json, std::string &out) {
+    out.clear();
+
+    if (dictId || (noDictMinSize && json.size() >= noDictMinSize)) {
+        auto compressed = comp.compress(txn, dictId, level, json);
+
+        if (dictId && compressed.size() + 4 < json.size()) {
+            out += '\x01';
+            out += lmdb::to_sv<uint32_t>(dictId);
+            out += compressed;
+            return;
+        } else if (!dictId && compressed.size() < json.size()) {
+            out += '\x02';
+            out += compressed;
+            return;
+        }
+    }
+
+    out += '\x00';
+    out += json;
+}
+
+
+// Dictionary used for each kind when compressing at write time
+
+struct WriteDictionaries {
+    flat_hash_map<uint64_t, uint32_t> byKind; // from events.compression.kindDictionaries
+    uint32_t byClass[NumKindClasses] = {}; // maintained by relay compaction
+
+    WriteDictionaries(lmdb::txn &txn) {
+        auto exists = [&](uint64_t dictId){
+            return !!env.lookup_CompressionDictionary(txn, dictId);
+        };
+
+        // Malformed entries are ignored
+        std::string_view spec = cfg().events__compression__kindDictionaries;
+
+        while (spec.size()) {
+            auto item = spec.substr(0, spec.find(','));
+            spec = spec.substr(std::min(item.size() + 1, spec.size()));
+
+            while (item.size() && item.front() == ' ') item.remove_prefix(1);
+            while (item.size() && item.back() == ' ') item.remove_suffix(1);
+
+            uint64_t kind, dictId;
+            auto colon = item.find(':');
+            if (colon == std::string_view::npos) continue;
+            if (std::from_chars(item.data(), item.data() + colon, kind).ec != std::errc()) continue;
+            if (std::from_chars(item.data() + colon + 1, item.data() + item.size(), dictId).ec != std::errc()) continue;
+
+            if (exists(dictId)) byKind[kind] = dictId; // dictIds are per-DB, so may not exist in every tenant
+        }
+
+        env.foreach_KindDictionary(txn, [&](auto &view){
+            if (view.kindClass() < NumKindClasses && exists(view.dictId())) byClass[view.kindClass()] = view.dictId();
+            return true;
+        });
+    }
+
+    uint32_t get(uint64_t kind) {
+        auto it = byKind.find(kind);
+        if (it != byKind.end()) return it->second;
+        return byClass[(uint64_t)kindClassOf(kind)];
+    }
+};
 
 
 // Do not use externally: does not handle negentropy trees
@@ -240,6 +415,8 @@ std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t lev
 bool deleteEventBasic(lmdb::txn &txn, uint64_t levId) {
     bool deleted = env.dbi_EventPayload.del(txn, lmdb::to_sv<uint64_t>(levId));
     env.delete_Event(txn, levId);
+    eventJsonCache.erase(mdb_txn_env(txn.handle()), levId);
+    deleteGenerations.bump(mdb_txn_env(txn.handle()));
     return deleted;
 }
 
@@ -256,13 +433,29 @@ void writeEvents(lmdb::txn &txn, NegentropyFilterCache &neFilterCache, std::vect
     std::vector<uint64_t> levIdsToDelete;
     std::string tmpBuf;
 
+    static thread_local Compressor comp;
+    std::optional<WriteDictionaries> writeDicts;
+    if (cfg().events__compression__enabled) writeDicts.emplace(txn);
+
+    std::vector<uint64_t> existing;
+
+    {
+        std::vector<std::string_view> ids;
+        ids.reserve(evs.size());
+        for (auto &ev : evs) ids.push_back(PackedEventView(ev.packedStr).id());
+        existing = lookupEventsById(txn, ids);
+    }
+
     neFilterCache.ctx(txn, [&](const std::function<void(const PackedEventView &, bool)> &updateNegentropy){
         for (size_t i = 0; i < evs.size(); i++) {
             auto &ev = evs[i];
 
             PackedEventView packed(ev.packedStr);
 
-            if (lookupEventById(txn, packed.id()) || (i != 0 && ev.id() == evs[i-1].id())) {
+            // Events found up-front may have since been deleted by an earlier event in this batch
+            bool exists = existing[i] && env.lookup_Event(txn, existing[i]);
+
+            if (exists || (i != 0 && ev.id() == evs[i-1].id())) {
                 ev.status = EventWriteStatus::Duplicate;
                 continue;
             }
@@ -327,9 +520,14 @@ void writeEvents(lmdb::txn &txn, NegentropyFilterCache &neFilterCache, std::vect
             if (ev.status == EventWriteStatus::Pending) {
                 ev.levId = env.insert_Event(txn, ev.packedStr);
 
-                tmpBuf.clear();
-                tmpBuf += '\x00';
-                tmpBuf += ev.jsonStr;
+                if (writeDicts) {
+                    encodeEventPayload(txn, comp, writeDicts->get(packed.kind()), cfg().events__compression__level, cfg().events__compression__noDictMinSize, ev.jsonStr, tmpBuf);
+                } else {
+                    tmpBuf.clear();
+                    tmpBuf += '\x00';
+                    tmpBuf += ev.jsonStr;
+                }
+
                 env.dbi_EventPayload.put(txn, lmdb::to_sv<uint64_t>(ev.levId), tmpBuf);
 
                 updateNegentropy(PackedEventView(ev.packedStr), true);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <mutex>
+
 #include <secp256k1_schnorrsig.h>
 
 #include "golpe.h"
@@ -8,6 +10,7 @@
 #include "PackedEvent.h"
 #include "NegentropyFilterCache.h"
 #include "Decompressor.h"
+#include "EventJsonCache.h"
 
 
 
@@ -49,11 +52,26 @@ void parseAndVerifyEvent(const tao::json::value &origJson, secp256k1_context *se
 
 
 std::optional<defaultDb::environment::View_Event> lookupEventById(lmdb::txn &txn, std::string_view id);
+std::vector<uint64_t> lookupEventsById(lmdb::txn &txn, const std::vector<std::string_view> &ids); // levId for each id, or 0 if not found
+void backfillIdPrefixIndex(lmdb::txn &txn);
 defaultDb::environment::View_Event lookupEventByLevId(lmdb::txn &txn, uint64_t levId); // throws if can't find
 uint64_t getMostRecentLevId(lmdb::txn &txn);
 std::string_view decodeEventPayload(lmdb::txn &txn, Decompressor &decomp, std::string_view raw, uint32_t *outDictId, size_t *outCompressedSize);
 std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t levId);
 std::string_view getEventJson(lmdb::txn &txn, Decompressor &decomp, uint64_t levId, std::string_view eventPayload);
+void encodeEventPayload(lmdb::txn &txn, Compressor &comp, uint32_t dictId, int level, uint64_t noDictMinSize, std::string_view json, std::string &out);
+
+struct EventJsonRef {
+    std::string_view json;
+    EventJsonCache::Buf buf; // if set, json points into this and stays valid while it is held
+
+    EventJsonCache::Buf share() const {
+        if (buf) return buf;
+        return std::make_shared<const std::string>(json);
+    }
+};
+
+EventJsonRef getEventJsonCached(lmdb::txn &txn, Decompressor &decomp, uint64_t levId, std::string_view eventPayload = "");
 
 
 
@@ -114,6 +132,32 @@ struct EventToWrite {
 void writeEvents(lmdb::txn &txn, NegentropyFilterCache &neFilterCache, std::vector<EventToWrite> &evs, uint64_t logLevel = 1);
 bool deleteEventBasic(lmdb::txn &txn, uint64_t levId);
 
+
+// Per-environment count of event deletions in this process. Caches built from query results record
+// it before taking their snapshot, and treat any change as invalidation.
+//
+// deleteEventBasic() bumps it, but that happens before the txn commits, so a snapshot taken in
+// between could still see the deleted event. Writers therefore bump it again after committing.
+
+struct DeleteGenerations {
+    uint64_t get(MDB_env *e) {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto it = generations.find(e);
+        return it == generations.end() ? 0 : it->second;
+    }
+
+    void bump(MDB_env *e) {
+        std::lock_guard<std::mutex> guard(mutex);
+        generations[e]++;
+    }
+
+  private:
+    std::mutex mutex;
+    flat_hash_map<MDB_env*, uint64_t> generations;
+};
+
+extern DeleteGenerations deleteGenerations;
+
 template <typename C>
 uint64_t deleteEvents(lmdb::txn &txn, NegentropyFilterCache &neFilterCache, const C &levIds) {
     uint64_t numDeleted = 0;
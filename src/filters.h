@@ -21,7 +21,7 @@ struct FilterSetBytes {
         std::vector<std::string> arr;
 
         for (const auto &i : arrHex.get_array()) {
-            arr.emplace_back(hexDecode ? from_hex(i.get_string(), false) : i.get_string());
+            arr.emplace_back(hexDecode ? ::hexDecode(i.get_string()) : i.get_string());
             size_t itemSize = arr.back().size();
             if (itemSize < minSize) throw herr("filter item too small");
             if (itemSize > maxSize) throw herr("filter item too large");
@@ -201,7 +201,7 @@ struct NostrFilter {
         return true;
     }
 
-    bool isFullDbQuery() {
+    bool isFullDbQuery() const {
         return !ids && !authors && !kinds && tags.size() == 0;
     }
 };
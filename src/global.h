@@ -10,6 +10,11 @@ using namespace phmap;
 
 
 std::string renderIP(std::string_view ipBytes);
+std::string hexEncode(std::string_view input);
+std::string hexDecode(std::string_view input); // strict: throws on odd length or non-hex chars
+std::vector<std::string> hexImplNames(); // codecs usable on this CPU, fastest first (for tests)
+std::string hexEncodeWith(std::string_view impl, std::string_view input);
+std::string hexDecodeWith(std::string_view impl, std::string_view input);
 std::string renderSize(uint64_t si);
 std::string renderPercent(double p);
 uint64_t parseUint64(const std::string &s);
@@ -17,4 +22,6 @@ std::string parseIP(const std::string &ip);
 uint64_t getDBVersion(lmdb::txn &txn);
 void exitOnSigPipe();
 
-extern lmdb::dbi negentropyDbi;
+// Must be called with a write txn on each environment before its negentropy trees are used
+void setupNegentropyDbi(lmdb::txn &txn);
+lmdb::dbi getNegentropyDbi(lmdb::txn &txn);
@@ -0,0 +1,239 @@
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "golpe.h"
+
+
+// Hex codecs for ids, pubkeys, sigs, tags and negentropy payloads
+//
+// Output is lower-case. Input may be upper or lower-case, but anything else (including a 0x prefix)
+// is rejected. On x86-64 an SSSE3 or AVX2 implementation is selected at runtime, and the scalar
+// code handles the tails.
+
+namespace {
+
+const char *hexChars = "0123456789abcdef";
+
+struct DecodeTable {
+    uint8_t t[256];
+
+    DecodeTable() {
+        for (int i = 0; i < 256; i++) t[i] = 0xFF;
+        for (int i = 0; i < 10; i++) t['0' + i] = i;
+        for (int i = 0; i < 6; i++) t['a' + i] = t['A' + i] = 10 + i;
+    }
+};
+
+const DecodeTable decodeTable;
+
+void encodeScalar(const uint8_t *in, size_t n, char *out) {
+    for (size_t i = 0; i < n; i++) {
+        out[i*2] = hexChars[in[i] >> 4];
+        out[i*2 + 1] = hexChars[in[i] & 0x0F];
+    }
+}
+
+// n is the number of output bytes. Returns false if any input char is invalid
+bool decodeScalar(const char *in, size_t n, uint8_t *out) {
+    uint8_t bad = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint8_t hi = decodeTable.t[uint8_t(in[i*2])];
+        uint8_t lo = decodeTable.t[uint8_t(in[i*2 + 1])];
+        bad |= hi | lo;
+        out[i] = (hi << 4) | (lo & 0x0F);
+    }
+
+    return !(bad & 0x80);
+}
+
+
+#if defined(__x86_64__)
+
+__attribute__((target("ssse3")))
+void encodeSSSE3(const uint8_t *in, size_t n, char *out) {
+    const __m128i lut = _mm_loadu_si128((const __m128i*)hexChars);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+        _mm_storeu_si128((__m128i*)(out + i*2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + i*2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+
+    encodeScalar(in + i, n - i, out + i*2);
+}
+
+// Converts 16 hex chars to nibbles, setting bad to non-zero if any are invalid
+__attribute__((target("ssse3")))
+inline __m128i nibblesSSSE3(__m128i c, __m128i &bad) {
+    __m128i d = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    __m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l);
+
+    bad = _mm_or_si128(bad, _mm_andnot_si128(_mm_or_si128(isDigit, isLetter), _mm_set1_epi8(-1)));
+
+    return _mm_or_si128(_mm_and_si128(isDigit, d), _mm_and_si128(isLetter, _mm_add_epi8(l, _mm_set1_epi8(10))));
+}
+
+__attribute__((target("ssse3")))
+bool decodeSSSE3(const char *in, size_t n, uint8_t *out) {
+    const __m128i weights = _mm_set1_epi16(0x0110); // high nibble * 16 + low nibble
+    __m128i bad = _mm_setzero_si128();
+
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = nibblesSSSE3(_mm_loadu_si128((const __m128i*)(in + i*2)), bad);
+        __m128i b = nibblesSSSE3(_mm_loadu_si128((const __m128i*)(in + i*2 + 16)), bad);
+        __m128i v = _mm_packus_epi16(_mm_maddubs_epi16(a, weights), _mm_maddubs_epi16(b, weights));
+        _mm_storeu_si128((__m128i*)(out + i), v);
+    }
+
+    if (_mm_movemask_epi8(bad)) return false;
+
+    return decodeScalar(in + i*2, n - i, out + i);
+}
+
+__attribute__((target("avx2")))
+void encodeAVX2(const uint8_t *in, size_t n, char *out) {
+    const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hexChars));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+        __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+
+        // unpack works within 128-bit lanes, so put the lanes back in order
+        __m256i a = _mm256_unpacklo_epi8(hi, lo);
+        __m256i b = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i*)(out + i*2), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i*)(out + i*2 + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+
+    encodeSSSE3(in + i, n - i, out + i*2);
+}
+
+__attribute__((target("avx2")))
+inline __m256i nibblesAVX2(__m256i c, __m256i &bad) {
+    __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    __m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+    __m256i isLetter = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+
+    bad = _mm256_or_si256(bad, _mm256_andnot_si256(_mm256_or_si256(isDigit, isLetter), _mm256_set1_epi8(-1)));
+
+    return _mm256_or_si256(_mm256_and_si256(isDigit, d), _mm256_and_si256(isLetter, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+}
+
+__attribute__((target("avx2")))
+bool decodeAVX2(const char *in, size_t n, uint8_t *out) {
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    __m256i bad = _mm256_setzero_si256();
+
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = nibblesAVX2(_mm256_loadu_si256((const __m256i*)(in + i*2)), bad);
+        __m256i b = nibblesAVX2(_mm256_loadu_si256((const __m256i*)(in + i*2 + 32)), bad);
+        __m256i v = _mm256_packus_epi16(_mm256_maddubs_epi16(a, weights), _mm256_maddubs_epi16(b, weights));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(v, 0xD8)); // pack works within lanes too
+    }
+
+    if (_mm256_movemask_epi8(bad)) return false;
+
+    return decodeSSSE3(in + i*2, n - i, out + i);
+}
+
+#endif
+
+
+struct HexImpl {
+    std::string_view name;
+    void (*encode)(const uint8_t *in, size_t n, char *out);
+    bool (*decode)(const char *in, size_t n, uint8_t *out);
+};
+
+// Fastest first
+std::vector<HexImpl> supportedHexImpls() {
+    std::vector<HexImpl> impls;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) impls.push_back(HexImpl{ "avx2", encodeAVX2, decodeAVX2 });
+    if (__builtin_cpu_supports("ssse3")) impls.push_back(HexImpl{ "ssse3", encodeSSSE3, decodeSSSE3 });
+#endif
+
+    impls.push_back(HexImpl{ "scalar", encodeScalar, decodeScalar });
+
+    return impls;
+}
+
+const HexImpl &hexImpl() {
+    static const HexImpl impl = supportedHexImpls().front();
+    return impl;
+}
+
+const HexImpl &hexImplByName(std::string_view name) {
+    static const std::vector<HexImpl> impls = supportedHexImpls();
+
+    for (auto &impl : impls) {
+        if (impl.name == name) return impl;
+    }
+
+    throw herr("hex implementation not supported on this CPU: ", name);
+}
+
+std::string encodeWith(const HexImpl &impl, std::string_view input) {
+    std::string output(input.size() * 2, '\0');
+    impl.encode((const uint8_t*)input.data(), input.size(), output.data());
+    return output;
+}
+
+std::string decodeWith(const HexImpl &impl, std::string_view input) {
+    if (input.size() % 2) throw herr("odd-length hex string");
+
+    std::string output(input.size() / 2, '\0');
+    if (!impl.decode(input.data(), output.size(), (uint8_t*)output.data())) throw herr("invalid character in hex string");
+    return output;
+}
+
+}
+
+
+std::string hexEncode(std::string_view input) {
+    return encodeWith(hexImpl(), input);
+}
+
+std::string hexDecode(std::string_view input) {
+    return decodeWith(hexImpl(), input);
+}
+
+std::vector<std::string> hexImplNames() {
+    std::vector<std::string> names;
+    for (auto &impl : supportedHexImpls()) names.emplace_back(impl.name);
+    return names;
+}
+
+std::string hexEncodeWith(std::string_view impl, std::string_view input) {
+    return encodeWith(hexImplByName(impl), input);
+}
+
+std::string hexDecodeWith(std::string_view impl, std::string_view input) {
+    return decodeWith(hexImplByName(impl), input);
+}
@@ -3,8 +3,12 @@
 #include <string.h>
 #include <errno.h>
 
+#include <mutex>
+
 #include "golpe.h"
 
+#include "events.h"
+
 #include <negentropy/storage/BTreeLMDB.h>
 
 
@@ -25,7 +29,7 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
 
     if (!s) {
         env.insert_Meta(txn, CURR_DB_VERSION, 1, 1);
-        env.insert_NegentropyFilter(txn, "{}");
+        env.insert_NegentropyFilter(txn, "{}", 0, 0);
         return;
     }
 
@@ -33,6 +37,14 @@ static void dbCheck(lmdb::txn &txn, const std::string &cmd) {
 
     if (s->dbVersion() < CURR_DB_VERSION) {
         if (cmd == "export" || cmd == "info") return;
+
+        if (s->dbVersion() == 3) {
+            LI << "Upgrading DB version 3 to " << CURR_DB_VERSION << ": building id prefix index";
+            backfillIdPrefixIndex(txn);
+            env.update_Meta(txn, *s, { .dbVersion = CURR_DB_VERSION });
+            return;
+        }
+
         dbTooOld(s->dbVersion());
     }
 
@@ -68,12 +80,31 @@ static void setRLimits() {
 }
 
 
-lmdb::dbi negentropyDbi;
+// dbi handles are per environment: a tenant DB that was created in a different order, or that
+// was opened after the negentropy table of another DB, can't use the default DB's handle
+
+static std::mutex negentropyDbisMutex;
+static flat_hash_map<MDB_env*, MDB_dbi> negentropyDbis;
+
+void setupNegentropyDbi(lmdb::txn &txn) {
+    auto dbi = negentropy::storage::BTreeLMDB::setupDB(txn, "negentropy");
+
+    std::lock_guard<std::mutex> guard(negentropyDbisMutex);
+    negentropyDbis[mdb_txn_env(txn.handle())] = dbi.handle();
+}
+
+lmdb::dbi getNegentropyDbi(lmdb::txn &txn) {
+    std::lock_guard<std::mutex> guard(negentropyDbisMutex);
+
+    auto it = negentropyDbis.find(mdb_txn_env(txn.handle()));
+    if (it == negentropyDbis.end()) throw herr("negentropy table not set up for this DB");
+    return lmdb::dbi(it->second);
+}
 
 void onAppStartup(lmdb::txn &txn, const std::string &cmd) {
     dbCheck(txn, cmd);
 
     setRLimits();
 
-    negentropyDbi = negentropy::storage::BTreeLMDB::setupDB(txn, "negentropy");
+    setupNegentropyDbi(txn);
 }
@@ -0,0 +1,261 @@
+#!/usr/bin/env perl
+
+## Connects clients that stop reading while a large REQ is being sent, and checks the relay's
+## back-pressure: with only a soft limit the REQ is paused and then resumes once the client reads
+## again, and with a hard limit the client is sent a NOTICE and closed.
+
+use strict;
+
+use Carp;
+$SIG{ __DIE__ } = \&Carp::confess;
+
+use Socket;
+use MIME::Base64;
+use Digest::SHA qw(sha256_hex);
+
+
+my $numEvents = 4000;
+my $contentSize = 4000;
+
+my $soft = { name => 'soft', cfg => 'test/cfgs/backpressureTest.conf', port => 40571, };
+my $hard = { name => 'hard', cfg => 'test/cfgs/backpressureTestHard.conf', port => 40572, };
+
+my @pids;
+END { kill 'KILL', $_ for @pids; }
+
+
+system("rm -rf strfry-db-test-bp");
+system("mkdir -p strfry-db-test-bp/tenants/default");
+
+## Signatures aren't checked with --no-verify, so the events only need unique ids
+
+{
+    open(my $fh, '|-', "./strfry --config test/cfgs/backpressureTestTenant.conf import --no-verify 2>/dev/null") || die "$!";
+
+    my $now = time();
+
+    for my $i (1..$numEvents) {
+        my $id = sha256_hex("backpressure test $i $$");
+        printf $fh '{"id":"%s","pubkey":"%s","created_at":%d,"kind":1,"tags":[],"content":"%s","sig":"%s"}' . "\n",
+                   $id, 'a' x 64, $now - $i, 'x' x $contentSize, '0' x 128;
+    }
+
+    close($fh);
+}
+
+
+print "* A paused REQ resumes once the client reads again, and reaches EOSE\n";
+
+{
+    startRelay($soft);
+
+    my $ws = wsConnect($soft);
+    wsSend($ws, qq{["REQ","sub1",{"kinds":[1],"limit":$numEvents}]});
+
+    sleep 2;
+    die "connection wasn't throttled while the client wasn't reading" if getMetric($soft, 'strfry_backpressure_throttled_connections') != 1;
+
+    my ($numReceived, $gotEose) = (0, 0);
+
+    while (my $frame = wsRead($ws)) {
+        die "unexpected message: $frame->[1]" if $frame->[0] != 1 || $frame->[1] =~ /^\["NOTICE"/;
+
+        if ($frame->[1] =~ /^\["EVENT","sub1",/) {
+            $numReceived++;
+        } elsif ($frame->[1] eq '["EOSE","sub1"]') {
+            $gotEose = 1;
+            last;
+        }
+    }
+
+    die "got EOSE after $numReceived events, expected $numEvents" if !$gotEose || $numReceived != $numEvents;
+    die "connection still throttled" if getMetric($soft, 'strfry_backpressure_throttled_connections') != 0;
+    die "connection was dropped" if getMetric($soft, 'strfry_backpressure_dropped_total') != 0;
+
+    close($ws->{sock});
+    stopRelay($soft);
+}
+
+
+print "* A client that doesn't read is sent a NOTICE and closed at the hard limit\n";
+
+{
+    startRelay($hard);
+
+    my $ws = wsConnect($hard);
+    wsSend($ws, qq{["REQ","sub1",{"kinds":[1],"limit":$numEvents}]});
+
+    sleep 2;
+
+    my ($numReceived, $gotNotice, $gotClose) = (0, 0, 0);
+
+    while (my $frame = wsRead($ws)) {
+        if ($frame->[0] == 8) {
+            $gotClose = 1;
+            last;
+        }
+
+        if ($frame->[1] =~ /^\["EVENT","sub1",/) {
+            die "EVENT after NOTICE" if $gotNotice;
+            $numReceived++;
+        } elsif ($frame->[1] =~ /^\["NOTICE","ERROR: slow consumer, send buffer limit exceeded"\]$/) {
+            $gotNotice = 1;
+        } else {
+            die "unexpected message: $frame->[1]";
+        }
+    }
+
+    die "no NOTICE before close" if !$gotNotice;
+    die "connection wasn't closed" if !$gotClose && !$ws->{eof};
+    die "all events were sent" if $numReceived >= $numEvents;
+    die "drop wasn't counted" if getMetric($hard, 'strfry_backpressure_dropped_total') != 1;
+
+    close($ws->{sock});
+    stopRelay($hard);
+}
+
+
+print "\nOK\n";
+
+
+
+## Minimal websocket client. A small receive buffer makes the relay's send buffer fill up sooner
+
+sub wsConnect {
+    my $target = shift;
+
+    socket(my $sock, PF_INET, SOCK_STREAM, getprotobyname('tcp')) || die "socket: $!";
+    setsockopt($sock, SOL_SOCKET, SO_RCVBUF, 4096) || die "setsockopt: $!";
+    connect($sock, pack_sockaddr_in($target->{port}, inet_aton('127.0.0.1'))) || die "connect: $!";
+    binmode($sock);
+
+    my $key = encode_base64(join('', map { chr(int(rand(256))) } 1..16), '');
+
+    syswrite($sock, "GET / HTTP/1.1\r\nHost: 127.0.0.1:$target->{port}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                  . "Sec-WebSocket-Key: $key\r\nSec-WebSocket-Version: 13\r\n\r\n");
+
+    ## One byte at a time, so no frames are read along with the response
+    my $resp = '';
+    while ($resp !~ /\r\n\r\n$/) {
+        sysread($sock, $resp, 1, length($resp)) || die "handshake failed: $resp";
+    }
+
+    die "handshake failed: $resp" if $resp !~ m{^HTTP/1\.1 101};
+
+    return { sock => $sock, buf => '', eof => 0, };
+}
+
+sub wsSend {
+    my ($ws, $msg) = @_;
+
+    my $len = length($msg);
+    my $mask = pack('N', int(rand(2**32)));
+
+    my $frame = chr(0x81);
+    if ($len < 126) { $frame .= chr(0x80 | $len); }
+    elsif ($len < 65536) { $frame .= chr(0x80 | 126) . pack('n', $len); }
+    else { $frame .= chr(0x80 | 127) . pack('Q>', $len); }
+
+    $frame .= $mask . ($msg ^ substr($mask x (int($len / 4) + 1), 0, $len));
+
+    syswrite($ws->{sock}, $frame) == length($frame) || die "short write";
+}
+
+## Returns [opcode, payload], or undef once the relay has closed the connection
+
+sub wsRead {
+    my $ws = shift;
+
+    while (1) {
+        my $frame = parseFrame($ws);
+        next if $frame && ($frame->[0] == 9 || $frame->[0] == 10); ## auto-pings
+        return $frame if $frame;
+        return undef if $ws->{eof};
+
+        my $rin = '';
+        vec($rin, fileno($ws->{sock}), 1) = 1;
+        select(my $rout = $rin, undef, undef, 10) || die "timed out waiting for relay";
+
+        my $n = sysread($ws->{sock}, $ws->{buf}, 65536, length($ws->{buf}));
+        $ws->{eof} = 1 if !$n;
+    }
+}
+
+sub parseFrame {
+    my $ws = shift;
+    my $buf = \$ws->{buf};
+
+    return undef if length($$buf) < 2;
+
+    my ($b0, $b1) = unpack('CC', $$buf);
+    my $len = $b1 & 0x7f;
+    my $offset = 2;
+
+    if ($len == 126) {
+        return undef if length($$buf) < 4;
+        $len = unpack('n', substr($$buf, 2, 2));
+        $offset = 4;
+    } elsif ($len == 127) {
+        return undef if length($$buf) < 10;
+        $len = unpack('Q>', substr($$buf, 2, 8));
+        $offset = 10;
+    }
+
+    return undef if length($$buf) < $offset + $len;
+
+    my $payload = substr($$buf, $offset, $len);
+    substr($$buf, 0, $offset + $len) = '';
+
+    return [ $b0 & 0x0f, $payload ];
+}
+
+sub getMetric {
+    my ($target, $name) = @_;
+
+    socket(my $sock, PF_INET, SOCK_STREAM, getprotobyname('tcp')) || die "socket: $!";
+    connect($sock, pack_sockaddr_in($target->{port}, inet_aton('127.0.0.1'))) || die "connect: $!";
+
+    syswrite($sock, "GET /metrics HTTP/1.1\r\nHost: 127.0.0.1:$target->{port}\r\nConnection: close\r\n\r\n");
+
+    my $resp = '';
+
+    while (1) {
+        if ($resp =~ /\r\n\r\n/ && $resp =~ /^Content-Length: (\d+)/mi) {
+            my $len = $1;
+            last if length($resp) - (index($resp, "\r\n\r\n") + 4) >= $len;
+        }
+
+        my $rin = '';
+        vec($rin, fileno($sock), 1) = 1;
+        select(my $rout = $rin, undef, undef, 5) || die "timed out waiting for metrics";
+
+        sysread($sock, $resp, 65536, length($resp)) || last;
+    }
+
+    close($sock);
+
+    die "metric $name not found" if $resp !~ /^\Q$name\E (\d+)/m;
+    return $1;
+}
+
+sub startRelay {
+    my $target = shift;
+
+    my $pid = fork();
+
+    if (!$pid) {
+        exec("./strfry --config $target->{cfg} relay 2>/dev/null") || die "couldn't exec strfry";
+    }
+
+    $target->{pid} = $pid;
+    push @pids, $pid;
+    sleep 1; ## FIXME
+}
+
+sub stopRelay {
+    my $target = shift;
+
+    kill 'KILL', $target->{pid};
+    waitpid($target->{pid}, 0);
+    @pids = grep { $_ != $target->{pid} } @pids;
+}
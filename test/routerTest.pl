@@ -0,0 +1,261 @@
+#!/usr/bin/env perl
+
+## Runs two upstream relays and a router connected to both, and checks which events end up where.
+## Needs nostril to create events.
+
+use strict;
+
+use Carp;
+$SIG{ __DIE__ } = \&Carp::confess;
+
+use JSON::XS;
+
+
+my $sec = 'c1eee22f68dc218d98263cfecb350db6fc6b3e836b47423b66c62af7ae3e32bb';
+
+my $up1 = { name => 'up1', url => 'ws://127.0.0.1:40561/', relayCfg => 'test/cfgs/routerTestUp1.conf', dbCfg => 'test/cfgs/routerTestUp1Tenant.conf', };
+my $up2 = { name => 'up2', url => 'ws://127.0.0.1:40562/', relayCfg => 'test/cfgs/routerTestUp2.conf', dbCfg => 'test/cfgs/routerTestUp2Tenant.conf', };
+my $router = { name => 'router', dbCfg => 'test/cfgs/routerTest.conf', };
+
+my $routerConfigFile = 'strfry-router-test.config';
+my $eventCounter = 0;
+
+my @pids;
+END { kill 'KILL', $_ for @pids; }
+
+
+system("rm -rf strfry-db-test-up1 strfry-db-test-up2 strfry-db-test-router");
+system("mkdir -p strfry-db-test-up1/tenants/default strfry-db-test-up2/tenants/default strfry-db-test-router");
+
+startRelay($up1);
+startRelay($up2);
+
+writeRouterConfig(qq{
+    notes {
+        dir = "down"
+        filter = { "kinds": [1] }
+        urls = [ "$up1->{url}", "$up2->{url}" ]
+    }
+
+    reactions {
+        dir = "down"
+        filter = { "kinds": [7] }
+        urls = [ "$up1->{url}" ]
+    }
+});
+
+startRouter();
+
+
+print "* Each stream group's REQ only delivers to its own group\n";
+
+{
+    my $note1 = addEvent($up1, 1);
+    my $reaction1 = addEvent($up1, 7);
+    my $other1 = addEvent($up1, 2);
+    my $note2 = addEvent($up2, 1);
+    my $reaction2 = addEvent($up2, 7);
+
+    waitFor($router, [$note1, $reaction1, $note2]);
+    assertMissing($router, [$other1, $reaction2]);
+}
+
+
+print "* Events for a removed stream group are ignored\n";
+
+{
+    writeRouterConfig(qq{
+        notes {
+            dir = "down"
+            filter = { "kinds": [1] }
+            urls = [ "$up1->{url}", "$up2->{url}" ]
+        }
+    });
+
+    sleep 2;
+
+    my $reaction = addEvent($up1, 7);
+    my $note = addEvent($up1, 1);
+
+    waitFor($router, [$note]);
+    assertMissing($router, [$reaction]);
+}
+
+
+print "* Uploads go to the urls of every stream group whose filter matches\n";
+
+{
+    writeRouterConfig(qq{
+        upNotes {
+            dir = "up"
+            filter = { "kinds": [1] }
+            urls = [ "$up1->{url}", "$up2->{url}" ]
+        }
+
+        upReactions {
+            dir = "up"
+            filter = { "kinds": [7] }
+            urls = [ "$up1->{url}" ]
+        }
+
+        downOnly {
+            dir = "down"
+            filter = { "kinds": [2] }
+            urls = [ "$up1->{url}" ]
+        }
+    });
+
+    sleep 2;
+
+    my $note = addEvent($router, 1);
+    my $reaction = addEvent($router, 7);
+    my $other = addEvent($router, 2);
+    my $unmatched = addEvent($router, 3);
+
+    waitFor($up1, [$note, $reaction]);
+    waitFor($up2, [$note]);
+    assertMissing($up1, [$other, $unmatched]);
+    assertMissing($up2, [$reaction, $other, $unmatched]);
+}
+
+
+print "* A changed filter replaces the stream group's monitor\n";
+
+{
+    writeRouterConfig(qq{
+        upNotes {
+            dir = "up"
+            filter = { "kinds": [1] }
+            urls = [ "$up1->{url}", "$up2->{url}" ]
+        }
+
+        upReactions {
+            dir = "up"
+            filter = { "kinds": [6] }
+            urls = [ "$up1->{url}" ]
+        }
+    });
+
+    sleep 2;
+
+    my $reaction = addEvent($router, 7);
+    my $repost = addEvent($router, 6);
+
+    waitFor($up1, [$repost]);
+    assertMissing($up1, [$reaction]);
+}
+
+
+print "* Uploads resume after a relay restarts\n";
+
+{
+    writeRouterConfig(qq{
+        upload {
+            dir = "up"
+            filter = { "kinds": [1] }
+            urls = [ "$up2->{url}" ]
+        }
+    });
+
+    sleep 2;
+
+    my $before = addEvent($router, 1);
+    waitFor($up2, [$before]);
+
+    stopRelay($up2);
+    my $during = addEvent($router, 1);
+    sleep 1;
+    startRelay($up2);
+
+    my $after = addEvent($router, 1);
+    waitFor($up2, [$during, $after]);
+}
+
+
+print "\nOK\n";
+
+
+
+sub addEvent {
+    my ($target, $kind) = @_;
+
+    $eventCounter++;
+    my $eventJson = `nostril --sec $sec --kind $kind --content "router test $eventCounter $$"`;
+    my $id = decode_json($eventJson)->{id};
+
+    open(my $fh, '|-', "./strfry --config $target->{dbCfg} import 2>/dev/null") || die "$!";
+    print $fh $eventJson;
+    close($fh);
+
+    return $id;
+}
+
+sub haveIds {
+    my ($target, $ids) = @_;
+
+    my $filter = encode_json({ ids => $ids });
+    my $count = `./strfry --config $target->{dbCfg} scan --count '$filter' 2>/dev/null`;
+    chomp $count;
+
+    return $count == @$ids;
+}
+
+sub waitFor {
+    my ($target, $ids) = @_;
+
+    for (1..100) {
+        return if haveIds($target, $ids);
+        select(undef, undef, undef, 0.1);
+    }
+
+    die "events didn't arrive at $target->{name}: @$ids";
+}
+
+sub assertMissing {
+    my ($target, $ids) = @_;
+
+    for my $id (@$ids) {
+        die "unexpected event at $target->{name}: $id" if haveIds($target, [$id]);
+    }
+}
+
+sub writeRouterConfig {
+    my $streams = shift;
+
+    open(my $fh, '>', $routerConfigFile) || die "$!";
+    print $fh "connectionTimeout = 1\n\nstreams {\n$streams\n}\n";
+    close($fh);
+}
+
+sub startRelay {
+    my $target = shift;
+
+    my $pid = fork();
+
+    if (!$pid) {
+        exec("./strfry --config $target->{relayCfg} relay 2>/dev/null") || die "couldn't exec strfry";
+    }
+
+    $target->{pid} = $pid;
+    push @pids, $pid;
+    sleep 1; ## FIXME
+}
+
+sub stopRelay {
+    my $target = shift;
+
+    kill 'KILL', $target->{pid};
+    waitpid($target->{pid}, 0);
+    @pids = grep { $_ != $target->{pid} } @pids;
+}
+
+sub startRouter {
+    my $pid = fork();
+
+    if (!$pid) {
+        exec("./strfry --config $router->{dbCfg} router $routerConfigFile 2>/dev/null") || die "couldn't exec strfry";
+    }
+
+    push @pids, $pid;
+    sleep 2; ## FIXME: wait for connections
+}
@@ -33,6 +33,40 @@ use strict;
     test(qq{ 1 1 1200 '$f' }, 100000);
 }
 
+## Sync tests with the time range split into sub-ranges, reconciled in parallel
+{
+    my $args = q{--sync-args='--ranges=4 --parallel=2'};
+
+    for my $f ('{}', '{"kinds":[1]}') {
+        test(qq{ $args 1 0 0 '$f' });
+        test(qq{ $args 0 1 0 '$f' });
+        test(qq{ $args 1 1 1000 '$f' });
+    }
+
+    my $f = '{"since":1652985767,"until":1662969916}';
+    test(qq{ $args 1 1 1000 '$f' }, 100000);
+}
+
+## Sync tests against two relays, where each event only they have is downloaded once
+{
+    for my $f ('{}', '{"kinds":[1]}') {
+        test(qq{ --relays=2 1 0 0 '$f' });
+        test(qq{ --relays=2 1 1 1000 '$f' }, 100000);
+    }
+
+    test(qq{ --relays=2 --sync-args='--ranges=4 --parallel=2' 1 1 1000 '{}' }, 100000);
+}
+
+## Interrupted sync tests: each stops the relay part way through and re-runs the sync, either resuming
+## from the checkpoint or starting over with --fresh
+{
+    my $args = q{--sync-args='--ranges=8'};
+    my $f = '{}';
+
+    test(qq{ --interrupt $args 1 1 100 '$f' }, 100000);
+    test(qq{ --fresh $args 1 1 100 '$f' }, 100000);
+}
+
 
 print "All OK\n";
 
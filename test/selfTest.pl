@@ -0,0 +1,30 @@
+#!/usr/bin/env perl
+
+use strict;
+
+use Carp;
+$SIG{ __DIE__ } = \&Carp::confess;
+
+
+system("mkdir -p strfry-db-test");
+
+
+print "* Cold segment short write\n";
+
+{
+    my $out = `./strfry --config test/cfgs/selfTest.conf selftest cold-short-write 2>&1`;
+    die "cold-short-write failed:\n$out" if $? != 0 || $out !~ /^OK$/m;
+}
+
+
+print "* Hex codecs against scalar\n";
+
+for my $seed (1..5) {
+    my $out = `./strfry --config test/cfgs/selfTest.conf selftest hex --seed $seed 2>&1`;
+    die "hex (seed $seed) failed:\n$out" if $? != 0 || $out !~ /^OK$/m;
+    die "scalar codec not tested:\n$out" if $out !~ /hex scalar: ok/;
+    if ($seed == 1) { print "  $_\n" for $out =~ /(hex \w+: ok)/g; }
+}
+
+
+print "\nOK\n";
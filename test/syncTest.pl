@@ -1,9 +1,33 @@
 #!/usr/bin/env perl
 
 ## zstdcat ../nostr-dumps/nostr-wellorder-early-500k-v1.jsonl.zst | head -100000 | perl test/syncTest.pl 1 1 10000 '{}'
+##
+## Options, before the probabilities:
+##   --sync-args=<args>  Extra arguments for the sync command, eg '--ranges=4 --parallel=2'
+##   --interrupt         Stop the relay once the sync starts downloading, then restart it and re-run the
+##                       same command, which must resume from the checkpoint
+##   --fresh             As --interrupt, but re-run with --fresh, which must start over
+##   --relays=2          Sync against two relays. Events that only the relays have are given to one or
+##                       both of them, and each must be downloaded just once
 
 use strict;
 
+use Getopt::Long;
+
+my $syncArgs = '';
+my $interrupt;
+my $fresh;
+my $numRelays = 1;
+
+GetOptions(
+    "sync-args=s" => \$syncArgs,
+    "interrupt" => \$interrupt,
+    "fresh" => \$fresh,
+    "relays=i" => \$numRelays,
+) || die "bad options";
+
+die "--relays must be 1 or 2" if $numRelays < 1 || $numRelays > 2;
+
 my $prob1 = shift // 1;
 my $prob2 = shift // 1;
 my $prob3 = shift // 98;
@@ -17,70 +41,190 @@ my $filter = shift // '{}';
     $prob3 = $prob3 / $total;
 }
 
-srand($ENV{SEED} || 0);
-system("mkdir -p strfry-db-test-1 strfry-db-test-2");
-system("rm -f strfry-db-test-1/data.mdb strfry-db-test-2/data.mdb");
+## Relays serve their default tenant, so events for them are imported into (and exported from) that DB
+
+my @relays = (
+    { cfg => 'test/cfgs/syncTest1.conf', dbCfg => 'test/cfgs/syncTest1Tenant.conf', url => 'ws://127.0.0.1:40551', dir => 'strfry-db-test-1', },
+    { cfg => 'test/cfgs/syncTest3.conf', dbCfg => 'test/cfgs/syncTest3Tenant.conf', url => 'ws://127.0.0.1:40553', dir => 'strfry-db-test-3', },
+);
+splice(@relays, $numRelays);
 
+my $local = { dbCfg => 'test/cfgs/syncTest2.conf', };
+
+srand($ENV{SEED} || 0);
+system("rm -rf strfry-db-test-1 strfry-db-test-2 strfry-db-test-3");
+system("mkdir -p strfry-db-test-2");
+system("mkdir -p $_->{dir}/tenants/default") for @relays;
 
-my $ids1 = {};
-my $ids2 = {};
 
 {
-    open(my $infile1, '|-', "./strfry --config test/cfgs/syncTest1.conf import");
-    open(my $infile2, '|-', "./strfry --config test/cfgs/syncTest2.conf import");
+    my @relayFiles = map {
+        open(my $fh, '|-', "./strfry --config $_->{dbCfg} import") || die "$!";
+        $fh;
+    } @relays;
+
+    open(my $localFile, '|-', "./strfry --config $local->{dbCfg} import") || die "$!";
 
-    while (<STDIN>) {
-        /"id":"(\w+)"/ || next;
-        my $id = $1;
+    while (my $line = <STDIN>) {
+        $line =~ /"id":"(\w+)"/ || next;
 
         my $modeRnd = rand();
 
         if ($modeRnd < $prob1) {
-            print $infile1 $_;
-            $ids1->{$id} = 1;
+            ## Not in the local DB: with two relays, held by the first, the second, or both
+            my $which = @relays == 1 ? 0 : int(rand(3));
+            print { $relayFiles[0] } $line if $which != 1;
+            print { $relayFiles[1] } $line if $which != 0;
         } elsif ($modeRnd < $prob1 + $prob2) {
-            print $infile2 $_;
-            $ids2->{$id} = 1;
+            print $localFile $line;
         } else {
-            print $infile1 $_;
-            print $infile2 $_;
-            $ids1->{$id} = 1;
-            $ids2->{$id} = 1;
+            print { $_ } $line for @relayFiles, $localFile;
         }
     }
 }
 
+## Events the local DB should download, and how many of them more than one relay has
+
+my $numNeeds = 0;
+my $numSharedNeeds = 0;
+
+{
+    my $localIds = exportIds($local);
+    my %relayCounts;
+
+    for my $r (@relays) {
+        $relayCounts{$_}++ for grep { !$localIds->{$_} } keys %{ exportIds($r) };
+    }
+
+    $numNeeds = keys %relayCounts;
+    $numSharedNeeds = grep { $_ > 1 } values %relayCounts;
+}
+
+
+my @pids;
+END { kill 'KILL', $_ for @pids; }
+
+if ($interrupt || $fresh) {
+    startRelay($_) for @relays;
+    my $stopped;
+
+    my ($ok, $log) = runSync('', sub {
+        return if $stopped || $_[0] !~ /DOWN: \d+ events/;
+        stopRelay($_) for @relays;
+        $stopped = 1;
+    });
+
+    die "sync finished before it could be interrupted" if !$stopped;
+    die "interrupted sync didn't fail" if $ok;
+    die "interrupted sync didn't save a checkpoint" if $log !~ /Saved sync checkpoint/;
+
+    withRelays(sub {
+        my ($ok, $log) = runSync($fresh ? '--fresh' : '');
+        die "sync failed" if !$ok;
+
+        my $resumed = $log =~ /Resuming sync checkpointed/;
+        die "sync didn't resume from the checkpoint" if !$fresh && !$resumed;
+        die "sync resumed from the checkpoint despite --fresh" if $fresh && $resumed;
+    });
+} else {
+    withRelays(sub {
+        my ($ok, $log) = runSync('');
+        die "sync failed" if !$ok;
+
+        if (@relays > 1) {
+            die "no event was held by both relays, so this doesn't test anything" if !$numSharedNeeds;
+
+            my $numDownloaded = 0;
+            $numDownloaded += $1 while $log =~ /DOWN: (\d+) events/g;
+            die "downloaded $numDownloaded events, expected $numNeeds ($numSharedNeeds held by both relays)" if $numDownloaded != $numNeeds;
+        }
+    });
+}
 
-withRelay(sub {
-    system("./strfry --config test/cfgs/syncTest2.conf sync ws://127.0.0.1:40551 --dir both --filter '$filter'");
-});
+## The local DB ends up with every event the relays have, and the relays between them with every event the local DB has
 
-my $hash1 = `./strfry --config test/cfgs/syncTest1.conf export | perl test/dumbFilter.pl '$filter' | sort | sha256sum`;
-my $hash2 = `./strfry --config test/cfgs/syncTest2.conf export | perl test/dumbFilter.pl '$filter' | sort | sha256sum`;
+my $hashRelays = exportHash(@relays);
+my $hashLocal = exportHash($local);
 
-die "hashes differ" unless $hash1 eq $hash2;
+die "hashes differ" unless $hashRelays eq $hashLocal;
 
 print "OK.\n";
 
 
-sub withRelay {
+sub exportCmd {
+    my @targets = @_;
+    my $exports = join('; ', map { "./strfry --config $_->{dbCfg} export" } @targets);
+    return "( $exports ) | perl test/dumbFilter.pl '$filter'";
+}
+
+sub exportHash {
+    my $cmd = exportCmd(@_);
+    return `$cmd | sort -u | sha256sum`;
+}
+
+sub exportIds {
+    my $cmd = exportCmd(@_);
+    my $ids = {};
+
+    for (`$cmd`) {
+        $ids->{$1} = 1 if /"id":"(\w+)"/;
+    }
+
+    return $ids;
+}
+
+sub runSync {
+    my ($extraArgs, $onLine) = @_;
+
+    my $urls = join(' ', map { $_->{url} } @relays);
+
+    open(my $fh, '-|', "./strfry --config $local->{dbCfg} sync $urls --dir both --filter '$filter' $syncArgs $extraArgs 2>&1")
+        || die "couldn't run sync: $!";
+
+    my $log = '';
+
+    while (<$fh>) {
+        print STDERR $_;
+        $log .= $_;
+        $onLine->($_) if $onLine;
+    }
+
+    close($fh);
+
+    return ($? == 0, $log);
+}
+
+sub withRelays {
     my $cb = shift;
 
-    my $relayPid = startRelay();
+    startRelay($_) for @relays;
+
+    eval { $cb->() };
+    my $err = $@;
 
-    $cb->();
+    stopRelay($_) for @relays;
 
-    kill 'KILL', $relayPid;
-    wait;
+    die $err if $err;
 }
 
 sub startRelay {
+    my $target = shift;
+
     my $pid = fork();
 
     if (!$pid) {
-        exec("./strfry --config test/cfgs/syncTest1.conf relay") || die "couldn't exec strfry";
+        exec("./strfry --config $target->{cfg} relay") || die "couldn't exec strfry";
     }
 
+    $target->{pid} = $pid;
+    push @pids, $pid;
     sleep 1; ## FIXME
-    return $pid;
+}
+
+sub stopRelay {
+    my $target = shift;
+
+    kill 'KILL', $target->{pid};
+    waitpid($target->{pid}, 0);
+    @pids = grep { $_ != $target->{pid} } @pids;
 }